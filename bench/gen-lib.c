@@ -0,0 +1,37 @@
+// Generates the source of a synthetic library for bench-suite
+// usage: bench-gen-lib <output.c> <symbols> [level]
+// The library exports functions sym_0 ... sym_<symbols - 1>. With a level,
+// it also exports dep_<level>, which calls dep_<level - 1> from the library
+// one level down (if level > 1), so that it depends on that library.
+
+#include <stdio.h>
+#include <stdlib.h>
+
+int main(int argc, const char **argv)
+{
+    if (argc < 3)
+    {
+        fprintf(stderr, "usage: %s <output.c> <symbols> [level]\n", argv[0]);
+        return 2;
+    }
+    long symbols = atol(argv[2]), level = argc > 3 ? atol(argv[3]) : 0, i;
+    FILE *out = fopen(argv[1], "w");
+    if (!out)
+    {
+        perror(argv[1]);
+        return 1;
+    }
+    fprintf(out, "// generated by bench-gen-lib - do not edit\n");
+    for (i = 0; i < symbols; ++i)
+        fprintf(out, "int sym_%li(void) { return %li; }\n", i, i);
+    if (level > 1)
+        fprintf(out, "int dep_%li(void);\nint dep_%li(void) { return dep_%li() + 1; }\n", level - 1, level, level - 1);
+    else if (level == 1)
+        fprintf(out, "int dep_1(void) { return 1; }\n");
+    if (fclose(out) != 0)
+    {
+        perror(argv[1]);
+        return 1;
+    }
+    return 0;
+}
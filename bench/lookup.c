@@ -0,0 +1,81 @@
+// Compares the cost of symbol lookups through dlsym and through libdylib with
+// each lookup engine
+// usage: bench-lookup [library] [iterations]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "libdylib.h"
+
+#ifdef LIBDYLIB_UNIX
+    #include <dlfcn.h>
+#endif
+
+static const char *symbols[] = {
+    "malloc", "free", "printf", "fopen", "qsort", "getenv", "strtol", "memcpy",
+};
+#define NUM_SYMBOLS (sizeof(symbols) / sizeof(symbols[0]))
+
+static double now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void report(const char *name, double start, long iterations)
+{
+    printf("%-24s %8.1f ns/lookup\n", name, (now_ns() - start) / (iterations * (double)NUM_SYMBOLS));
+}
+
+static void bench_libdylib(const char *name, const char *path, int flags, long iterations, const char *missing)
+{
+    dylib_ref lib = libdylib_open_ex(path, flags);
+    long i;
+    size_t j;
+    if (!lib)
+    {
+        fprintf(stderr, "%s: %s\n", name, libdylib_last_error());
+        return;
+    }
+    double start = now_ns();
+    for (i = 0; i < iterations; ++i)
+    {
+        for (j = 0; j < NUM_SYMBOLS; ++j)
+            libdylib_lookup(lib, missing ? missing : symbols[j]);
+    }
+    report(name, start, iterations);
+    libdylib_close(lib);
+}
+
+int main(int argc, const char **argv)
+{
+    const char *path = argc > 1 ? argv[1] : "libc.so.6";
+    long iterations = argc > 2 ? atol(argv[2]) : 100000, i;
+    size_t j;
+    printf("%s, %li iterations of %i symbols\n", path, iterations, (int)NUM_SYMBOLS);
+
+#ifdef LIBDYLIB_UNIX
+    void *handle = dlopen(path, RTLD_LOCAL | RTLD_NOW);
+    if (handle)
+    {
+        double start = now_ns();
+        for (i = 0; i < iterations; ++i)
+        {
+            for (j = 0; j < NUM_SYMBOLS; ++j)
+                dlsym(handle, symbols[j]);
+        }
+        report("dlsym", start, iterations);
+        dlclose(handle);
+    }
+#endif
+
+    bench_libdylib("lookup", path, 0, iterations, NULL);
+    bench_libdylib("lookup (cache)", path, LIBDYLIB_OPEN_CACHE, iterations, NULL);
+    bench_libdylib("lookup (elf)", path, LIBDYLIB_OPEN_ELF_LOOKUP, iterations, NULL);
+    bench_libdylib("miss", path, 0, iterations, "no_such_symbol");
+    bench_libdylib("miss (cache)", path, LIBDYLIB_OPEN_CACHE, iterations, "no_such_symbol");
+    bench_libdylib("miss (elf)", path, LIBDYLIB_OPEN_ELF_LOOKUP, iterations, "no_such_symbol");
+    return 0;
+}
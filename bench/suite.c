@@ -0,0 +1,484 @@
+// Benchmarks libdylib against the synthetic libraries generated by
+// bench-gen-lib, and prints the results as JSON
+// usage: bench-suite [library directory] [iteration scale]
+
+#ifdef __linux__
+    #define _GNU_SOURCE // for dladdr()
+#endif
+#include <dlfcn.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "libdylib.h"
+
+#ifndef BENCH_LIB_PREFIX
+    #define BENCH_LIB_PREFIX "lib"
+#endif
+#ifndef BENCH_LIB_SUFFIX
+    #define BENCH_LIB_SUFFIX ".so"
+#endif
+#ifndef BENCH_DEP_DEPTH
+    #define BENCH_DEP_DEPTH 8
+#endif
+
+#define NUM_NAMES 1000
+#define NUM_THREADS_MAX 64
+
+static const char *dir = ".";
+static double scale = 1;
+static bool first_result = true;
+static char names[NUM_NAMES][16], missing_names[NUM_NAMES][16];
+
+static double now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static long iterations(long base)
+{
+    long n = (long)(base * scale);
+    return n > 0 ? n : 1;
+}
+
+static void report(const char *benchmark, const char *variant, double elapsed_ns, long ops)
+{
+    printf("%s\n    {\"benchmark\": \"%s\", \"variant\": \"%s\", \"ops\": %li, \"ns_per_op\": %.2f, \"ops_per_sec\": %.0f}",
+        first_result ? "" : ",", benchmark, variant, ops, elapsed_ns / ops, ops / (elapsed_ns / 1e9));
+    first_result = false;
+}
+
+static const char *lib_path(const char *name)
+{
+    static char path[1024];
+    snprintf(path, sizeof(path), "%s/" BENCH_LIB_PREFIX "%s" BENCH_LIB_SUFFIX, dir, name);
+    return path;
+}
+
+static dylib_ref open_or_die(const char *name, int flags)
+{
+    dylib_ref lib = libdylib_open_ex(lib_path(name), flags);
+    if (!lib)
+    {
+        fprintf(stderr, "%s: %s\n", name, libdylib_last_error());
+        exit(1);
+    }
+    return lib;
+}
+
+static void bench_open_close(const char *name, long n)
+{
+    const char *path = lib_path(name);
+    long i;
+    double start = now_ns();
+    for (i = 0; i < n; ++i)
+        libdylib_close(libdylib_open(path));
+    report("open_close", name, now_ns() - start, n);
+}
+
+static void bench_reopen(const char *name, long n)
+{
+    dylib_ref lib = open_or_die(name, 0);
+    const char *path = lib_path(name);
+    long i;
+    double start = now_ns();
+    for (i = 0; i < n; ++i)
+        libdylib_close(libdylib_open(path));
+    report("open_already_open", name, now_ns() - start, n);
+    libdylib_close(lib);
+}
+
+// loading an image that is already in memory, compared to extracting it to a
+// temporary file first
+static void bench_open_memory(const char *name, long n)
+{
+    FILE *f = fopen(lib_path(name), "rb");
+    if (!f || fseek(f, 0, SEEK_END) != 0)
+        exit(1);
+    size_t len = (size_t)ftell(f);
+    char *image = (char*)malloc(len);
+    rewind(f);
+    if (!image || fread(image, 1, len, f) != len)
+        exit(1);
+    fclose(f);
+    char tmp_path[1024];
+    snprintf(tmp_path, sizeof(tmp_path), "%s/bench-extract.so", dir);
+    long i;
+    double start = now_ns();
+    for (i = 0; i < n; ++i)
+    {
+        f = fopen(tmp_path, "wb");
+        if (!f || fwrite(image, 1, len, f) != len || fclose(f) != 0)
+            exit(1);
+        libdylib_close(libdylib_open(tmp_path));
+        remove(tmp_path);
+    }
+    report("open_memory", "temp_file", now_ns() - start, n);
+    start = now_ns();
+    for (i = 0; i < n; ++i)
+        libdylib_close(libdylib_open_memory(image, len, name));
+    report("open_memory", "memfd", now_ns() - start, n);
+    free(image);
+}
+
+// closing the dependency chain, opened one library at a time (dependencies
+// last), one by one or with a single close_many() - only closes are timed
+static void bench_close_many(long n)
+{
+    static const char *variants[] = {"close_each", "close_many", "fast_exit"};
+    dylib_ref libs[BENCH_DEP_DEPTH];
+    char name[64];
+    long i;
+    int j, batched;
+    // fast exits leave the libraries loaded, so they go last
+    for (batched = 0; batched < 3; ++batched)
+    {
+        double elapsed = 0;
+        for (i = 0; i < n; ++i)
+        {
+            for (j = 0; j < BENCH_DEP_DEPTH; ++j)
+            {
+                snprintf(name, sizeof(name), "bench-dep-%i", BENCH_DEP_DEPTH - j);
+                libs[j] = open_or_die(name, 0);
+            }
+            double start = now_ns();
+            if (batched)
+                libdylib_close_many_ex(libs, BENCH_DEP_DEPTH, batched == 2 ? LIBDYLIB_CLOSE_FAST_EXIT : 0);
+            else
+            {
+                for (j = BENCH_DEP_DEPTH - 1; j >= 0; --j)
+                    libdylib_close(libs[j]);
+            }
+            elapsed += now_ns() - start;
+        }
+        report("close_many", variants[batched], elapsed, n);
+    }
+}
+
+// opening and closing 4 copies of a library, in namespaces of their own -
+// compare with open_close of the same library (the synthetic libraries don't
+// need the C library, which most copies would also load)
+static void bench_instance_pool(const char *name, long n)
+{
+    const char *path = lib_path(name);
+    long i;
+    double start = now_ns();
+    for (i = 0; i < n; ++i)
+    {
+        dylib_instance_pool pool = libdylib_instance_pool_open(path, 4, 0);
+        if (!pool)
+        {
+            // e.g. not glibc
+            fprintf(stderr, "instance_pool: %s\n", libdylib_last_error());
+            return;
+        }
+        libdylib_instance_pool_free(pool);
+    }
+    report("instance_pool", name, now_ns() - start, n * 4);
+}
+
+// with a warm page cache, this is the cost LIBDYLIB_OPEN_PREFETCH adds to
+// an open when it does not save any reads
+static void bench_deps_resolve(const char *name, long n)
+{
+    const char *path = lib_path(name);
+    long i;
+    double start = now_ns();
+    for (i = 0; i < n; ++i)
+        libdylib_deps_free(libdylib_deps_resolve(path));
+    report("deps_resolve", name, now_ns() - start, n);
+    start = now_ns();
+    for (i = 0; i < n; ++i)
+        libdylib_close(libdylib_open_ex(path, LIBDYLIB_OPEN_PREFETCH));
+    report("open_close", "prefetch", now_ns() - start, n);
+}
+
+static void bench_lookup(const char *variant, int flags, bool miss, long n)
+{
+    dylib_ref lib = open_or_die("bench-syms-50000", flags);
+    long i;
+    double start = now_ns();
+    for (i = 0; i < n; ++i)
+        libdylib_lookup(lib, miss ? missing_names[i % NUM_NAMES] : names[i % NUM_NAMES]);
+    report(miss ? "lookup_miss" : "lookup_hit", variant, now_ns() - start, n);
+    libdylib_close(lib);
+}
+
+// the last of three candidates exists, as with ABI-versioned entry points
+static void bench_lookup_first(long n)
+{
+    dylib_ref lib = open_or_die("bench-syms-50000", 0);
+    long i;
+    double start = now_ns();
+    for (i = 0; i < n; ++i)
+    {
+        if (!libdylib_find(lib, "sym_0_v3") && !libdylib_find(lib, "sym_0_v2"))
+            libdylib_lookup(lib, "sym_0");
+    }
+    report("lookup_first", "find_loop", now_ns() - start, n);
+    start = now_ns();
+    for (i = 0; i < n; ++i)
+        libdylib_lookup_first(lib, "sym_0_v3", "sym_0_v2", "sym_0", NULL);
+    report("lookup_first", "remembered", now_ns() - start, n);
+    libdylib_close(lib);
+}
+
+// symbols of the last of BENCH_DEP_DEPTH + 1 libraries, looked up in each
+// library in turn, and through a scope
+static void bench_scope(long n)
+{
+    dylib_ref libs[BENCH_DEP_DEPTH + 1];
+    dylib_scope scope = libdylib_scope_create();
+    char name[64];
+    long i;
+    int j;
+    for (j = 0; j < BENCH_DEP_DEPTH; ++j)
+    {
+        snprintf(name, sizeof(name), "bench-dep-%i", j + 1);
+        libs[j] = open_or_die(name, 0);
+    }
+    libs[BENCH_DEP_DEPTH] = open_or_die("bench-syms-50000", 0);
+    for (j = 0; j <= BENCH_DEP_DEPTH; ++j)
+        libdylib_scope_add(scope, libs[j]);
+    double start = now_ns();
+    for (i = 0; i < n; ++i)
+    {
+        for (j = 0; j <= BENCH_DEP_DEPTH; ++j)
+        {
+            if (libdylib_lookup(libs[j], names[i % NUM_NAMES]))
+                break;
+        }
+    }
+    snprintf(name, sizeof(name), "lookup_loop_%i_libs", BENCH_DEP_DEPTH + 1);
+    report("scope_lookup", name, now_ns() - start, n);
+    libdylib_scope_lookup(scope, names[0], NULL); // build the index
+    start = now_ns();
+    for (i = 0; i < n; ++i)
+        libdylib_scope_lookup(scope, names[i % NUM_NAMES], NULL);
+    snprintf(name, sizeof(name), "scope_%i_libs", BENCH_DEP_DEPTH + 1);
+    report("scope_lookup", name, now_ns() - start, n);
+    libdylib_scope_free(scope);
+    for (j = 0; j <= BENCH_DEP_DEPTH; ++j)
+        libdylib_close(libs[j]);
+}
+
+static void bench_find_all(long n)
+{
+    dylib_ref lib = open_or_die("bench-syms-50000", 0);
+    long i;
+    double start = now_ns();
+    for (i = 0; i < n; ++i)
+    {
+        libdylib_find_all(lib, names[0], names[1], names[2], names[3], names[4], names[5], names[6], names[7],
+            names[8], names[9], names[10], names[11], names[12], names[13], names[14], names[15], NULL);
+    }
+    report("find_all", "16_symbols", now_ns() - start, n);
+    libdylib_close(lib);
+}
+
+static void bench_bind_table(long n)
+{
+    static void *dest[NUM_NAMES];
+    static dylib_bind_entry table[NUM_NAMES];
+    dylib_ref lib = open_or_die("bench-syms-50000", 0);
+    long i;
+    for (i = 0; i < NUM_NAMES; ++i)
+    {
+        table[i].name = names[i];
+        table[i].dest = &dest[i];
+    }
+    double start = now_ns();
+    for (i = 0; i < n; ++i)
+        libdylib_bind_table(lib, table, NUM_NAMES);
+    report("bind_table", "1000_symbols", now_ns() - start, n);
+    // as in a later process, with the file written by the first bind
+    libdylib_set_persist_dir(dir);
+    libdylib_close(open_or_die("bench-syms-50000", LIBDYLIB_OPEN_PERSIST));
+    libdylib_bind_table(lib, table, NUM_NAMES);
+    start = now_ns();
+    for (i = 0; i < n; ++i)
+        libdylib_bind_table(lib, table, NUM_NAMES);
+    report("bind_table", "1000_symbols_persist", now_ns() - start, n);
+    libdylib_set_persist_dir(NULL);
+    libdylib_close(lib);
+}
+
+static dylib_ref lazy_lib;
+LIBDYLIB_LAZY(lazy_lib, int, sym_0, (void), ())
+
+// calls after the first one, which should cost the same as through a pointer
+// bound at load time
+static void bench_lazy_call(long n)
+{
+    lazy_lib = open_or_die("bench-syms-1000", 0);
+    int (*volatile bound)(void) = (int (*)(void))libdylib_lookup(lazy_lib, "sym_0");
+    long i, sum = 0;
+    double start = now_ns();
+    for (i = 0; i < n; ++i)
+        sum += bound();
+    report("call", "bound", now_ns() - start, n);
+    start = now_ns();
+    for (i = 0; i < n; ++i)
+        sum += sym_0();
+    report("call", "lazy", now_ns() - start, n);
+    if (sum)
+        exit(1);
+    libdylib_close(lazy_lib);
+}
+
+static void bench_locate_miss(long n)
+{
+    dylib_search_path sp = libdylib_search_path_create();
+    long i;
+    libdylib_search_path_add_dir(sp, dir);
+    double start = now_ns();
+    for (i = 0; i < n; ++i)
+        libdylib_open_locate("bench-no-such-lib");
+    report("open_locate_miss", "default", now_ns() - start, n);
+    start = now_ns();
+    for (i = 0; i < n; ++i)
+        libdylib_open_search(sp, "bench-no-such-lib", 0);
+    report("open_locate_miss", "search_path", now_ns() - start, n);
+    libdylib_search_path_free(sp);
+}
+
+static void bench_addr_to_symbol(long n)
+{
+    static const void *addrs[NUM_NAMES];
+    static dylib_addr_info infos[NUM_NAMES];
+    dylib_ref lib = open_or_die("bench-syms-50000", 0);
+    Dl_info dl;
+    long i;
+    for (i = 0; i < NUM_NAMES; ++i)
+        addrs[i] = (const char*)libdylib_lookup(lib, names[i]) + 1;
+    // build the indexes
+    libdylib_addr_to_symbols(lib, addrs, 1, infos);
+    libdylib_addr_to_symbols(NULL, addrs, 1, infos);
+    double start = now_ns();
+    for (i = 0; i < n; ++i)
+        dladdr(addrs[i % NUM_NAMES], &dl);
+    report("addr_to_symbol", "dladdr", now_ns() - start, n);
+    start = now_ns();
+    for (i = 0; i < n; ++i)
+        libdylib_addr_to_symbol(lib, addrs[i % NUM_NAMES], &infos[0]);
+    report("addr_to_symbol", "library", now_ns() - start, n);
+    start = now_ns();
+    for (i = 0; i < n; ++i)
+        libdylib_addr_to_symbol(NULL, addrs[i % NUM_NAMES], &infos[0]);
+    report("addr_to_symbol", "all_objects", now_ns() - start, n);
+    start = now_ns();
+    for (i = 0; i < n / NUM_NAMES + 1; ++i)
+        libdylib_addr_to_symbols(NULL, addrs, NUM_NAMES, infos);
+    report("addr_to_symbol", "all_objects_batch", now_ns() - start, (n / NUM_NAMES + 1) * NUM_NAMES);
+    libdylib_close(lib);
+}
+
+struct thread_data {
+    dylib_ref lib;
+    long n;
+    volatile bool stop; // for churn_thread()
+};
+
+static void *lookup_thread(void *arg)
+{
+    struct thread_data *data = (struct thread_data*)arg;
+    long i;
+    for (i = 0; i < data->n; ++i)
+        libdylib_lookup(data->lib, names[i % NUM_NAMES]);
+    return NULL;
+}
+
+// opens and closes another library until stopped, so that lookups on other
+// threads run concurrently with final closes
+static void *churn_thread(void *arg)
+{
+    struct thread_data *data = (struct thread_data*)arg;
+    const char *path = lib_path("bench-syms-10");
+    while (!data->stop)
+        libdylib_close(libdylib_open(path));
+    return NULL;
+}
+
+// lookups through a shared handle - with churn, another thread keeps loading
+// and unloading a library at the same time
+static void bench_threads(const char *engine, int flags, bool churn, long n)
+{
+    dylib_ref lib = open_or_die("bench-syms-50000", flags);
+    pthread_t threads[NUM_THREADS_MAX], churner;
+    struct thread_data data = {lib, n, false};
+    char variant[64];
+    int count, i;
+    for (count = 1; count <= NUM_THREADS_MAX; count *= 2)
+    {
+        data.stop = false;
+        if (churn)
+            pthread_create(&churner, NULL, churn_thread, &data);
+        double start = now_ns();
+        for (i = 0; i < count; ++i)
+            pthread_create(&threads[i], NULL, lookup_thread, &data);
+        for (i = 0; i < count; ++i)
+            pthread_join(threads[i], NULL);
+        // ns_per_op is the wall time per lookup across all threads
+        double elapsed = now_ns() - start;
+        data.stop = true;
+        if (churn)
+            pthread_join(churner, NULL);
+        snprintf(variant, sizeof(variant), "%s%s_%i_threads", engine, churn ? "_churn" : "", count);
+        report("lookup_threads", variant, elapsed, n * count);
+    }
+    libdylib_close(lib);
+}
+
+int main(int argc, const char **argv)
+{
+    char name[64];
+    int i;
+    if (argc > 1)
+        dir = argv[1];
+    if (argc > 2)
+        scale = atof(argv[2]);
+    for (i = 0; i < NUM_NAMES; ++i)
+    {
+        // spread over the whole library
+        snprintf(names[i], sizeof(names[i]), "sym_%i", i * 50);
+        snprintf(missing_names[i], sizeof(missing_names[i]), "nosym_%i", i * 50);
+    }
+
+    printf("{\n  \"libdylib_version\": \"%s\",\n  \"scale\": %g,\n  \"results\": [", libdylib_get_version_str(), scale);
+    bench_open_close("bench-syms-10", iterations(2000));
+    bench_open_close("bench-syms-1000", iterations(1000));
+    bench_open_close("bench-syms-50000", iterations(200));
+    snprintf(name, sizeof(name), "bench-dep-%i", BENCH_DEP_DEPTH);
+    bench_open_close(name, iterations(500));
+    bench_deps_resolve(name, iterations(500));
+    bench_reopen("bench-syms-50000", iterations(200000));
+    bench_open_memory("bench-syms-1000", iterations(500));
+    bench_close_many(iterations(200));
+    bench_instance_pool("bench-syms-1000", iterations(100));
+
+    bench_lookup("default", 0, false, iterations(1000000));
+    bench_lookup("cache", LIBDYLIB_OPEN_CACHE, false, iterations(1000000));
+    bench_lookup("elf", LIBDYLIB_OPEN_ELF_LOOKUP, false, iterations(1000000));
+    bench_lookup("default", 0, true, iterations(1000000));
+    bench_lookup("cache", LIBDYLIB_OPEN_CACHE, true, iterations(1000000));
+    bench_lookup("elf", LIBDYLIB_OPEN_ELF_LOOKUP, true, iterations(1000000));
+
+    bench_lookup_first(iterations(200000));
+    bench_scope(iterations(100000));
+    bench_find_all(iterations(50000));
+    bench_bind_table(iterations(1000));
+    bench_lazy_call(iterations(10000000));
+    bench_locate_miss(iterations(2000));
+    bench_addr_to_symbol(iterations(20000));
+
+    bench_threads("default", 0, false, iterations(500000));
+    bench_threads("cache", LIBDYLIB_OPEN_CACHE, false, iterations(500000));
+    bench_threads("elf", LIBDYLIB_OPEN_ELF_LOOKUP, false, iterations(500000));
+    bench_threads("cache", LIBDYLIB_OPEN_CACHE, true, iterations(500000));
+    printf("\n  ]\n}\n");
+    return 0;
+}
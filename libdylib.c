@@ -1,356 +1,6382 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+    #define _GNU_SOURCE // for dlinfo()
+#endif
+#include <errno.h>
+#include <limits.h>
 #include <stdarg.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "libdylib.h"
 
+#if defined(LIBDYLIB_LINUX) && defined(__ELF__)
+    #define LIBDYLIB_ELF
+    #include <fcntl.h>
+    #include <link.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+#endif
+
+// Locks and atomic counters
+#if defined(LIBDYLIB_UNIX)
+    #include <fcntl.h>
+    #include <pthread.h>
+    #include <sched.h>
+    #include <sys/stat.h>
+    #include <time.h>
+    #include <unistd.h>
+    typedef pthread_rwlock_t rwlock_t;
+    #define RWLOCK_INIT PTHREAD_RWLOCK_INITIALIZER
+    #define rwlock_init(lock) pthread_rwlock_init(lock, NULL)
+    #define rwlock_destroy(lock) pthread_rwlock_destroy(lock)
+    #define rwlock_read(lock) pthread_rwlock_rdlock(lock)
+    #define rwlock_write(lock) pthread_rwlock_wrlock(lock)
+    #define rwlock_unlock_read(lock) pthread_rwlock_unlock(lock)
+    #define rwlock_unlock_write(lock) pthread_rwlock_unlock(lock)
+    #define atomic_increment(ptr) __atomic_add_fetch(ptr, 1, __ATOMIC_RELAXED)
+    #define atomic_add64(ptr, n) __atomic_fetch_add(ptr, n, __ATOMIC_RELAXED)
+    #define atomic_load64(ptr) __atomic_load_n(ptr, __ATOMIC_RELAXED)
+    #define atomic_store64(ptr, value) __atomic_store_n(ptr, value, __ATOMIC_RELAXED)
+    #define atomic_load_ptr(ptr) __atomic_load_n(ptr, __ATOMIC_ACQUIRE)
+    #define atomic_store_ptr(ptr, value) __atomic_store_n(ptr, value, __ATOMIC_RELEASE)
+    #define atomic_fetch_add_seq(ptr, n) __atomic_fetch_add(ptr, n, __ATOMIC_SEQ_CST)
+    #define atomic_load_seq(ptr) __atomic_load_n(ptr, __ATOMIC_SEQ_CST)
+    #define atomic_store_seq(ptr, value) __atomic_store_n(ptr, value, __ATOMIC_SEQ_CST)
+    #define atomic_load_ptr_seq(ptr) __atomic_load_n(ptr, __ATOMIC_SEQ_CST)
+    #define atomic_store_ptr_seq(ptr, value) __atomic_store_n(ptr, value, __ATOMIC_SEQ_CST)
+    #define atomic_load_long(ptr) __atomic_load_n(ptr, __ATOMIC_RELAXED)
+    #define atomic_cas_long(ptr, expected, value) __sync_bool_compare_and_swap(ptr, expected, value)
+    #define atomic_cas_ptr(ptr, expected, value) __sync_bool_compare_and_swap(ptr, expected, value)
+    #define thread_yield() sched_yield()
+    typedef pthread_mutex_t mutex_t;
+    #define MUTEX_INIT PTHREAD_MUTEX_INITIALIZER
+    #define mutex_lock(lock) pthread_mutex_lock(lock)
+    #define mutex_unlock(lock) pthread_mutex_unlock(lock)
+    typedef pthread_cond_t cond_t;
+    #define COND_INIT PTHREAD_COND_INITIALIZER
+    #define cond_wait(cond, lock) pthread_cond_wait(cond, lock)
+    #define cond_signal(cond) pthread_cond_signal(cond)
+    #define cond_broadcast(cond) pthread_cond_broadcast(cond)
+    typedef void *thread_result;
+    #define THREAD_CALL
+    // starts a detached thread
+    static bool thread_start (thread_result (THREAD_CALL *func)(void*), void *arg)
+    {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, func, arg) != 0)
+            return false;
+        pthread_detach(thread);
+        return true;
+    }
+    static uint64_t monotonic_ns()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+    }
+#elif defined(LIBDYLIB_WINDOWS)
+    #include <Windows.h>
+    typedef SRWLOCK rwlock_t;
+    #define RWLOCK_INIT SRWLOCK_INIT
+    #define rwlock_init(lock) InitializeSRWLock(lock)
+    #define rwlock_destroy(lock) ((void)(lock))
+    #define rwlock_read(lock) AcquireSRWLockShared(lock)
+    #define rwlock_write(lock) AcquireSRWLockExclusive(lock)
+    #define rwlock_unlock_read(lock) ReleaseSRWLockShared(lock)
+    #define rwlock_unlock_write(lock) ReleaseSRWLockExclusive(lock)
+    #define atomic_increment(ptr) InterlockedIncrement(ptr)
+    #define atomic_add64(ptr, n) InterlockedExchangeAdd64((LONG64*)(ptr), (LONG64)(n))
+    #define atomic_load64(ptr) ((uint64_t)InterlockedCompareExchange64((LONG64*)(ptr), 0, 0))
+    #define atomic_store64(ptr, value) InterlockedExchange64((LONG64*)(ptr), (LONG64)(value))
+    #define atomic_load_ptr(ptr) InterlockedCompareExchangePointer((PVOID*)(ptr), NULL, NULL)
+    #define atomic_store_ptr(ptr, value) InterlockedExchangePointer((PVOID*)(ptr), (PVOID)(value))
+    #define atomic_fetch_add_seq(ptr, n) ((uint64_t)InterlockedExchangeAdd64((LONG64*)(ptr), (LONG64)(n)))
+    #define atomic_load_seq(ptr) ((uint64_t)InterlockedCompareExchange64((LONG64*)(ptr), 0, 0))
+    #define atomic_store_seq(ptr, value) InterlockedExchange64((LONG64*)(ptr), (LONG64)(value))
+    #define atomic_load_ptr_seq(ptr) InterlockedCompareExchangePointer((PVOID*)(ptr), NULL, NULL)
+    #define atomic_store_ptr_seq(ptr, value) InterlockedExchangePointer((PVOID*)(ptr), (PVOID)(value))
+    #define atomic_load_long(ptr) InterlockedCompareExchange((LONG*)(ptr), 0, 0)
+    #define atomic_cas_long(ptr, expected, value) \
+        (InterlockedCompareExchange((LONG*)(ptr), (LONG)(value), (LONG)(expected)) == (LONG)(expected))
+    #define atomic_cas_ptr(ptr, expected, value) \
+        (InterlockedCompareExchangePointer((PVOID*)(ptr), (PVOID)(value), (PVOID)(expected)) == (PVOID)(expected))
+    #define thread_yield() SwitchToThread()
+    typedef SRWLOCK mutex_t;
+    #define MUTEX_INIT SRWLOCK_INIT
+    #define mutex_lock(lock) AcquireSRWLockExclusive(lock)
+    #define mutex_unlock(lock) ReleaseSRWLockExclusive(lock)
+    typedef CONDITION_VARIABLE cond_t;
+    #define COND_INIT CONDITION_VARIABLE_INIT
+    #define cond_wait(cond, lock) SleepConditionVariableSRW(cond, lock, INFINITE, 0)
+    #define cond_signal(cond) WakeConditionVariable(cond)
+    #define cond_broadcast(cond) WakeAllConditionVariable(cond)
+    typedef DWORD thread_result;
+    #define THREAD_CALL WINAPI
+    static bool thread_start (thread_result (THREAD_CALL *func)(void*), void *arg)
+    {
+        HANDLE thread = CreateThread(NULL, 0, func, arg, 0, NULL);
+        if (thread == NULL)
+            return false;
+        CloseHandle(thread);
+        return true;
+    }
+    static uint64_t monotonic_ns()
+    {
+        static LARGE_INTEGER frequency;
+        LARGE_INTEGER count;
+        if (!frequency.QuadPart)
+            QueryPerformanceFrequency(&frequency);
+        QueryPerformanceCounter(&count);
+        return (uint64_t)(count.QuadPart / frequency.QuadPart * 1000000000u +
+            count.QuadPart % frequency.QuadPart * 1000000000u / frequency.QuadPart);
+    }
+#endif
+
+#ifdef PATH_MAX
+    #define PATH_BUF_SIZE PATH_MAX
+#else
+    #define PATH_BUF_SIZE 4096
+#endif
+
+struct registry_alias;
+struct addr_object;
+struct first_memo;
+
+// lookup_first() results, see lookup_first_key()
+#define LOOKUP_FIRST_MEMO 16
+#define LOOKUP_FIRST_MAX 32
+
+// a candidate path that a search path failed to open
+struct search_path_miss {
+    uint32_t hash;
+    struct search_path_miss *next;
+    const char *error; // the loader's error, NULL if the probe rejected path
+    char path[1];      // followed by error
+};
+#define SEARCH_PATH_BUCKETS 64
+
+struct symbol_cache_entry {
+    uint32_t hash;
+    void *addr; // NULL if the symbol was not found
+    char *name; // NULL if the slot is empty - set last, with atomic_store_ptr()
+};
+// entries are never changed or removed once they are set, and full tables are
+// replaced by larger copies - replaced tables are kept until the cache is
+// freed, since lookups on other threads may still be reading them
+struct symbol_cache_table {
+    size_t capacity; // always a power of 2
+    struct symbol_cache_table *replaced;
+    struct symbol_cache_entry entries[1]; // capacity entries
+};
+struct symbol_cache {
+    struct symbol_cache_table *table; // read with atomic_load_ptr(), NULL if empty
+    mutex_t lock; // serializes inserts
+    size_t count;
+};
+// Lookup counters are striped: each thread adds to one stripe, so that threads
+// looking up symbols in the same library don't all write to one cache line.
+// Stripes span two cache lines, since they are only aligned like malloc().
+// Handles allocate their stripes on their first counted lookup.
+#define LOOKUP_STRIPES 32
+struct lookup_stripe {
+    uint64_t lookups;
+    uint64_t lookup_misses;
+    uint64_t cache_hits;
+    uint64_t cache_misses;
+    char pad[128 - 4 * sizeof(uint64_t)];
+};
+#ifdef LIBDYLIB_ELF
+// dynamic symbol table of a loaded ELF object, read in place
+struct elf_object {
+    bool valid;
+    ElfW(Addr) base;
+    const ElfW(Phdr) *phdr;
+    ElfW(Half) phnum;
+    const ElfW(Sym) *symtab;
+    const char *strtab;
+    const ElfW(Half) *versym; // NULL if the object has no symbol versions
+    // DT_GNU_HASH
+    const ElfW(Addr) *gnu_bloom;
+    const uint32_t *gnu_buckets;
+    const uint32_t *gnu_chain; // indexed by (symbol index - gnu_symoffset)
+    uint32_t gnu_nbuckets, gnu_symoffset, gnu_bloom_size, gnu_bloom_shift;
+    // DT_HASH, only used if there is no DT_GNU_HASH
+    const uint32_t *sysv_hash;
+};
+#endif
+
+// a read-only mapping of an ELF file, with its header fields converted to
+// the widest type
+struct elf_file {
+    const unsigned char *data;
+    size_t size;
+    bool is64;
+    uint16_t type;
+    uint16_t machine;
+    uint64_t phoff, shoff;
+    uint16_t phnum, phentsize, shnum, shentsize;
+};
+struct elf_file_section {
+    uint32_t type;
+    uint32_t link;
+    uint64_t addr, offset, size, entsize;
+};
+
 #ifdef LIBDYLIB_CXX
 using libdylib::dylib_ref;
+using libdylib::dylib_error;
+using libdylib::LIBDYLIB_E_NONE;
+using libdylib::LIBDYLIB_E_NULL_HANDLE;
+using libdylib::LIBDYLIB_E_NULL_ARG;
+using libdylib::LIBDYLIB_E_OPEN_FAILED;
+using libdylib::LIBDYLIB_E_CLOSE_FAILED;
+using libdylib::LIBDYLIB_E_NOT_FOUND;
+using libdylib::LIBDYLIB_E_NO_MEMORY;
+using libdylib::LIBDYLIB_E_UNSUPPORTED;
+using libdylib::LIBDYLIB_E_BAD_FORMAT;
+using libdylib::LIBDYLIB_E_INVALID_HANDLE;
+using libdylib::dylib_namespace;
+using libdylib::dylib_instance_pool;
+using libdylib::dylib_search_path;
+using libdylib::dylib_open_task;
+using libdylib::dylib_reloadable;
+using libdylib::dylib_addr_info;
+using libdylib::dylib_scope;
+using libdylib::dylib_dependency;
+using libdylib::dylib_deps;
+using libdylib::dylib_bind_entry;
+using libdylib::dylib_lazy_fail_func;
+using libdylib::dylib_alloc_func;
+using libdylib::dylib_free_func;
+using libdylib::dylib_stats;
+using libdylib::dylib_trace_event;
+using libdylib::dylib_trace_func;
+using libdylib::LIBDYLIB_TRACE_OPEN;
+using libdylib::LIBDYLIB_TRACE_LOOKUP;
+using libdylib::LIBDYLIB_TRACE_CLOSE;
+using libdylib::dylib_symbols_ref;
+using libdylib::dylib_symbol_info;
+using libdylib::LIBDYLIB_SYMTYPE_NOTYPE;
+using libdylib::LIBDYLIB_SYMTYPE_OBJECT;
+using libdylib::LIBDYLIB_SYMTYPE_FUNC;
+using libdylib::LIBDYLIB_SYMTYPE_TLS;
+using libdylib::LIBDYLIB_SYMTYPE_IFUNC;
+using libdylib::LIBDYLIB_SYMTYPE_OTHER;
+using libdylib::LIBDYLIB_SYMBIND_GLOBAL;
+using libdylib::LIBDYLIB_SYMBIND_WEAK;
+using libdylib::LIBDYLIB_SYMBIND_UNIQUE;
+using libdylib::LIBDYLIB_SYMBIND_OTHER;
 namespace libdylib {
 #endif
 struct dylib_data {
+    dylib_ref ref; // the handle given to callers (see handle_alloc()), read atomically
     void *handle;
     const char *path;
-    bool dyn_path; // true if path should be freed
-    bool freed;
     bool is_self;
+    int flags;
+    struct symbol_cache cache;
+    struct lookup_stripe *counters; // see lib_counters(), read atomically
+#ifdef LIBDYLIB_ELF
+    struct elf_object elf;
+#endif
+    struct first_memo *first_memo[LOOKUP_FIRST_MEMO]; // set once, read with atomic_load_ptr()
+#ifndef LIBDYLIB_NO_STATS
+    dylib_stats stats;
+#endif
+    // registry state, protected by the registry lock
+    long refcount; // updated atomically, 0 once the library is being closed
+    bool has_file_id;
+    uint64_t dev, ino;
+    struct registry_alias *aliases;
+    struct addr_object *addr_index; // built on first use
+    int fd; // kept open while loaded by open_memory(), otherwise -1
+    dylib_namespace ns; // LIBDYLIB_NAMESPACE_BASE unless opened by open_namespace()
+    uint64_t load_seq; // increases with each library loaded
+    bool keep_loaded; // set by LIBDYLIB_CLOSE_FAST_EXIT
+    // handles closed while lookups on other threads may be using them
+    uint64_t retired_epoch;
+    dylib_ref next_retired;
+};
+struct dylib_instance_pool_data {
+    dylib_ref *instances;
+    size_t count;
+    uint64_t next; // incremented atomically by instance_pool_next()
+};
+struct dylib_search_path_data {
+    rwlock_t lock; // protects misses
+    char **dirs;
+    size_t dir_count;
+    char **patterns; // NULL to use locate_patterns
+    size_t pattern_count;
+    struct search_path_miss *misses[SEARCH_PATH_BUCKETS];
+};
+struct dylib_symbols_data {
+    struct elf_file file;
+    const unsigned char *symtab;
+    uint64_t sym_entsize, sym_count;
+    const char *strtab;
+    uint64_t strtab_size;
+    const uint16_t *versym;         // NULL if the file has no symbol versions
+    const unsigned char *verdef;    // NULL if the file defines no versions
+    uint64_t verdef_size;
+    const char *verdef_strtab;
+    uint64_t verdef_strtab_size;
+    uint64_t next;
 };
 #ifdef LIBDYLIB_CXX
 }
 #endif
 
-LIBDYLIB_DEFINE(const void*, get_handle)(dylib_ref lib)
-{
-    return lib->handle;
-}
+static dylib_ref handle_enter (dylib_ref ref);
+static void handle_exit();
 
-LIBDYLIB_DEFINE(const char*, get_path)(dylib_ref lib)
+LIBDYLIB_DEFINE(const void*, get_handle)(dylib_ref ref)
 {
-    return lib->path;
+    dylib_ref lib = handle_enter(ref);
+    if (lib == NULL)
+        return NULL;
+    const void *handle = lib->handle;
+    handle_exit();
+    return handle;
 }
 
-#define ERR_MAX_SIZE 2048
-static char last_err[ERR_MAX_SIZE];
-static bool last_err_set = 0;
-static void set_last_error(const char *s)
+LIBDYLIB_DEFINE(const char*, get_path)(dylib_ref ref)
 {
-    if (!s)
-        s = "NULL error";
-    last_err_set = 1;
-    strncpy(last_err, s, ERR_MAX_SIZE);
+    dylib_ref lib = handle_enter(ref);
+    if (lib == NULL)
+        return NULL;
+    // paths are interned, and outlive the library
+    const char *path = lib->path;
+    handle_exit();
+    return path;
 }
 
-static dylib_ref dylib_ref_alloc (void *handle, const char *path)
+#if defined(_MSC_VER)
+    #define LIBDYLIB_TLS __declspec(thread)
+#else
+    #define LIBDYLIB_TLS __thread
+#endif
+
+static struct lookup_stripe global_counters[LOOKUP_STRIPES];
+static LIBDYLIB_TLS unsigned lookup_stripe_self; // stripe index + 1, or 0
+static long lookup_stripe_next;
+
+// returns the calling thread's stripe, or NULL if stripes is - threads are
+// spread over stripes in the order of their first lookup
+static struct lookup_stripe *lookup_stripe (struct lookup_stripe *stripes)
 {
-    if (handle == NULL)
+    if (stripes == NULL)
         return NULL;
-    dylib_ref ref = NULL;
-    ref = (dylib_ref)malloc(sizeof(*ref));
-    ref->handle = handle;
-    ref->path = path;
-    ref->dyn_path = false;
-    ref->freed = false;
-    ref->is_self = false;
-    return ref;
+    if (lookup_stripe_self == 0)
+        lookup_stripe_self = (unsigned)(atomic_increment(&lookup_stripe_next) % LOOKUP_STRIPES) + 1;
+    return &stripes[lookup_stripe_self - 1];
 }
 
-static dylib_ref dylib_ref_alloc_dynamic (void *handle, char *path)
+// returns the stripes of lib, allocating them if needed - NULL if out of
+// memory, in which case the lookup isn't counted
+static struct lookup_stripe *lib_counters (dylib_ref lib);
+
+// sums a lookup counter over all stripes (of which there may be none)
+#define lookup_total(stripes, field) lookup_total_offset(stripes, offsetof(struct lookup_stripe, field))
+static uint64_t lookup_total_offset (struct lookup_stripe *stripes, size_t offset)
 {
-    dylib_ref ref = dylib_ref_alloc(handle, path);
-    if (ref == NULL)
-        return NULL;
-    ref->dyn_path = true;
-    return ref;
+    uint64_t total = 0;
+    size_t i;
+    for (i = 0; stripes && i < LOOKUP_STRIPES; ++i)
+        total += atomic_load64((uint64_t*)((char*)&stripes[i] + offset));
+    return total;
 }
 
-static void dylib_ref_free (dylib_ref ref)
+// Instrumentation: while statistics are enabled (see set_stats_enabled()),
+// counters are updated with relaxed atomics (striped for lookups), both per
+// handle and in global totals. The trace callback is called around opens,
+// lookups and closes, and operations are only timed while one of them is
+// on. Defining LIBDYLIB_NO_STATS compiles all of this out (except for symbol
+// cache counters, which are always kept per handle).
+#ifndef LIBDYLIB_NO_STATS
+static dylib_stats global_stats;
+static uint64_t stats_enabled; // read and written atomically
+
+// callbacks are kept until the process exits, so that a trace_call() on
+// another thread can still use the one it loaded - setting the same
+// callback and context again reuses it
+struct trace_callback {
+    dylib_trace_func func;
+    void *ctx;
+    struct trace_callback *next;
+};
+static struct {
+    mutex_t lock; // protects all
+    struct trace_callback *current; // NULL if none, read atomically
+    struct trace_callback *all;
+} trace = {MUTEX_INIT, NULL, NULL};
+
+#define stats_on() (atomic_load64(&stats_enabled) != 0)
+
+static void stats_add_lib (dylib_ref lib, uint64_t *lib_field, uint64_t *global_field, uint64_t n)
 {
-    if (ref == NULL)
-        return;
-    if (ref->freed)
+    if (n == 0 || !stats_on())
         return;
-    ref->handle = NULL;
-    if (ref->dyn_path)
-        free((char*)ref->path);
-    ref->freed = true;
-    free((void*)ref);
+    atomic_add64(global_field, n);
+    if (lib)
+        atomic_add64(lib_field, n);
 }
+#define stats_add(lib, field, n) stats_add_lib(lib, (lib) ? &(lib)->stats.field : NULL, &global_stats.field, n)
+#define stats_add_global(field, n) stats_add_lib(NULL, NULL, &global_stats.field, n)
 
-static void platform_set_last_error();
-static void *platform_raw_open (const char *path);
-static void *platform_raw_open_self();
-static bool platform_raw_close (void *handle);
-static void *platform_raw_lookup (void *handle, const char *symbol);
-
-#define check_null_arg(arg, msg, ret) if (arg == NULL) {set_last_error(msg); return ret; }
-#define check_null_handle(handle, ret) check_null_arg(handle, "NULL library handle", ret)
-#define check_null_path(path, ret) check_null_arg(path, "NULL library path", ret)
+// counts a lookup in lib (NULL for lookups that aren't in a single library)
+static void stats_add_lookup_to (struct lookup_stripe *counters, bool found)
+{
+    struct lookup_stripe *stripe = lookup_stripe(counters);
+    if (stripe == NULL)
+        return;
+    atomic_add64(&stripe->lookups, 1);
+    if (!found)
+        atomic_add64(&stripe->lookup_misses, 1);
+}
 
-#if defined(LIBDYLIB_UNIX)
-#include <dlfcn.h>
+static void stats_add_lookup (dylib_ref lib, bool found)
+{
+    if (!stats_on())
+        return;
+    stats_add_lookup_to(global_counters, found);
+    if (lib)
+        stats_add_lookup_to(lib_counters(lib), found);
+}
 
-static void platform_set_last_error()
+// counts a lookup made for a scope, which counts itself globally
+static void stats_add_member_lookup (dylib_ref lib, bool found)
 {
-    set_last_error(dlerror());
+    if (stats_on())
+        stats_add_lookup_to(lib_counters(lib), found);
 }
 
-static void *platform_raw_open (const char *path)
+static bool trace_enabled()
 {
-    return (void*)dlopen(path, RTLD_LOCAL | RTLD_NOW);
+    return atomic_load_ptr(&trace.current) != NULL;
 }
 
-static void *platform_raw_open_self()
+// the start time of an operation, or 0 if it is neither counted nor traced
+static uint64_t stats_now()
 {
-    return (void*)RTLD_SELF;
+    return stats_on() || trace_enabled() ? monotonic_ns() : 0;
 }
+#define stats_since(start) ((start) ? stats_now() - (start) : 0)
 
-static bool platform_raw_close (void *handle)
+static void trace_call (int type, dylib_ref lib, const char *name, uint64_t start_ns, bool success)
 {
-    return dlclose(handle) == 0;
+    struct trace_callback *callback = (struct trace_callback*)atomic_load_ptr(&trace.current);
+    if (callback == NULL)
+        return;
+    dylib_trace_event event;
+    event.type = type;
+    event.lib = lib ? lib->ref : NULL;
+    event.name = name;
+    event.start_ns = start_ns;
+    event.end_ns = monotonic_ns();
+    event.success = success;
+    callback->func(&event, callback->ctx);
 }
+#else
+#define stats_add(lib, field, n) ((void)0)
+#define stats_add_global(field, n) ((void)(n))
+#define stats_add_lookup(lib, found) ((void)0)
+#define stats_add_member_lookup(lib, found) ((void)0)
+#define stats_now() ((uint64_t)0)
+#define stats_since(start) ((void)(start), (uint64_t)0)
+#define trace_enabled() false
+#define trace_call(type, lib, name, start_ns, success) ((void)(start_ns))
+#endif
 
-static void *platform_raw_lookup (void *handle, const char *symbol)
+// Error state is per thread. Failures on hot paths (e.g. missed lookups) only
+// record a code, a static message and a short detail string; the full message
+// is formatted when last_error() is called.
+#define ERR_MAX_SIZE 2048
+#define ERR_DETAIL_MAX_SIZE 256
+struct error_state {
+    dylib_error code;
+    const char *msg;                    // static message, unless formatted
+    char detail[ERR_DETAIL_MAX_SIZE];   // appended to msg, if not empty
+    bool formatted;                     // true if buf holds the whole message
+    char buf[ERR_MAX_SIZE];
+};
+static LIBDYLIB_TLS struct error_state last_err;
+
+static void set_error (dylib_error code, const char *msg)
 {
-    return dlsym(handle, symbol);
+    last_err.code = code;
+    last_err.msg = msg;
+    last_err.detail[0] = 0;
+    last_err.formatted = false;
 }
 
-// end LIBDYLIB_UNIX
-#elif defined(LIBDYLIB_WINDOWS)
-#include <Windows.h>
+static void set_error_detail (dylib_error code, const char *msg, const char *detail)
+{
+    // details are short (symbol names) - a plain loop beats strlen + memcpy here
+    size_t i;
+    set_error(code, msg);
+    for (i = 0; i < ERR_DETAIL_MAX_SIZE - 1 && detail[i]; ++i)
+        last_err.detail[i] = detail[i];
+    last_err.detail[i] = 0;
+    stats_add_global(error_bytes, i);
+}
 
-static void platform_set_last_error()
+// returns a buffer of ERR_MAX_SIZE bytes to write a complete message into
+static char *set_error_buffer (dylib_error code)
 {
-    // Based on http://stackoverflow.com/questions/1387064
-    DWORD code = GetLastError();
-    if (!code)
-        set_last_error(NULL);
-    else
-    {
-        LPSTR buf = NULL;
-        size_t size = FormatMessageA(FORMAT_MESSAGE_ALLOCATE_BUFFER | FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_IGNORE_INSERTS,
-            NULL, code, MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT), (LPSTR)&buf, 0, NULL);
-        set_last_error((const char*)buf);
-        LocalFree(buf);
-    }
+    set_error(code, NULL);
+    last_err.formatted = true;
+    return last_err.buf;
 }
 
-static void *platform_raw_open (const char *path)
+// formats "context: <description of errno>"
+static void set_error_errno (dylib_error code, const char *context)
 {
-    return (void*)LoadLibrary(path);
+    int len = snprintf(set_error_buffer(code), ERR_MAX_SIZE, "%s: %s", context, strerror(errno));
+    stats_add_global(error_bytes, len > 0 ? (uint64_t)len : 0);
 }
 
-static void *platform_raw_open_self()
+static void set_error_copy (dylib_error code, const char *msg)
 {
-    return (void*)GetModuleHandle(NULL);
+    if (!msg)
+        msg = "NULL error";
+    size_t len = strlen(msg);
+    if (len >= ERR_MAX_SIZE)
+        len = ERR_MAX_SIZE - 1;
+    char *buf = set_error_buffer(code);
+    memcpy(buf, msg, len);
+    buf[len] = 0;
+    stats_add_global(error_bytes, len);
 }
 
-static bool platform_raw_close (void *handle)
+// Memory is allocated through the hooks set by set_allocator(). Handles and
+// registry aliases come from fixed-size pools that are never returned to the
+// allocator, and library paths are interned, so opening and closing the same
+// libraries repeatedly doesn't allocate once the pools have grown.
+static void *default_alloc (size_t size, void *ctx)
 {
-    return FreeLibrary((HMODULE)handle);
+    (void)ctx;
+    return malloc(size);
 }
 
-static void *platform_raw_lookup (void *handle, const char *symbol)
+static void default_free (void *ptr, void *ctx)
 {
-    return (void*)GetProcAddress((HMODULE)handle, symbol);
+    (void)ctx;
+    free(ptr);
 }
 
-// end LIBDYLIB_WINDOWS
-#else
-#error "unrecognized platform"
-#endif
+static struct {
+    dylib_alloc_func alloc;
+    dylib_free_func free;
+    void *ctx;
+} allocator = {default_alloc, default_free, NULL};
 
-// All platforms
+static void *mem_alloc (size_t size)
+{
+    return allocator.alloc(size, allocator.ctx);
+}
 
-LIBDYLIB_DEFINE(dylib_ref, open)(const char *path)
+static void *mem_calloc (size_t n, size_t size)
 {
-    check_null_path(path, NULL);
-    dylib_ref lib = dylib_ref_alloc(platform_raw_open(path), path);
-    if (lib == NULL)
-        platform_set_last_error();
-    return lib;
+    if (size && n > (size_t)-1 / size)
+        return NULL;
+    void *ptr = mem_alloc(n * size);
+    if (ptr)
+        memset(ptr, 0, n * size);
+    return ptr;
 }
 
-LIBDYLIB_DEFINE(dylib_ref, open_self)()
+static void mem_free (void *ptr)
 {
-    dylib_ref lib = dylib_ref_alloc(platform_raw_open_self(), NULL);
-    lib->is_self = true;
-    return lib;
+    if (ptr)
+        allocator.free(ptr, allocator.ctx);
 }
 
-LIBDYLIB_DEFINE(bool, close)(dylib_ref lib)
+// the allocator hooks don't know allocation sizes, so the caller passes them
+static void *mem_realloc (void *ptr, size_t old_size, size_t new_size)
 {
-    check_null_handle(lib, 0);
-    if (lib->is_self)
+    void *new_ptr = mem_alloc(new_size);
+    if (new_ptr == NULL)
+        return NULL;
+    if (ptr)
+        memcpy(new_ptr, ptr, old_size < new_size ? old_size : new_size);
+    mem_free(ptr);
+    return new_ptr;
+}
+
+static struct lookup_stripe *lib_counters (dylib_ref lib)
+{
+    struct lookup_stripe *stripes = (struct lookup_stripe*)atomic_load_ptr(&lib->counters);
+    if (stripes)
+        return stripes;
+    stripes = (struct lookup_stripe*)mem_calloc(LOOKUP_STRIPES, sizeof(*stripes));
+    if (stripes && !atomic_cas_ptr(&lib->counters, NULL, stripes))
     {
-        dylib_ref_free(lib);
-        return true;
+        mem_free(stripes);
+        stripes = (struct lookup_stripe*)atomic_load_ptr(&lib->counters);
     }
-    bool ret = platform_raw_close((void*)lib->handle);
-    if (!ret)
-        platform_set_last_error();
-    else
-        dylib_ref_free(lib);
-    return ret;
+    return stripes;
 }
 
-LIBDYLIB_DEFINE(void*, lookup)(dylib_ref lib, const char *symbol)
+#define POOL_CHUNK_ITEMS 16
+struct pool_item {
+    struct pool_item *next;
+};
+struct fixed_pool {
+    mutex_t lock;
+    struct pool_item *free_list;
+};
+
+// items of a pool must all have the same size
+static void *pool_alloc (struct fixed_pool *pool, size_t size)
 {
-    check_null_handle(lib, NULL);
-    void *ret = platform_raw_lookup((void*)lib->handle, symbol);
-    if (ret == NULL)
-        platform_set_last_error();
-    return ret;
+    struct pool_item *item;
+    size_t i;
+    // keep items aligned like malloc()
+    size = (size + 15) & ~(size_t)15;
+    mutex_lock(&pool->lock);
+    if (pool->free_list == NULL)
+    {
+        char *chunk = (char*)mem_alloc(size * POOL_CHUNK_ITEMS);
+        for (i = 0; chunk && i < POOL_CHUNK_ITEMS; ++i)
+        {
+            item = (struct pool_item*)(chunk + i * size);
+            item->next = pool->free_list;
+            pool->free_list = item;
+        }
+    }
+    item = pool->free_list;
+    if (item)
+        pool->free_list = item->next;
+    mutex_unlock(&pool->lock);
+    return item;
 }
 
-LIBDYLIB_DEFINE(dylib_ref, open_list)(const char *path, ...)
+static void pool_free (struct fixed_pool *pool, void *ptr)
 {
-    va_list args;
-    va_start(args, path);
-    dylib_ref ret = LIBDYLIB_NAME(va_open_list)(path, args);
-    va_end(args);
-    return ret;
+    struct pool_item *item = (struct pool_item*)ptr;
+    if (item == NULL)
+        return;
+    mutex_lock(&pool->lock);
+    item->next = pool->free_list;
+    pool->free_list = item;
+    mutex_unlock(&pool->lock);
 }
 
-LIBDYLIB_DEFINE(dylib_ref, va_open_list)(const char *path, va_list args)
+#define INTERN_BUCKETS 256
+struct interned_path {
+    uint32_t hash;
+    struct interned_path *next;
+    char path[1];
+};
+static struct {
+    mutex_t lock;
+    struct interned_path *buckets[INTERN_BUCKETS];
+} interned_paths = {MUTEX_INIT, {NULL}};
+
+// returns a copy of path that is kept until the process exits, or NULL if out
+// of memory - hash must be symbol_hash(path)
+static const char *intern_path (const char *path, uint32_t hash)
 {
-    const char *curpath = path;
-    dylib_ref ret = NULL;
-    while (curpath)
+    struct interned_path *entry;
+    mutex_lock(&interned_paths.lock);
+    for (entry = interned_paths.buckets[hash % INTERN_BUCKETS]; entry; entry = entry->next)
     {
-        ret = LIBDYLIB_NAME(open)(curpath);
-        if (ret)
+        if (entry->hash == hash && strcmp(entry->path, path) == 0)
             break;
-        curpath = va_arg(args, const char*);
     }
-    return ret;
+    if (entry == NULL)
+    {
+        size_t len = strlen(path);
+        entry = (struct interned_path*)mem_alloc(sizeof(*entry) + len);
+        if (entry)
+        {
+            entry->hash = hash;
+            memcpy(entry->path, path, len + 1);
+            entry->next = interned_paths.buckets[hash % INTERN_BUCKETS];
+            interned_paths.buckets[hash % INTERN_BUCKETS] = entry;
+        }
+    }
+    mutex_unlock(&interned_paths.lock);
+    return entry ? entry->path : NULL;
 }
 
-const char *locate_patterns[] =
-#if defined(LIBDYLIB_APPLE)
-    {"lib%s.dylib", "%s.framework/%s", "%s.dylib", "lib%s.so", "%s.so"}
-#elif defined(LIBDYLIB_LINUX)
-    {"lib%s.so", "%s.so"}
-#elif defined(LIBDYLIB_WINDOWS)
-    {"%s.dll", "lib%s.dll"}
+// Library handles: the dylib_ref values given to callers are not pointers,
+// but the index of a slot in a table of handles tagged with the generation of
+// the slot. The generation changes whenever the slot's library is freed, and
+// freed slots are only reused once more than HANDLE_REUSE_DELAY others are
+// free, so a handle that was already closed is rejected instead of being
+// taken for a library that was opened later at the same address. Slots are
+// allocated in chunks that are never freed, so they are read without a lock.
+#if UINTPTR_MAX > 0xffffffffu
+    #define HANDLE_INDEX_BITS 20
 #else
-    #warning "Falling back to default open_locate patterns"
-    {"lib%s.so", "%s.so"}
+    #define HANDLE_INDEX_BITS 14
 #endif
-;
+#define HANDLE_MAX ((size_t)1 << HANDLE_INDEX_BITS)
+#define HANDLE_CHUNK 256
+#define HANDLE_REUSE_DELAY 64
+struct handle_slot {
+    dylib_ref lib; // NULL unless the handle is valid, read atomically
+    uintptr_t generation;
+    size_t next_free; // index of the next slot in the free list, or 0
+};
+static struct {
+    mutex_t lock;
+    struct handle_slot *chunks[HANDLE_MAX / HANDLE_CHUNK]; // read atomically
+    size_t count; // slots used so far - slot 0 is never used
+    size_t free_head, free_tail, free_count; // freed slots, oldest first
+} handles = {MUTEX_INIT, {NULL}, 1, 0, 0, 0};
+
+static size_t handle_index (dylib_ref ref)
+{
+    return (size_t)((uintptr_t)ref & (HANDLE_MAX - 1));
+}
 
-char *simple_format(const char *pattern, const char *str)
+static struct handle_slot *handle_slot (size_t index)
 {
-    size_t i_in = 0,
-           i_out = 0,
-           len_p = strlen(pattern),
-           len_s = strlen(str),
-           len_out = len_p;
+    struct handle_slot *chunk = (struct handle_slot*)atomic_load_ptr(&handles.chunks[index / HANDLE_CHUNK]);
+    return chunk ? &chunk[index % HANDLE_CHUNK] : NULL;
+}
+
+// gives lib a slot and sets lib->ref - returns false if out of memory or slots
+static bool handle_alloc (dylib_ref lib)
+{
+    size_t index = 0;
+    mutex_lock(&handles.lock);
+    if (handles.free_count > HANDLE_REUSE_DELAY || (handles.free_count && handles.count == HANDLE_MAX))
     {
-        const char *tmp = pattern;
-        while ((tmp = strstr(tmp, "%s")))
-        {
-            len_out += len_s - 2;
-            ++tmp;
-        }
+        index = handles.free_head;
+        handles.free_head = handle_slot(index)->next_free;
+        if (--handles.free_count == 0)
+            handles.free_tail = 0;
     }
-    char *out = (char*)malloc((len_out + 1) * sizeof(char));
-    while (i_in < len_p)
+    else if (handles.count < HANDLE_MAX)
     {
-        if (pattern[i_in] == '%' && pattern[i_in + 1] == 's')
-        {
-            strcpy(out + i_out, str);
-            i_in += 2;
-            i_out += len_s;
-        }
-        else if (pattern[i_in] == '%' && pattern[i_in + 1] == '%')
-        {
-            out[i_out++] = '%';
-            i_in += 2;
-        }
-        else
+        struct handle_slot **chunk = &handles.chunks[handles.count / HANDLE_CHUNK];
+        if (*chunk == NULL)
         {
-            out[i_out++] = pattern[i_in++];
+            struct handle_slot *slots = (struct handle_slot*)mem_calloc(HANDLE_CHUNK, sizeof(*slots));
+            if (slots)
+                atomic_store_ptr(chunk, slots);
         }
+        if (*chunk)
+            index = handles.count++;
     }
-    out[len_out] = 0;
-    return out;
-}
-
-LIBDYLIB_DEFINE(dylib_ref, open_locate)(const char *name)
-{
-    dylib_ref lib = NULL;
-    size_t i;
-    for (i = 0; i < (sizeof(locate_patterns) / sizeof(locate_patterns[0])); ++i)
+    if (index)
     {
-        char *path = simple_format(locate_patterns[i], name);
-        lib = LIBDYLIB_NAME(open)(path);
-        if (lib != NULL)
-            break;
-        else
-            free(path);
+        struct handle_slot *slot = handle_slot(index);
+        atomic_store_ptr(&lib->ref, (dylib_ref)(slot->generation << HANDLE_INDEX_BITS | index));
+        atomic_store_ptr(&slot->lib, lib);
     }
-    if (lib == NULL)
-        lib = LIBDYLIB_NAME(open)(name);
-    return lib;
+    mutex_unlock(&handles.lock);
+    return index != 0;
 }
 
-LIBDYLIB_DEFINE(bool, bind)(dylib_ref lib, const char *symbol, void **dest)
+// makes lib->ref invalid, while lib may still be in use by lookups that
+// started before - sequentially consistent, so that any handle_enter() that
+// still finds lib afterwards is seen by readers_hold()
+static void handle_unpublish (dylib_ref lib)
 {
-    *dest = LIBDYLIB_NAME(lookup)(lib, symbol);
-    return *dest != 0;
+    struct handle_slot *slot = handle_slot(handle_index(lib->ref));
+    if (atomic_load_ptr(&slot->lib) == lib)
+        atomic_store_ptr_seq(&slot->lib, NULL);
 }
 
-LIBDYLIB_DEFINE(bool, find)(dylib_ref lib, const char *symbol)
+// returns the slot of a library that is being freed to the free list
+static void handle_free (dylib_ref lib)
 {
-    return LIBDYLIB_NAME(lookup)(lib, symbol) != NULL;
+    size_t index = handle_index(lib->ref);
+    struct handle_slot *slot = handle_slot(index);
+    mutex_lock(&handles.lock);
+    atomic_store_ptr(&slot->lib, NULL);
+    atomic_store_ptr(&lib->ref, NULL);
+    slot->generation = (slot->generation + 1) & (UINTPTR_MAX >> HANDLE_INDEX_BITS);
+    slot->next_free = 0;
+    if (handles.free_tail)
+        handle_slot(handles.free_tail)->next_free = index;
+    else
+        handles.free_head = index;
+    handles.free_tail = index;
+    ++handles.free_count;
+    mutex_unlock(&handles.lock);
 }
 
-LIBDYLIB_DEFINE(bool, find_any)(dylib_ref lib, ...)
+// returns the library of a handle given to a caller, or NULL if the handle
+// is not valid (any more) - the library must be protected from being freed
+// by the caller (see handle_enter())
+static dylib_ref handle_lookup (dylib_ref ref)
 {
-    va_list args;
-    va_start(args, lib);
-    bool ret = LIBDYLIB_NAME(va_find_any)(lib, args);
-    va_end(args);
-    return ret;
+    struct handle_slot *slot = handle_slot(handle_index(ref));
+    dylib_ref lib = slot ? (dylib_ref)atomic_load_ptr(&slot->lib) : NULL;
+    return lib && (dylib_ref)atomic_load_ptr(&lib->ref) == ref ? lib : NULL;
 }
-LIBDYLIB_DEFINE(bool, va_find_any)(dylib_ref lib, va_list args)
+
+static struct fixed_pool dylib_data_pool = {MUTEX_INIT, NULL};
+// changes whenever libdylib loads or unloads a library
+static uint64_t loaded_generation = 1;
+static uint64_t load_counter;
+
+static dylib_ref dylib_ref_alloc (void *handle, const char *path)
 {
-    const char *cursym = NULL;
-    bool ret = 0;
-    while (!ret && (cursym = va_arg(args, const char*)))
+    if (handle == NULL)
+        return NULL;
+    dylib_ref ref = (dylib_ref)pool_alloc(&dylib_data_pool, sizeof(*ref));
+    if (ref == NULL)
+        return NULL;
+    if (!handle_alloc(ref))
     {
-        if (LIBDYLIB_NAME(lookup)(lib, cursym))
-            ret = 1;
+        pool_free(&dylib_data_pool, ref);
+        return NULL;
     }
-    return ret;
+    ref->handle = handle;
+    ref->path = path;
+    ref->is_self = false;
+    ref->flags = 0;
+    ref->refcount = 1;
+    ref->has_file_id = false;
+    ref->aliases = NULL;
+    ref->addr_index = NULL;
+    ref->fd = -1;
+    ref->ns = LIBDYLIB_NAMESPACE_BASE;
+    ref->load_seq = atomic_add64(&load_counter, 1);
+    ref->keep_loaded = false;
+    memset(ref->first_memo, 0, sizeof(ref->first_memo));
+    atomic_add64(&loaded_generation, 1);
+    memset(&ref->cache, 0, sizeof(ref->cache));
+    mutex_t lock = MUTEX_INIT;
+    ref->cache.lock = lock;
+    ref->counters = NULL;
+    ref->retired_epoch = 0;
+    ref->next_retired = NULL;
+#ifdef LIBDYLIB_ELF
+    memset(&ref->elf, 0, sizeof(ref->elf));
+#endif
+    return ref;
+}
+
+static void symbol_cache_free (struct symbol_cache *cache);
+static void addr_object_free (struct addr_object *obj);
+
+static void dylib_ref_free (dylib_ref ref)
+{
+    size_t i;
+    if (ref == NULL)
+        return;
+    handle_free(ref);
+    symbol_cache_free(&ref->cache);
+    addr_object_free(ref->addr_index);
+    mem_free(ref->addr_index);
+    for (i = 0; i < LOOKUP_FIRST_MEMO; ++i)
+        mem_free(ref->first_memo[i]);
+    mem_free(ref->counters);
+    atomic_add64(&loaded_generation, 1);
+    pool_free(&dylib_data_pool, ref);
 }
-LIBDYLIB_DEFINE(bool, find_all)(dylib_ref lib, ...)
+
+static void platform_set_last_error(dylib_error code);
+static void *platform_raw_open (const char *path, int flags);
+static void *platform_raw_open_self();
+static void *platform_raw_open_namespace (const char *path, int flags, dylib_namespace ns);
+static bool platform_handle_namespace (void *handle, dylib_namespace *ns);
+static bool platform_raw_close (void *handle);
+static void *platform_raw_lookup (void *handle, const char *symbol);
+static bool platform_file_id (const char *path, uint64_t *dev, uint64_t *ino);
+static const char *platform_loaded_path (void *handle);
+static bool platform_canonical_path (const char *path, char *buf);
+static bool platform_is_file (const char *path);
+static void platform_prefetch (const char *path);
+
+#define check_null_arg_code(arg, code, msg, ret) if (arg == NULL) {set_error(code, msg); return ret; }
+#define check_null_arg(arg, msg, ret) check_null_arg_code(arg, LIBDYLIB_E_NULL_ARG, msg, ret)
+#define check_null_handle(handle, ret) check_null_arg_code(handle, LIBDYLIB_E_NULL_HANDLE, "NULL library handle", ret)
+#define check_null_path(path, ret) check_null_arg(path, "NULL library path", ret)
+
+static void set_invalid_handle_error()
 {
-    va_list args;
-    va_start(args, lib);
-    bool ret = LIBDYLIB_NAME(va_find_all)(lib, args);
-    va_end(args);
-    return ret;
+    set_error(LIBDYLIB_E_INVALID_HANDLE, "Invalid or already closed library handle");
 }
-LIBDYLIB_DEFINE(bool, va_find_all)(dylib_ref lib, va_list args)
+
+// returns the library of a handle passed by the caller, or NULL with an error
+// set - the library can't be unloaded before the matching handle_exit()
+static dylib_ref handle_enter (dylib_ref ref);
+static void handle_exit();
+
+#if defined(LIBDYLIB_UNIX)
+#include <dlfcn.h>
+
+static void platform_set_last_error(dylib_error code)
 {
-    const char *cursym = NULL;
-    bool ret = 1;
-    while (ret && (cursym = va_arg(args, const char*)))
-    {
-        if (!LIBDYLIB_NAME(lookup)(lib, cursym))
-            ret = 0;
-    }
-    return ret;
+    set_error_copy(code, dlerror());
 }
 
-LIBDYLIB_DEFINE(const char*, last_error)()
+static int platform_open_mode (int flags)
 {
-    if (!last_err_set)
-        return NULL;
-    return last_err;
+    int mode = (flags & LIBDYLIB_OPEN_LAZY) ? RTLD_LAZY : RTLD_NOW;
+    mode |= (flags & LIBDYLIB_OPEN_GLOBAL) ? RTLD_GLOBAL : RTLD_LOCAL;
+#ifdef RTLD_NOLOAD
+    if (flags & LIBDYLIB_OPEN_NOLOAD)
+        mode |= RTLD_NOLOAD;
+#endif
+#ifdef RTLD_NODELETE
+    if (flags & LIBDYLIB_OPEN_NODELETE)
+        mode |= RTLD_NODELETE;
+#endif
+    return mode;
+}
+
+static void *platform_raw_open (const char *path, int flags)
+{
+    return (void*)dlopen(path, platform_open_mode(flags));
+}
+
+// ns is always LIBDYLIB_NAMESPACE_BASE without dlmopen()
+static void *platform_raw_open_namespace (const char *path, int flags, dylib_namespace ns)
+{
+#ifdef LM_ID_NEWLM
+    if (ns != LIBDYLIB_NAMESPACE_BASE)
+        return (void*)dlmopen(ns == LIBDYLIB_NAMESPACE_NEW ? LM_ID_NEWLM : (Lmid_t)ns, path, platform_open_mode(flags));
+#else
+    (void)ns;
+#endif
+    return platform_raw_open(path, flags);
+}
+
+// returns false if the namespace of handle is unknown, leaving the error for
+// platform_set_last_error()
+static bool platform_handle_namespace (void *handle, dylib_namespace *ns)
+{
+#ifdef LM_ID_NEWLM
+    Lmid_t id;
+    if (dlinfo(handle, RTLD_DI_LMID, &id) != 0)
+        return false;
+    *ns = (dylib_namespace)id;
+#else
+    (void)handle;
+    *ns = LIBDYLIB_NAMESPACE_BASE;
+#endif
+    return true;
+}
+
+static void *platform_raw_open_self()
+{
+#ifdef RTLD_SELF
+    return (void*)RTLD_SELF;
+#else
+    return dlopen(NULL, RTLD_NOW);
+#endif
+}
+
+static bool platform_raw_close (void *handle)
+{
+    return dlclose(handle) == 0;
+}
+
+static void *platform_raw_lookup (void *handle, const char *symbol)
+{
+    return dlsym(handle, symbol);
+}
+
+static bool platform_file_id (const char *path, uint64_t *dev, uint64_t *ino)
+{
+    struct stat st;
+    if (stat(path, &st) != 0)
+        return false;
+    *dev = (uint64_t)st.st_dev;
+    *ino = (uint64_t)st.st_ino;
+    return true;
+}
+
+// returns the path the loader actually used for a handle, or NULL if unknown
+static const char *platform_loaded_path (void *handle)
+{
+#ifdef LIBDYLIB_ELF
+    struct link_map *map = NULL;
+    if (dlinfo(handle, RTLD_DI_LINKMAP, &map) == 0 && map && map->l_name && map->l_name[0])
+        return map->l_name;
+    dlerror();
+#else
+    (void)handle;
+#endif
+    return NULL;
+}
+
+// stores the absolute path with symlinks resolved in buf (PATH_BUF_SIZE bytes)
+static bool platform_canonical_path (const char *path, char *buf)
+{
+#ifdef PATH_MAX
+    return realpath(path, buf) != NULL;
+#else
+    (void)path; (void)buf;
+    return false;
+#endif
+}
+
+static bool platform_is_file (const char *path)
+{
+    struct stat st;
+    return stat(path, &st) == 0 && S_ISREG(st.st_mode);
+}
+
+// start reading a library file into the page cache
+static void platform_prefetch (const char *path)
+{
+#ifdef POSIX_FADV_WILLNEED
+    if (!strchr(path, '/'))
+        return;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+    close(fd);
+#else
+    (void)path;
+#endif
+}
+
+// end LIBDYLIB_UNIX
+#elif defined(LIBDYLIB_WINDOWS)
+#include <Windows.h>
+
+static void platform_set_last_error(dylib_error code)
+{
+    // Based on http://stackoverflow.com/questions/1387064
+    DWORD err = GetLastError();
+    if (!err)
+        set_error_copy(code, NULL);
+    else
+    {
+        FormatMessageA(FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_IGNORE_INSERTS,
+            NULL, err, MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT), set_error_buffer(code), ERR_MAX_SIZE, NULL);
+    }
+}
+
+static void *platform_raw_open (const char *path, int flags)
+{
+    HMODULE module = NULL;
+    if (flags & LIBDYLIB_OPEN_NOLOAD)
+        GetModuleHandleExA(0, path, &module);
+    else
+        module = LoadLibraryA(path);
+    if (module && (flags & LIBDYLIB_OPEN_NODELETE))
+    {
+        HMODULE pinned;
+        GetModuleHandleExA(GET_MODULE_HANDLE_EX_FLAG_PIN, path, &pinned);
+    }
+    return (void*)module;
+}
+
+static void *platform_raw_open_self()
+{
+    return (void*)GetModuleHandle(NULL);
+}
+
+// there is a single namespace on Windows
+static void *platform_raw_open_namespace (const char *path, int flags, dylib_namespace ns)
+{
+    (void)ns;
+    return platform_raw_open(path, flags);
+}
+
+static bool platform_handle_namespace (void *handle, dylib_namespace *ns)
+{
+    (void)handle;
+    *ns = LIBDYLIB_NAMESPACE_BASE;
+    return true;
+}
+
+static bool platform_raw_close (void *handle)
+{
+    return FreeLibrary((HMODULE)handle);
+}
+
+static void *platform_raw_lookup (void *handle, const char *symbol)
+{
+    return (void*)GetProcAddress((HMODULE)handle, symbol);
+}
+
+// libraries are only identified by their module handles on Windows
+static bool platform_file_id (const char *path, uint64_t *dev, uint64_t *ino)
+{
+    (void)path; (void)dev; (void)ino;
+    return false;
+}
+
+static const char *platform_loaded_path (void *handle)
+{
+    (void)handle;
+    return NULL;
+}
+
+static bool platform_canonical_path (const char *path, char *buf)
+{
+    (void)path; (void)buf;
+    return false;
+}
+
+static void platform_prefetch (const char *path)
+{
+    (void)path;
+}
+
+static bool platform_is_file (const char *path)
+{
+    DWORD attrs = GetFileAttributesA(path);
+    return attrs != INVALID_FILE_ATTRIBUTES && !(attrs & FILE_ATTRIBUTE_DIRECTORY);
+}
+
+// end LIBDYLIB_WINDOWS
+#else
+#error "unrecognized platform"
+#endif
+
+#if defined(LIBDYLIB_ELF)
+// Direct ELF symbol lookup (LIBDYLIB_OPEN_ELF_LOOKUP): symbols are resolved
+// from the hash tables of the mapped object without taking the loader lock.
+// Anything that needs the dynamic linker (IFUNCs, TLS, unique symbols, hidden
+// versions, and symbols not defined by the object itself) is left to
+// platform_raw_lookup().
+
+#define ELF_ST_BIND(info) ((info) >> 4)
+#define ELF_ST_TYPE(info) ((info) & 0xf)
+#define ELF_VERSYM_HIDDEN 0x8000
+
+static const void *elf_dyn_ptr (ElfW(Addr) base, ElfW(Addr) ptr)
+{
+    // glibc relocates these entries in place on most architectures, but not all
+    return (const void*)(ptr < base ? ptr + base : ptr);
+}
+
+static bool elf_object_init (struct elf_object *obj, ElfW(Addr) base, const ElfW(Phdr) *phdr, ElfW(Half) phnum)
+{
+    const ElfW(Dyn) *dyn = NULL;
+    const uint32_t *gnu_hash = NULL;
+    ElfW(Half) i;
+    memset(obj, 0, sizeof(*obj));
+    obj->base = base;
+    obj->phdr = phdr;
+    obj->phnum = phnum;
+    for (i = 0; i < phnum; ++i)
+    {
+        if (phdr[i].p_type == PT_DYNAMIC)
+            dyn = (const ElfW(Dyn)*)(base + phdr[i].p_vaddr);
+    }
+    if (dyn == NULL)
+        return false;
+    for (; dyn->d_tag != DT_NULL; ++dyn)
+    {
+        switch (dyn->d_tag)
+        {
+        case DT_SYMTAB:
+            obj->symtab = (const ElfW(Sym)*)elf_dyn_ptr(base, dyn->d_un.d_ptr);
+            break;
+        case DT_STRTAB:
+            obj->strtab = (const char*)elf_dyn_ptr(base, dyn->d_un.d_ptr);
+            break;
+        case DT_VERSYM:
+            obj->versym = (const ElfW(Half)*)elf_dyn_ptr(base, dyn->d_un.d_ptr);
+            break;
+        case DT_GNU_HASH:
+            gnu_hash = (const uint32_t*)elf_dyn_ptr(base, dyn->d_un.d_ptr);
+            break;
+        case DT_HASH:
+            obj->sysv_hash = (const uint32_t*)elf_dyn_ptr(base, dyn->d_un.d_ptr);
+            break;
+        }
+    }
+    if (gnu_hash)
+    {
+        obj->gnu_nbuckets = gnu_hash[0];
+        obj->gnu_symoffset = gnu_hash[1];
+        obj->gnu_bloom_size = gnu_hash[2];
+        obj->gnu_bloom_shift = gnu_hash[3];
+        obj->gnu_bloom = (const ElfW(Addr)*)(gnu_hash + 4);
+        obj->gnu_buckets = (const uint32_t*)(obj->gnu_bloom + obj->gnu_bloom_size);
+        obj->gnu_chain = obj->gnu_buckets + obj->gnu_nbuckets;
+        if (!obj->gnu_nbuckets || !obj->gnu_bloom_size)
+            obj->gnu_buckets = NULL;
+    }
+    obj->valid = obj->symtab && obj->strtab && (obj->gnu_buckets || obj->sysv_hash);
+    return obj->valid;
+}
+
+struct elf_find_data {
+    const struct link_map *map;
+    struct elf_object *obj;
+};
+
+static int elf_find_callback (struct dl_phdr_info *info, size_t size, void *data)
+{
+    struct elf_find_data *find = (struct elf_find_data*)data;
+    ElfW(Half) i;
+    (void)size;
+    if (info->dlpi_addr != find->map->l_addr)
+        return 0;
+    // several objects can share a base address (e.g. 0 for non-PIE executables
+    // and the vDSO), but not a dynamic section
+    for (i = 0; i < info->dlpi_phnum; ++i)
+    {
+        if (info->dlpi_phdr[i].p_type == PT_DYNAMIC &&
+            info->dlpi_addr + info->dlpi_phdr[i].p_vaddr == (ElfW(Addr))find->map->l_ld)
+        {
+            elf_object_init(find->obj, info->dlpi_addr, info->dlpi_phdr, info->dlpi_phnum);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static bool elf_object_from_handle (struct elf_object *obj, void *handle)
+{
+    struct link_map *map = NULL;
+    struct elf_find_data find;
+    memset(obj, 0, sizeof(*obj));
+    if (dlinfo(handle, RTLD_DI_LINKMAP, &map) != 0 || map == NULL)
+    {
+        dlerror();
+        return false;
+    }
+    find.map = map;
+    find.obj = obj;
+    dl_iterate_phdr(elf_find_callback, &find);
+    return obj->valid;
+}
+
+static uint32_t elf_sysv_hash (const char *symbol)
+{
+    uint32_t h = 0, g;
+    for (; *symbol; ++symbol)
+    {
+        h = (h << 4) + (unsigned char)*symbol;
+        g = h & 0xf0000000U;
+        if (g)
+            h ^= g >> 24;
+        h &= ~g;
+    }
+    return h;
+}
+
+// returns true and sets *addr if symbol index idx is a plain definition of symbol
+static bool elf_match_symbol (const struct elf_object *obj, uint32_t idx, const char *symbol, void **addr)
+{
+    const ElfW(Sym) *sym = &obj->symtab[idx];
+    if (sym->st_shndx == SHN_UNDEF || sym->st_shndx == SHN_ABS)
+        return false;
+    if (strcmp(obj->strtab + sym->st_name, symbol) != 0)
+        return false;
+    if (obj->versym && ((obj->versym[idx] & ELF_VERSYM_HIDDEN) || obj->versym[idx] == 0))
+        return false;
+    if (ELF_ST_TYPE(sym->st_info) == STT_GNU_IFUNC || ELF_ST_TYPE(sym->st_info) == STT_TLS)
+        return false;
+    if (ELF_ST_BIND(sym->st_info) != STB_GLOBAL && ELF_ST_BIND(sym->st_info) != STB_WEAK)
+        return false;
+    *addr = (void*)(obj->base + sym->st_value);
+    return true;
+}
+
+// hash is symbol_hash(symbol), which is the GNU ELF hash
+// returns false if the symbol should be resolved by the platform instead
+static bool elf_lookup (const struct elf_object *obj, const char *symbol, uint32_t hash, void **addr)
+{
+    uint32_t idx;
+    if (obj->gnu_buckets)
+    {
+        const uint32_t word_bits = sizeof(ElfW(Addr)) * 8;
+        ElfW(Addr) word = obj->gnu_bloom[(hash / word_bits) % obj->gnu_bloom_size];
+        ElfW(Addr) mask = ((ElfW(Addr))1 << (hash % word_bits)) |
+                          ((ElfW(Addr))1 << ((hash >> obj->gnu_bloom_shift) % word_bits));
+        if ((word & mask) != mask)
+            return false;
+        idx = obj->gnu_buckets[hash % obj->gnu_nbuckets];
+        if (idx < obj->gnu_symoffset)
+            return false;
+        for (;; ++idx)
+        {
+            uint32_t chain_hash = obj->gnu_chain[idx - obj->gnu_symoffset];
+            if ((chain_hash | 1) == (hash | 1) && elf_match_symbol(obj, idx, symbol, addr))
+                return true;
+            if (chain_hash & 1)
+                return false;
+        }
+    }
+    else
+    {
+        uint32_t nbuckets = obj->sysv_hash[0];
+        const uint32_t *buckets = obj->sysv_hash + 2, *chain = buckets + nbuckets;
+        if (!nbuckets)
+            return false;
+        for (idx = buckets[elf_sysv_hash(symbol) % nbuckets]; idx != STN_UNDEF; idx = chain[idx])
+        {
+            if (elf_match_symbol(obj, idx, symbol, addr))
+                return true;
+        }
+    }
+    return false;
+}
+
+// ELF files, read through a read-only mapping without loading them. Only
+// files of the host byte order are supported. All offsets are checked
+// against the size of the file.
+
+static unsigned char elf_host_data()
+{
+    const uint16_t one = 1;
+    return *(const unsigned char*)&one ? ELFDATA2LSB : ELFDATA2MSB;
+}
+
+// returns a pointer to size bytes at offset, or NULL if out of bounds or misaligned
+static const void *elf_file_range (const struct elf_file *f, uint64_t offset, uint64_t size, uint64_t align)
+{
+    if (offset > f->size || size > f->size - offset || (align > 1 && offset % align))
+        return NULL;
+    return f->data + offset;
+}
+
+// f->data and f->size must be set
+static bool elf_file_parse_header (struct elf_file *f)
+{
+    const unsigned char *ident = f->data;
+    if (f->size < EI_NIDENT || memcmp(ident, ELFMAG, SELFMAG) != 0 || ident[EI_DATA] != elf_host_data())
+        return false;
+    if (ident[EI_CLASS] == ELFCLASS64 && f->size >= sizeof(Elf64_Ehdr))
+    {
+        const Elf64_Ehdr *eh = (const Elf64_Ehdr*)f->data;
+        f->is64 = true;
+        f->type = eh->e_type;
+        f->machine = eh->e_machine;
+        f->phoff = eh->e_phoff;
+        f->shoff = eh->e_shoff;
+        f->phnum = eh->e_phnum;
+        f->phentsize = eh->e_phentsize;
+        f->shnum = eh->e_shnum;
+        f->shentsize = eh->e_shentsize;
+    }
+    else if (ident[EI_CLASS] == ELFCLASS32 && f->size >= sizeof(Elf32_Ehdr))
+    {
+        const Elf32_Ehdr *eh = (const Elf32_Ehdr*)f->data;
+        f->is64 = false;
+        f->type = eh->e_type;
+        f->machine = eh->e_machine;
+        f->phoff = eh->e_phoff;
+        f->shoff = eh->e_shoff;
+        f->phnum = eh->e_phnum;
+        f->phentsize = eh->e_phentsize;
+        f->shnum = eh->e_shnum;
+        f->shentsize = eh->e_shentsize;
+    }
+    else
+        return false;
+    if (f->shnum && f->shentsize < (f->is64 ? sizeof(Elf64_Shdr) : sizeof(Elf32_Shdr)))
+        return false;
+    if (f->phnum && f->phentsize < (f->is64 ? sizeof(Elf64_Phdr) : sizeof(Elf32_Phdr)))
+        return false;
+    return true;
+}
+
+// the machine type of the object containing this library
+static uint16_t elf_host_machine()
+{
+    static uint16_t machine = EM_NONE;
+    Dl_info info;
+    if (machine == EM_NONE && dladdr((void*)&elf_host_machine, &info) && info.dli_fbase)
+        machine = ((const ElfW(Ehdr)*)info.dli_fbase)->e_machine;
+    return machine;
+}
+
+// returns true if path is a shared object loadable by this process, based on
+// its ELF header alone
+static bool elf_file_probe (const char *path)
+{
+    unsigned char header[sizeof(Elf64_Ehdr)];
+    struct elf_file f;
+    ssize_t size;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+    do
+        size = read(fd, header, sizeof(header));
+    while (size < 0 && errno == EINTR);
+    close(fd);
+    if (size <= 0)
+        return false;
+    memset(&f, 0, sizeof(f));
+    f.data = header;
+    f.size = (size_t)size;
+    if (!elf_file_parse_header(&f) || f.type != ET_DYN)
+        return false;
+    return f.is64 == (sizeof(ElfW(Ehdr)) == sizeof(Elf64_Ehdr)) &&
+        (elf_host_machine() == EM_NONE || f.machine == elf_host_machine());
+}
+
+static void elf_file_unmap (struct elf_file *f)
+{
+    if (f->data)
+        munmap((void*)f->data, f->size);
+    f->data = NULL;
+}
+
+// maps a regular file read-only, setting an error on failure
+static bool map_file (const char *path, const unsigned char **data, size_t *size)
+{
+    struct stat st;
+    void *addr;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        set_error_errno(LIBDYLIB_E_OPEN_FAILED, path);
+        return false;
+    }
+    if (fstat(fd, &st) != 0)
+    {
+        set_error_errno(LIBDYLIB_E_OPEN_FAILED, path);
+        close(fd);
+        return false;
+    }
+    if (!S_ISREG(st.st_mode) || st.st_size == 0)
+    {
+        set_error_detail(LIBDYLIB_E_BAD_FORMAT, "Not a regular file", path);
+        close(fd);
+        return false;
+    }
+    addr = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED)
+    {
+        set_error_errno(LIBDYLIB_E_OPEN_FAILED, path);
+        return false;
+    }
+    *data = (const unsigned char*)addr;
+    *size = (size_t)st.st_size;
+    return true;
+}
+
+static bool elf_file_map (struct elf_file *f, const char *path)
+{
+    memset(f, 0, sizeof(*f));
+    if (!map_file(path, &f->data, &f->size))
+    {
+        if (last_err.code == LIBDYLIB_E_BAD_FORMAT)
+            set_error_detail(LIBDYLIB_E_BAD_FORMAT, "Not an ELF file", path);
+        return false;
+    }
+    if (!elf_file_parse_header(f))
+    {
+        set_error_detail(LIBDYLIB_E_BAD_FORMAT, "Not an ELF file", path);
+        elf_file_unmap(f);
+        return false;
+    }
+    return true;
+}
+
+static bool elf_file_section (const struct elf_file *f, uint32_t idx, struct elf_file_section *sec)
+{
+    if (idx >= f->shnum)
+        return false;
+    uint64_t offset = f->shoff + (uint64_t)idx * f->shentsize;
+    if (f->is64)
+    {
+        const Elf64_Shdr *sh = (const Elf64_Shdr*)elf_file_range(f, offset, sizeof(Elf64_Shdr), 8);
+        if (sh == NULL)
+            return false;
+        sec->type = sh->sh_type;
+        sec->link = sh->sh_link;
+        sec->addr = sh->sh_addr;
+        sec->offset = sh->sh_offset;
+        sec->size = sh->sh_size;
+        sec->entsize = sh->sh_entsize;
+    }
+    else
+    {
+        const Elf32_Shdr *sh = (const Elf32_Shdr*)elf_file_range(f, offset, sizeof(Elf32_Shdr), 4);
+        if (sh == NULL)
+            return false;
+        sec->type = sh->sh_type;
+        sec->link = sh->sh_link;
+        sec->addr = sh->sh_addr;
+        sec->offset = sh->sh_offset;
+        sec->size = sh->sh_size;
+        sec->entsize = sh->sh_entsize;
+    }
+    return true;
+}
+
+// returns the contents of a string table section, or NULL if it is invalid
+static const char *elf_file_strtab (const struct elf_file *f, uint32_t idx, uint64_t *size)
+{
+    struct elf_file_section sec;
+    const char *strtab;
+    if (!elf_file_section(f, idx, &sec) || sec.type != SHT_STRTAB || !sec.size)
+        return NULL;
+    strtab = (const char*)elf_file_range(f, sec.offset, sec.size, 1);
+    // a terminated last string means every offset below size is a valid string
+    if (strtab == NULL || strtab[sec.size - 1] != 0)
+        return NULL;
+    *size = sec.size;
+    return strtab;
+}
+
+static bool elf_symbols_init (dylib_symbols_ref it)
+{
+    const struct elf_file *f = &it->file;
+    struct elf_file_section sec, versym_sec;
+    uint32_t i;
+    bool has_versym = false;
+    uint64_t min_entsize = f->is64 ? sizeof(Elf64_Sym) : sizeof(Elf32_Sym);
+    for (i = 0; i < f->shnum; ++i)
+    {
+        if (!elf_file_section(f, i, &sec))
+            return false;
+        if (sec.type == SHT_DYNSYM && sec.entsize >= min_entsize)
+        {
+            it->symtab = (const unsigned char*)elf_file_range(f, sec.offset, sec.size, f->is64 ? 8 : 4);
+            it->sym_entsize = sec.entsize;
+            it->sym_count = sec.size / sec.entsize;
+            it->strtab = elf_file_strtab(f, sec.link, &it->strtab_size);
+        }
+        else if (sec.type == SHT_GNU_versym)
+        {
+            versym_sec = sec;
+            has_versym = true;
+        }
+        else if (sec.type == SHT_GNU_verdef)
+        {
+            it->verdef = (const unsigned char*)elf_file_range(f, sec.offset, sec.size, 4);
+            it->verdef_size = sec.size;
+            it->verdef_strtab = elf_file_strtab(f, sec.link, &it->verdef_strtab_size);
+        }
+    }
+    if (!it->symtab || !it->strtab)
+        return false;
+    if (has_versym && versym_sec.size / sizeof(uint16_t) >= it->sym_count)
+        it->versym = (const uint16_t*)elf_file_range(f, versym_sec.offset, versym_sec.size, 2);
+    if (!it->verdef_strtab)
+        it->verdef = NULL;
+    return true;
+}
+
+static const char *elf_symbols_version_name (dylib_symbols_ref it, uint16_t ndx)
+{
+    // Elf32_Verdef/Elf32_Verdaux have the same layout as the 64-bit versions
+    uint64_t offset = 0;
+    while (it->verdef && offset <= it->verdef_size && it->verdef_size - offset >= sizeof(Elf64_Verdef) && offset % 4 == 0)
+    {
+        const Elf64_Verdef *vd = (const Elf64_Verdef*)(it->verdef + offset);
+        if (vd->vd_ndx == ndx && !(vd->vd_flags & VER_FLG_BASE))
+        {
+            uint64_t aux = offset + vd->vd_aux;
+            if (aux % 4 || aux > it->verdef_size || it->verdef_size - aux < sizeof(Elf64_Verdaux))
+                return NULL;
+            uint32_t name = ((const Elf64_Verdaux*)(it->verdef + aux))->vda_name;
+            return name < it->verdef_strtab_size ? it->verdef_strtab + name : NULL;
+        }
+        if (!vd->vd_next)
+            break;
+        offset += vd->vd_next;
+    }
+    return NULL;
+}
+
+static bool elf_symbols_next (dylib_symbols_ref it, dylib_symbol_info *info)
+{
+    // index 0 is always the undefined symbol
+    if (it->next == 0)
+        it->next = 1;
+    for (; it->next < it->sym_count; ++it->next)
+    {
+        const unsigned char *entry = it->symtab + it->next * it->sym_entsize;
+        uint32_t name;
+        unsigned char st_info;
+        uint16_t shndx;
+        if (it->file.is64)
+        {
+            const Elf64_Sym *sym = (const Elf64_Sym*)entry;
+            name = sym->st_name;
+            st_info = sym->st_info;
+            shndx = sym->st_shndx;
+            info->value = sym->st_value;
+            info->size = sym->st_size;
+        }
+        else
+        {
+            const Elf32_Sym *sym = (const Elf32_Sym*)entry;
+            name = sym->st_name;
+            st_info = sym->st_info;
+            shndx = sym->st_shndx;
+            info->value = sym->st_value;
+            info->size = sym->st_size;
+        }
+        if (shndx == SHN_UNDEF || ELF_ST_BIND(st_info) == STB_LOCAL || name >= it->strtab_size)
+            continue;
+        info->name = it->strtab + name;
+        switch (ELF_ST_TYPE(st_info))
+        {
+            case STT_NOTYPE: info->type = LIBDYLIB_SYMTYPE_NOTYPE; break;
+            case STT_OBJECT:
+            case STT_COMMON: info->type = LIBDYLIB_SYMTYPE_OBJECT; break;
+            case STT_FUNC: info->type = LIBDYLIB_SYMTYPE_FUNC; break;
+            case STT_TLS: info->type = LIBDYLIB_SYMTYPE_TLS; break;
+            case STT_GNU_IFUNC: info->type = LIBDYLIB_SYMTYPE_IFUNC; break;
+            default: info->type = LIBDYLIB_SYMTYPE_OTHER; break;
+        }
+        switch (ELF_ST_BIND(st_info))
+        {
+            case STB_GLOBAL: info->binding = LIBDYLIB_SYMBIND_GLOBAL; break;
+            case STB_WEAK: info->binding = LIBDYLIB_SYMBIND_WEAK; break;
+            case STB_GNU_UNIQUE: info->binding = LIBDYLIB_SYMBIND_UNIQUE; break;
+            default: info->binding = LIBDYLIB_SYMBIND_OTHER; break;
+        }
+        info->version = NULL;
+        info->default_version = true;
+        if (it->versym)
+        {
+            uint16_t ver = it->versym[it->next];
+            info->default_version = !(ver & ELF_VERSYM_HIDDEN);
+            if ((ver & 0x7fff) > VER_NDX_GLOBAL)
+                info->version = elf_symbols_version_name(it, ver & 0x7fff);
+        }
+        ++it->next;
+        return true;
+    }
+    return false;
+}
+
+// end LIBDYLIB_ELF
+#endif
+
+// All platforms
+
+// Symbol cache: an open-addressed hash table (linear probing) mapping symbol
+// names to addresses. Failed lookups are stored too, with a NULL address.
+#define SYMBOL_CACHE_MIN_CAPACITY 64
+
+static uint32_t symbol_hash (const char *symbol)
+{
+    // same function as the GNU ELF hash (DT_GNU_HASH)
+    uint32_t h = 5381;
+    for (; *symbol; ++symbol)
+        h = (h << 5) + h + (unsigned char)*symbol;
+    return h;
+}
+
+static size_t symbol_cache_slot (uint32_t hash, size_t capacity)
+{
+    // the low bits of the GNU hash are weak for similar names - mix first
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bU;
+    hash ^= hash >> 13;
+    return (size_t)hash & (capacity - 1);
+}
+
+// returns the entry for symbol, or NULL - safe while another thread inserts
+static struct symbol_cache_entry *symbol_cache_find (struct symbol_cache_table *table, const char *symbol, uint32_t hash)
+{
+    size_t mask = table->capacity - 1, i = symbol_cache_slot(hash, table->capacity);
+    const char *name;
+    while ((name = (const char*)atomic_load_ptr(&table->entries[i].name)) != NULL)
+    {
+        if (table->entries[i].hash == hash && strcmp(name, symbol) == 0)
+            return &table->entries[i];
+        i = (i + 1) & mask;
+    }
+    return NULL;
+}
+
+// the caller must hold the cache lock
+static void symbol_cache_put (struct symbol_cache_table *table, char *name, uint32_t hash, void *addr)
+{
+    size_t mask = table->capacity - 1, i = symbol_cache_slot(hash, table->capacity);
+    while (table->entries[i].name)
+        i = (i + 1) & mask;
+    table->entries[i].hash = hash;
+    table->entries[i].addr = addr;
+    atomic_store_ptr(&table->entries[i].name, name);
+}
+
+// the caller must hold the cache lock
+static bool symbol_cache_grow (struct symbol_cache *cache)
+{
+    struct symbol_cache_table *old = cache->table;
+    size_t capacity = old ? old->capacity * 2 : SYMBOL_CACHE_MIN_CAPACITY, i;
+    struct symbol_cache_table *table = (struct symbol_cache_table*)mem_calloc(1,
+        sizeof(*table) + (capacity - 1) * sizeof(table->entries[0]));
+    if (table == NULL)
+        return false;
+    table->capacity = capacity;
+    table->replaced = old;
+    for (i = 0; old && i < old->capacity; ++i)
+    {
+        if (old->entries[i].name)
+            symbol_cache_put(table, old->entries[i].name, old->entries[i].hash, old->entries[i].addr);
+    }
+    atomic_store_ptr(&cache->table, table);
+    return true;
+}
+
+static void symbol_cache_free (struct symbol_cache *cache)
+{
+    struct symbol_cache_table *table = cache->table, *replaced;
+    size_t i;
+    // replaced tables share their names with the current one
+    for (i = 0; table && i < table->capacity; ++i)
+        mem_free(table->entries[i].name);
+    for (; table; table = replaced)
+    {
+        replaced = table->replaced;
+        mem_free(table);
+    }
+    cache->table = NULL;
+    cache->count = 0;
+}
+
+// counts a symbol cache lookup in lib, and in the totals
+static void symbol_cache_count (dylib_ref lib, bool hit)
+{
+    struct lookup_stripe *stripe = lookup_stripe(lib_counters(lib));
+    if (stripe)
+        atomic_add64(hit ? &stripe->cache_hits : &stripe->cache_misses, 1);
+#ifndef LIBDYLIB_NO_STATS
+    if (!stats_on())
+        return;
+    stripe = lookup_stripe(global_counters);
+    atomic_add64(hit ? &stripe->cache_hits : &stripe->cache_misses, 1);
+#endif
+}
+
+// resolves a symbol with the lookup engine selected for lib, bypassing the cache
+// hash is symbol_hash(symbol)
+static void *engine_lookup (dylib_ref lib, const char *symbol, uint32_t hash)
+{
+#ifdef LIBDYLIB_ELF
+    void *addr;
+    if (atomic_load_ptr(&lib->elf.valid) && elf_lookup(&lib->elf, symbol, hash, &addr))
+        return addr;
+#else
+    (void)hash;
+#endif
+    return platform_raw_lookup(lib->handle, symbol);
+}
+
+// lookups that hit the cache only read it, and misses are added under the
+// cache lock
+static void *symbol_cache_lookup (dylib_ref lib, const char *symbol, uint32_t hash)
+{
+    struct symbol_cache *cache = &lib->cache;
+    struct symbol_cache_table *table = (struct symbol_cache_table*)atomic_load_ptr(&cache->table);
+    struct symbol_cache_entry *entry = table ? symbol_cache_find(table, symbol, hash) : NULL;
+    if (entry)
+    {
+        symbol_cache_count(lib, true);
+        return entry->addr;
+    }
+    symbol_cache_count(lib, false);
+    void *addr = engine_lookup(lib, symbol, hash);
+    size_t len = strlen(symbol);
+    char *name = (char*)mem_alloc(len + 1);
+    if (name == NULL)
+        return addr;
+    memcpy(name, symbol, len + 1);
+    mutex_lock(&cache->lock);
+    table = cache->table;
+    // another thread may have added the symbol since, and the load factor is
+    // kept below 3/4
+    if ((table && symbol_cache_find(table, symbol, hash)) ||
+        ((!table || (cache->count + 1) * 4 > table->capacity * 3) && !symbol_cache_grow(cache)))
+    {
+        mutex_unlock(&cache->lock);
+        mem_free(name);
+        return addr;
+    }
+    symbol_cache_put(cache->table, name, hash, addr);
+    ++cache->count;
+    mutex_unlock(&cache->lock);
+    return addr;
+}
+
+LIBDYLIB_DEFINE(dylib_ref, open)(const char *path)
+{
+    return LIBDYLIB_NAME(open_ex)(path, 0);
+}
+
+// Handle registry: every open library has exactly one dylib_data, shared by
+// all callers that open it and freed when the last of them closes it. Paths
+// that were used to open a library (and its canonical path) are kept as
+// aliases, so opening a library that is already open doesn't involve the
+// loader at all. Other paths are matched by file identity before loading, and
+// by platform handle after loading.
+#define REGISTRY_BUCKETS 256
+struct registry_alias {
+    uint32_t hash;
+    dylib_ref ref;
+    struct registry_alias *next;        // next alias in the same bucket
+    struct registry_alias *next_alias;  // next alias of the same library
+    const char *path;                   // interned
+};
+static struct fixed_pool registry_alias_pool = {MUTEX_INIT, NULL};
+static struct {
+    rwlock_t lock;
+    struct registry_alias *buckets[REGISTRY_BUCKETS];
+    dylib_ref *refs; // every open library, including self_ref
+    size_t count, capacity;
+    dylib_ref self_ref;
+} registry = {RWLOCK_INIT, {NULL}, NULL, 0, 0, NULL};
+
+#define open_feature_flags (LIBDYLIB_OPEN_CACHE | LIBDYLIB_OPEN_ELF_LOOKUP | LIBDYLIB_OPEN_PERSIST)
+// loader flags that change an already-loaded library, and are kept in lib->flags
+#define open_loader_flags (LIBDYLIB_OPEN_GLOBAL | LIBDYLIB_OPEN_NODELETE)
+
+// References are counted without the registry lock: a library whose count
+// drops to 0 is being closed, and stays in the registry (where it can't be
+// retained any more) until the close removes it with the lock held.
+// Libraries that can't be retained or closed at all have a count of 0 from
+// the start (see reload_load()).
+
+// adds a reference to lib - returns false if lib has no references left
+static bool refcount_retain (dylib_ref lib)
+{
+    long count = atomic_load_long(&lib->refcount);
+    while (count > 0)
+    {
+        if (atomic_cas_long(&lib->refcount, count, count + 1))
+            return true;
+        count = atomic_load_long(&lib->refcount);
+    }
+    return false;
+}
+
+// the caller must hold the lock for writing
+static void registry_add_alias (dylib_ref lib, const char *path, uint32_t hash)
+{
+    struct registry_alias *alias;
+    for (alias = lib->aliases; alias; alias = alias->next_alias)
+    {
+        if (alias->hash == hash && strcmp(alias->path, path) == 0)
+            return;
+    }
+    const char *interned = intern_path(path, hash);
+    alias = interned ? (struct registry_alias*)pool_alloc(&registry_alias_pool, sizeof(*alias)) : NULL;
+    if (alias == NULL)
+        return;
+    alias->hash = hash;
+    alias->ref = lib;
+    alias->path = interned;
+    alias->next = registry.buckets[hash % REGISTRY_BUCKETS];
+    registry.buckets[hash % REGISTRY_BUCKETS] = alias;
+    alias->next_alias = lib->aliases;
+    lib->aliases = alias;
+}
+
+// the caller must hold the lock for writing
+static void registry_remove_aliases (dylib_ref lib)
+{
+    while (lib->aliases)
+    {
+        struct registry_alias *alias = lib->aliases, **link = &registry.buckets[alias->hash % REGISTRY_BUCKETS];
+        while (*link != alias)
+            link = &(*link)->next;
+        *link = alias->next;
+        lib->aliases = alias->next_alias;
+        pool_free(&registry_alias_pool, alias);
+    }
+}
+
+// the caller must hold the lock for writing
+static bool registry_insert (dylib_ref lib)
+{
+    if (registry.count == registry.capacity)
+    {
+        size_t capacity = registry.capacity ? registry.capacity * 2 : 16;
+        dylib_ref *refs = (dylib_ref*)mem_realloc(registry.refs, registry.capacity * sizeof(*refs), capacity * sizeof(*refs));
+        if (refs == NULL)
+            return false;
+        registry.refs = refs;
+        registry.capacity = capacity;
+    }
+    registry.refs[registry.count++] = lib;
+    return true;
+}
+
+// the caller must hold the lock - lib must be open
+static size_t registry_index (dylib_ref lib)
+{
+    size_t i;
+    for (i = 0; i < registry.count; ++i)
+    {
+        if (registry.refs[i] == lib)
+            return i;
+    }
+    return registry.count;
+}
+
+// enable per-handle features and loader flags requested by a later open() of
+// the same library
+static void registry_add_flags (dylib_ref lib, int flags)
+{
+    int added = flags & (open_feature_flags | open_loader_flags) & ~lib->flags;
+    if (!added)
+        return;
+    if (added & open_loader_flags)
+    {
+        // reopening a loaded library applies the new flags to it
+        void *handle = lib->is_self ? NULL :
+            platform_raw_open_namespace(lib->path, (added & open_loader_flags) | LIBDYLIB_OPEN_NOLOAD, lib->ns);
+        if (handle)
+            platform_raw_close(handle);
+        else
+            added &= ~open_loader_flags;
+    }
+    rwlock_write(&registry.lock);
+#ifdef LIBDYLIB_ELF
+    struct elf_object elf;
+    if ((added & LIBDYLIB_OPEN_ELF_LOOKUP) && !lib->elf.valid && elf_object_from_handle(&elf, lib->handle))
+    {
+        // lookups on other threads only use the object once valid is set
+        elf.valid = false;
+        lib->elf = elf;
+        atomic_store_ptr(&lib->elf.valid, true);
+    }
+#endif
+    lib->flags |= added;
+    rwlock_unlock_write(&registry.lock);
+}
+
+// returns a new reference to an open library known by path, or NULL
+static dylib_ref registry_find_path (const char *path)
+{
+    uint32_t hash = symbol_hash(path);
+    struct registry_alias *alias;
+    dylib_ref lib = NULL;
+    uint64_t dev, ino;
+    size_t i;
+    rwlock_read(&registry.lock);
+    for (alias = registry.buckets[hash % REGISTRY_BUCKETS]; alias; alias = alias->next)
+    {
+        if (alias->hash == hash && strcmp(alias->path, path) == 0 && refcount_retain(alias->ref))
+        {
+            lib = alias->ref;
+            break;
+        }
+    }
+    rwlock_unlock_read(&registry.lock);
+    // a different path to a file that is already open? (only for paths that
+    // don't depend on the loader's search path)
+    if (lib || !strchr(path, '/') || !platform_file_id(path, &dev, &ino))
+        return lib;
+    rwlock_write(&registry.lock);
+    for (i = 0; i < registry.count && !lib; ++i)
+    {
+        if (registry.refs[i]->has_file_id && registry.refs[i]->dev == dev && registry.refs[i]->ino == ino &&
+            refcount_retain(registry.refs[i]))
+        {
+            lib = registry.refs[i];
+            registry_add_alias(lib, path, hash);
+        }
+    }
+    rwlock_unlock_write(&registry.lock);
+    return lib;
+}
+
+// returns a reference to the library for a newly opened platform handle, or
+// NULL if out of memory - the handle is closed if it was already registered
+// Libraries in other namespaces than the program's have no aliases, since
+// paths and files don't identify them.
+static dylib_ref registry_add (void *handle, const char *path, int flags, dylib_namespace ns)
+{
+    const char *loaded_path = ns == LIBDYLIB_NAMESPACE_BASE ? platform_loaded_path(handle) : NULL;
+    char canonical[PATH_BUF_SIZE];
+    bool has_canonical = loaded_path && platform_canonical_path(loaded_path, canonical);
+    uint64_t dev = 0, ino = 0;
+    bool has_file_id = loaded_path && platform_file_id(loaded_path, &dev, &ino);
+    dylib_ref lib = NULL;
+    size_t i;
+
+    rwlock_write(&registry.lock);
+    for (i = 0; i < registry.count && !lib; ++i)
+    {
+        if (registry.refs[i]->handle == handle && refcount_retain(registry.refs[i]))
+            lib = registry.refs[i];
+    }
+    if (lib)
+    {
+        // opened through a path that wasn't known yet - drop the loader's
+        // extra reference and keep the one held by lib
+        platform_raw_close(handle);
+    }
+    else
+    {
+        const char *path_copy = intern_path(path, symbol_hash(path));
+        if (path_copy)
+            lib = dylib_ref_alloc(handle, path_copy);
+        if (lib && !registry_insert(lib))
+        {
+            dylib_ref_free(lib);
+            lib = NULL;
+        }
+        if (lib == NULL)
+        {
+            rwlock_unlock_write(&registry.lock);
+            platform_raw_close(handle);
+            return NULL;
+        }
+        lib->flags = flags & (open_feature_flags | open_loader_flags);
+        lib->has_file_id = has_file_id;
+        lib->dev = dev;
+        lib->ino = ino;
+        lib->ns = ns;
+#ifdef LIBDYLIB_ELF
+        if (flags & LIBDYLIB_OPEN_ELF_LOOKUP)
+            elf_object_from_handle(&lib->elf, lib->handle);
+#endif
+    }
+    if (ns == LIBDYLIB_NAMESPACE_BASE)
+        registry_add_alias(lib, path, symbol_hash(path));
+    if (has_canonical)
+        registry_add_alias(lib, canonical, symbol_hash(canonical));
+    rwlock_unlock_write(&registry.lock);
+    registry_add_flags(lib, flags);
+    return lib;
+}
+
+// drops a reference to lib - returns false if it has none (see
+// refcount_retain()), otherwise sets *last if the library must be removed
+// with registry_remove() and unloaded
+static bool refcount_release (dylib_ref lib, bool *last)
+{
+    long count = atomic_load_long(&lib->refcount);
+    *last = false;
+    // the handle to the current executable is never closed
+    if (lib->is_self)
+        return true;
+    while (count > 0)
+    {
+        if (atomic_cas_long(&lib->refcount, count, count - 1))
+        {
+            *last = count == 1;
+            return true;
+        }
+        count = atomic_load_long(&lib->refcount);
+    }
+    return false;
+}
+
+// removes a library whose last reference was released, after which its
+// handle is no longer valid - the caller must hold the lock for writing
+static void registry_remove (dylib_ref lib)
+{
+    size_t i = registry_index(lib);
+    registry.refs[i] = registry.refs[--registry.count];
+    registry_remove_aliases(lib);
+    handle_unpublish(lib);
+}
+
+static void prefetch_dependencies (const char *path);
+
+// opens path in namespace ns - only libraries in the program's namespace can
+// be found by path before loading them
+static dylib_ref open_ex_untraced (const char *path, int flags, dylib_namespace ns)
+{
+    check_null_path(path, NULL);
+    // some platforms treat "" like NULL, i.e. as the main program
+    if (!*path)
+    {
+        set_error(LIBDYLIB_E_OPEN_FAILED, "Empty library path");
+        return NULL;
+    }
+    dylib_ref lib = ns == LIBDYLIB_NAMESPACE_BASE ? registry_find_path(path) : NULL;
+    if (lib)
+    {
+        registry_add_flags(lib, flags);
+        return lib;
+    }
+    if ((flags & LIBDYLIB_OPEN_PREFETCH) && !(flags & LIBDYLIB_OPEN_NOLOAD))
+        prefetch_dependencies(path);
+    void *handle = platform_raw_open_namespace(path, flags, ns);
+    if (handle == NULL)
+    {
+        if (flags & LIBDYLIB_OPEN_NOLOAD)
+            set_error_detail(LIBDYLIB_E_OPEN_FAILED, "Library is not loaded", path);
+        else
+            platform_set_last_error(LIBDYLIB_E_OPEN_FAILED);
+        return NULL;
+    }
+    // a library in a namespace that can't be identified couldn't be opened
+    // again in it, and get_namespace() returns NEW only for errors
+    if (ns == LIBDYLIB_NAMESPACE_NEW && !platform_handle_namespace(handle, &ns))
+    {
+        platform_set_last_error(LIBDYLIB_E_OPEN_FAILED);
+        platform_raw_close(handle);
+        return NULL;
+    }
+    lib = registry_add(handle, path, flags, ns);
+    if (lib == NULL)
+        set_error(LIBDYLIB_E_NO_MEMORY, "Out of memory");
+    return lib;
+}
+
+// records an open that started at start, and returns the handle of lib
+static dylib_ref open_finish (dylib_ref lib, const char *path, uint64_t start)
+{
+    if (lib)
+    {
+        stats_add(lib, opens, 1);
+        stats_add(lib, open_ns, stats_since(start));
+    }
+    else
+        stats_add_global(open_failures, 1);
+    trace_call(LIBDYLIB_TRACE_OPEN, lib, path, start, lib != NULL);
+    return lib ? lib->ref : NULL;
+}
+
+LIBDYLIB_DEFINE(dylib_ref, open_ex)(const char *path, int flags)
+{
+    uint64_t start = stats_now();
+    return open_finish(open_ex_untraced(path, flags, LIBDYLIB_NAMESPACE_BASE), path, start);
+}
+
+// Libraries in memory are copied into a sealed memfd once, and loaded through
+// /proc/self/fd/<fd>. The descriptor stays open while the library is loaded,
+// since the loader matches libraries by name before anything else, and a
+// reused descriptor number must not match a library that is still loaded.
+static dylib_ref open_memory_untraced (const void *buf, size_t len, const char *name, int flags)
+{
+    check_null_arg(buf, "NULL buffer", NULL);
+    check_null_arg(name, "NULL name", NULL);
+#if defined(LIBDYLIB_LINUX) && defined(MFD_CLOEXEC)
+    int fd = memfd_create(name, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0)
+    {
+        set_error_errno(LIBDYLIB_E_OPEN_FAILED, name);
+        return NULL;
+    }
+    const char *data = (const char*)buf;
+    size_t written = 0;
+    while (written < len)
+    {
+        ssize_t n = write(fd, data + written, len - written);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+        {
+            set_error_errno(LIBDYLIB_E_OPEN_FAILED, name);
+            close(fd);
+            return NULL;
+        }
+        written += (size_t)n;
+    }
+    #ifdef F_ADD_SEALS
+    // the image can't change once the caller has (for example) verified it
+    fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+    #endif
+    char fd_path[32];
+    snprintf(fd_path, sizeof(fd_path), "/proc/self/fd/%i", fd);
+    void *handle = platform_raw_open(fd_path, flags);
+    if (handle == NULL)
+    {
+        platform_set_last_error(LIBDYLIB_E_OPEN_FAILED);
+        close(fd);
+        return NULL;
+    }
+    dylib_ref lib = registry_add(handle, fd_path, flags, LIBDYLIB_NAMESPACE_BASE);
+    if (lib == NULL)
+    {
+        set_error(LIBDYLIB_E_NO_MEMORY, "Out of memory");
+        close(fd);
+        return NULL;
+    }
+    lib->fd = fd;
+    return lib;
+#else
+    (void)len; (void)flags;
+    set_error(LIBDYLIB_E_UNSUPPORTED, "Loading libraries from memory is not supported on this platform");
+    return NULL;
+#endif
+}
+
+LIBDYLIB_DEFINE(dylib_ref, open_memory)(const void *buf, size_t len, const char *name)
+{
+    return LIBDYLIB_NAME(open_memory_ex)(buf, len, name, 0);
+}
+
+LIBDYLIB_DEFINE(dylib_ref, open_memory_ex)(const void *buf, size_t len, const char *name, int flags)
+{
+    uint64_t start = stats_now();
+    return open_finish(open_memory_untraced(buf, len, name, flags), name, start);
+}
+
+static dylib_ref open_namespace_untraced (const char *path, dylib_namespace ns, int flags)
+{
+#ifndef LM_ID_NEWLM
+    if (ns != LIBDYLIB_NAMESPACE_BASE)
+    {
+        set_error(LIBDYLIB_E_UNSUPPORTED, "Link-map namespaces are not supported on this platform");
+        return NULL;
+    }
+#endif
+    return open_ex_untraced(path, flags, ns);
+}
+
+LIBDYLIB_DEFINE(dylib_ref, open_namespace)(const char *path, dylib_namespace ns, int flags)
+{
+    uint64_t start = stats_now();
+    return open_finish(open_namespace_untraced(path, ns, flags), path, start);
+}
+
+LIBDYLIB_DEFINE(dylib_namespace, get_namespace)(dylib_ref ref)
+{
+    dylib_ref lib = handle_enter(ref);
+    if (lib == NULL)
+        return LIBDYLIB_NAMESPACE_NEW;
+    dylib_namespace ns = lib->ns;
+    handle_exit();
+    return ns;
+}
+
+LIBDYLIB_DEFINE(dylib_ref, open_self)()
+{
+    rwlock_read(&registry.lock);
+    dylib_ref lib = registry.self_ref;
+    rwlock_unlock_read(&registry.lock);
+    if (lib)
+        return lib->ref;
+    rwlock_write(&registry.lock);
+    if (registry.self_ref == NULL)
+    {
+        lib = dylib_ref_alloc(platform_raw_open_self(), NULL);
+        if (lib && registry_insert(lib))
+        {
+            lib->is_self = true;
+            registry.self_ref = lib;
+        }
+        else
+        {
+            dylib_ref_free(lib);
+            set_error(LIBDYLIB_E_NO_MEMORY, "Out of memory");
+        }
+    }
+    lib = registry.self_ref;
+    rwlock_unlock_write(&registry.lock);
+    return lib ? lib->ref : NULL;
+}
+
+LIBDYLIB_DEFINE(dylib_ref, retain)(dylib_ref ref)
+{
+    dylib_ref lib = handle_enter(ref);
+    if (lib == NULL)
+        return NULL;
+    bool retained = refcount_retain(lib);
+    handle_exit();
+    if (!retained)
+    {
+        set_invalid_handle_error();
+        return NULL;
+    }
+    return ref;
+}
+
+static uint64_t readers_advance();
+static bool readers_quiesced (uint64_t epoch);
+static bool readers_hold (dylib_ref lib);
+
+// handles whose last reference was closed while lookups on other threads (or
+// reader sections) may still be using them, which are unloaded by the first
+// handle_exit(), reader_exit() or close() after they are no longer in use
+static struct {
+    mutex_t lock;
+    dylib_ref head; // read with atomic_load_ptr() to skip empty lists
+} retired_libs = {MUTEX_INIT, NULL};
+
+static bool unload_handle (dylib_ref lib)
+{
+    bool ret = lib->keep_loaded || platform_raw_close((void*)lib->handle);
+#if defined(LIBDYLIB_UNIX)
+    // libraries that stay loaded keep their name, and therefore descriptor
+    if (lib->fd >= 0 && !lib->keep_loaded && !(lib->flags & LIBDYLIB_OPEN_NODELETE))
+        close(lib->fd);
+#endif
+    dylib_ref_free(lib);
+    return ret;
+}
+
+// whether lib, unpublished before epoch started, may still be in use
+static bool retired_in_use (dylib_ref lib, uint64_t epoch)
+{
+    return !readers_quiesced(epoch) || readers_hold(lib);
+}
+
+static void retired_libs_reclaim ()
+{
+    dylib_ref *link, lib, unload = NULL;
+    if (atomic_load_ptr(&retired_libs.head) == NULL)
+        return;
+    mutex_lock(&retired_libs.lock);
+    for (link = &retired_libs.head; (lib = *link) != NULL; )
+    {
+        if (!retired_in_use(lib, lib->retired_epoch))
+        {
+            *link = lib->next_retired;
+            lib->next_retired = unload;
+            unload = lib;
+        }
+        else
+            link = &lib->next_retired;
+    }
+    mutex_unlock(&retired_libs.lock);
+    while ((lib = unload) != NULL)
+    {
+        unload = lib->next_retired;
+        unload_handle(lib);
+    }
+}
+
+// unloads a library that was unpublished before epoch started, or queues it
+// to be unloaded once the lookups that may be using it are done - close()
+// never waits for other threads
+static bool retire_handle (dylib_ref lib, uint64_t epoch)
+{
+    if (!retired_in_use(lib, epoch))
+        return unload_handle(lib);
+    lib->retired_epoch = epoch;
+    mutex_lock(&retired_libs.lock);
+    lib->next_retired = retired_libs.head;
+    atomic_store_ptr(&retired_libs.head, lib);
+    mutex_unlock(&retired_libs.lock);
+    return true;
+}
+
+LIBDYLIB_DEFINE(bool, close)(dylib_ref ref)
+{
+    uint64_t start = stats_now();
+    dylib_ref lib = handle_enter(ref);
+    if (lib == NULL)
+        return false;
+    bool last;
+    if (!refcount_release(lib, &last))
+    {
+        handle_exit();
+        set_invalid_handle_error();
+        return false;
+    }
+    if (!last)
+    {
+        // another close() may free lib once the section ends
+        stats_add(lib, closes, 1);
+        stats_add(lib, close_ns, stats_since(start));
+        trace_call(LIBDYLIB_TRACE_CLOSE, lib, NULL, start, true);
+        handle_exit();
+        retired_libs_reclaim();
+        return true;
+    }
+    rwlock_write(&registry.lock);
+    registry_remove(lib);
+    rwlock_unlock_write(&registry.lock);
+    handle_exit();
+    bool ret = retire_handle(lib, readers_advance());
+    if (!ret)
+        platform_set_last_error(LIBDYLIB_E_CLOSE_FAILED);
+    retired_libs_reclaim();
+    // lib must not be used once it is freed
+    stats_add_global(closes, 1);
+    stats_add_global(close_ns, stats_since(start));
+    trace_call(LIBDYLIB_TRACE_CLOSE, NULL, NULL, start, ret);
+    return ret;
+}
+
+// Batched closes: libraries are unloaded in reverse order of loading, except
+// that a library is always unloaded before the libraries it depends on
+// (directly or not), which the loader's own order doesn't guarantee when
+// dependencies were also opened explicitly. On ELF platforms, dependencies
+// are found by matching DT_NEEDED entries to the loaded objects, with the
+// loader's lock held (through dl_iterate_phdr()).
+static int close_order_compare (const void *a, const void *b)
+{
+    uint64_t seq_a = (*(const dylib_ref*)a)->load_seq, seq_b = (*(const dylib_ref*)b)->load_seq;
+    return seq_a < seq_b ? 1 : seq_a > seq_b ? -1 : 0;
+}
+
+#ifdef LIBDYLIB_ELF
+struct close_order_object {
+    struct link_map *map;
+    const char *base;   // last component of the path
+    const char *soname; // NULL if none
+    const char *strtab;
+    size_t chain;       // objects only depend on objects in the same namespace
+    size_t mark;        // i + 1 once found to be a dependency of libs[i]
+};
+struct close_order_data {
+    dylib_ref *libs;
+    size_t n;
+    bool *depends; // depends[i * n + j] if libs[i] depends on libs[j]
+};
+
+// the object in chain that satisfies a DT_NEEDED entry, or NULL
+static struct close_order_object *close_order_find (struct close_order_object *objects, size_t count, size_t chain, const char *name)
+{
+    size_t i;
+    bool has_dir = strchr(name, '/') != NULL;
+    for (i = 0; i < count; ++i)
+    {
+        if (objects[i].chain != chain)
+            continue;
+        if (has_dir ? !strcmp(objects[i].map->l_name, name) :
+            !strcmp(objects[i].base, name) || (objects[i].soname && !strcmp(objects[i].soname, name)))
+            return &objects[i];
+    }
+    return NULL;
+}
+
+static int close_order_callback (struct dl_phdr_info *info, size_t size, void *ptr)
+{
+    struct close_order_data *data = (struct close_order_data*)ptr;
+    struct close_order_object *objects, **queue, **lib_objects;
+    struct link_map **heads, *map;
+    size_t count = 0, head_count = 0, i, j, k, queued;
+    const ElfW(Dyn) *dyn;
+    (void)info; (void)size;
+    // the first object of each namespace the libraries are loaded in
+    heads = (struct link_map**)mem_alloc(data->n * sizeof(*heads));
+    for (i = 0; heads && i < data->n; ++i)
+    {
+        if (dlinfo(data->libs[i]->handle, RTLD_DI_LINKMAP, &map) != 0 || map == NULL)
+            continue;
+        for (; map->l_prev; map = map->l_prev)
+            ;
+        for (j = 0; j < head_count && heads[j] != map; ++j)
+            ;
+        if (j == head_count)
+            heads[head_count++] = map;
+    }
+    for (j = 0; j < head_count; ++j)
+    {
+        for (map = heads[j]; map; map = map->l_next)
+            ++count;
+    }
+    objects = (struct close_order_object*)mem_calloc(count + 1, sizeof(*objects));
+    queue = (struct close_order_object**)mem_alloc((count + 1) * sizeof(*queue));
+    lib_objects = (struct close_order_object**)mem_calloc(data->n, sizeof(*lib_objects));
+    for (j = 0, k = 0; objects && queue && lib_objects && j < head_count; ++j)
+    {
+        for (map = heads[j]; map; map = map->l_next)
+        {
+            // objects without a name can't be needed by anything
+            if (map->l_name == NULL || !map->l_name[0] || map->l_ld == NULL)
+                continue;
+            struct close_order_object *obj = &objects[k++];
+            const char *slash = strrchr(map->l_name, '/');
+            obj->map = map;
+            obj->chain = j;
+            obj->base = slash ? slash + 1 : map->l_name;
+            for (dyn = map->l_ld; dyn->d_tag != DT_NULL; ++dyn)
+            {
+                if (dyn->d_tag == DT_STRTAB)
+                    obj->strtab = (const char*)elf_dyn_ptr(map->l_addr, dyn->d_un.d_ptr);
+            }
+            for (dyn = map->l_ld; obj->strtab && dyn->d_tag != DT_NULL; ++dyn)
+            {
+                if (dyn->d_tag == DT_SONAME)
+                    obj->soname = obj->strtab + dyn->d_un.d_val;
+            }
+        }
+    }
+    count = objects && queue && lib_objects ? k : 0;
+    for (i = 0; count && i < data->n; ++i)
+    {
+        map = NULL;
+        if (dlinfo(data->libs[i]->handle, RTLD_DI_LINKMAP, &map) != 0)
+            continue;
+        for (k = 0; k < count && objects[k].map != map; ++k)
+            ;
+        lib_objects[i] = k < count ? &objects[k] : NULL;
+    }
+    for (i = 0; count && i < data->n; ++i)
+    {
+        // mark every object that libs[i] depends on, breadth first
+        queued = 0;
+        if (lib_objects[i])
+        {
+            lib_objects[i]->mark = i + 1;
+            queue[queued++] = lib_objects[i];
+        }
+        for (k = 0; k < queued; ++k)
+        {
+            for (dyn = queue[k]->map->l_ld; queue[k]->strtab && dyn->d_tag != DT_NULL; ++dyn)
+            {
+                struct close_order_object *dep = dyn->d_tag == DT_NEEDED ?
+                    close_order_find(objects, count, queue[k]->chain, queue[k]->strtab + dyn->d_un.d_val) : NULL;
+                if (dep && dep->mark != i + 1)
+                {
+                    dep->mark = i + 1;
+                    queue[queued++] = dep;
+                }
+            }
+        }
+        for (j = 0; j < data->n; ++j)
+            data->depends[i * data->n + j] = j != i && lib_objects[j] && lib_objects[j]->mark == i + 1;
+    }
+    mem_free(heads);
+    mem_free(objects);
+    mem_free(queue);
+    mem_free(lib_objects);
+    dlerror();
+    // the loader's lock is only needed once
+    return 1;
+}
+#endif
+
+// sorts libs into the order they must be unloaded in
+static void close_order (dylib_ref *libs, size_t n)
+{
+    qsort(libs, n, sizeof(*libs), close_order_compare);
+#ifdef LIBDYLIB_ELF
+    struct close_order_data data = {libs, n, NULL};
+    size_t pos, i, j;
+    if (n < 2 || (data.depends = (bool*)mem_calloc(n * n, sizeof(bool))) == NULL)
+        return;
+    dl_iterate_phdr(close_order_callback, &data);
+    // order[pos] is the index in libs of the pos-th library to unload
+    size_t *order = (size_t*)mem_alloc(n * sizeof(size_t));
+    dylib_ref *sorted = (dylib_ref*)mem_alloc(n * sizeof(dylib_ref));
+    for (i = 0; order && sorted && i < n; ++i)
+        order[i] = i;
+    for (pos = 0; order && sorted && pos < n; ++pos)
+    {
+        // the next library (by load order) that no remaining library depends
+        // on - or just the next one, if they depend on each other
+        size_t pick = pos;
+        for (i = pos; i < n; ++i)
+        {
+            for (j = pos; j < n && (j == i || !data.depends[order[j] * n + order[i]]); ++j)
+                ;
+            if (j == n)
+            {
+                pick = i;
+                break;
+            }
+        }
+        size_t picked = order[pick];
+        memmove(order + pos + 1, order + pos, (pick - pos) * sizeof(size_t));
+        order[pos] = picked;
+    }
+    if (order && sorted)
+    {
+        for (i = 0; i < n; ++i)
+            sorted[i] = libs[order[i]];
+        memcpy(libs, sorted, n * sizeof(dylib_ref));
+    }
+    mem_free(order);
+    mem_free(sorted);
+    mem_free(data.depends);
+#endif
+}
+
+LIBDYLIB_DEFINE(bool, close_many)(const dylib_ref *libs, size_t n)
+{
+    return LIBDYLIB_NAME(close_many_ex)(libs, n, 0);
+}
+
+LIBDYLIB_DEFINE(bool, close_many_ex)(const dylib_ref *libs, size_t n, int flags)
+{
+    check_null_arg(libs, "NULL library list", 0);
+    uint64_t start = stats_now();
+    dylib_ref *unload = (dylib_ref*)mem_alloc((n ? n : 1) * sizeof(dylib_ref));
+    if (unload == NULL)
+    {
+        set_error(LIBDYLIB_E_NO_MEMORY, "Out of memory");
+        return false;
+    }
+    size_t count = 0, failed = 0, total = 0, i;
+    dylib_error first_code = LIBDYLIB_E_NONE;
+    char first_error[ERR_MAX_SIZE];
+    first_error[0] = 0;
+    // drop all references with the registry locked once - handles are only
+    // unpublished with the lock held, so their libraries can't be freed
+    // before it is released
+    rwlock_write(&registry.lock);
+    for (i = 0; i < n; ++i)
+    {
+        bool last;
+        if (libs[i] == NULL)
+            continue;
+        ++total;
+        dylib_ref lib = handle_lookup(libs[i]);
+        if (lib == NULL || !refcount_release(lib, &last))
+        {
+            if (!failed++)
+            {
+                first_code = LIBDYLIB_E_INVALID_HANDLE;
+                snprintf(first_error, sizeof(first_error), "Invalid or already closed library handle");
+            }
+            continue;
+        }
+        if (last)
+        {
+            registry_remove(lib);
+            lib->keep_loaded = (flags & LIBDYLIB_CLOSE_FAST_EXIT) != 0;
+            unload[count++] = lib;
+        }
+        else
+            stats_add(lib, closes, 1);
+    }
+    rwlock_unlock_write(&registry.lock);
+    // the order only matters if the libraries are unloaded - libraries that
+    // are still in use are unloaded later, but the loader keeps what they
+    // depend on loaded until then
+    if (!(flags & LIBDYLIB_CLOSE_FAST_EXIT))
+        close_order(unload, count);
+    uint64_t epoch = count ? readers_advance() : 0;
+    for (i = 0; i < count; ++i)
+    {
+        if (retire_handle(unload[i], epoch))
+            continue;
+        platform_set_last_error(LIBDYLIB_E_CLOSE_FAILED);
+        if (!failed++)
+        {
+            first_code = LIBDYLIB_E_CLOSE_FAILED;
+            snprintf(first_error, sizeof(first_error), "%s", LIBDYLIB_NAME(last_error)());
+        }
+    }
+    mem_free(unload);
+    retired_libs_reclaim();
+    stats_add_global(closes, count);
+    stats_add_global(close_ns, stats_since(start));
+    trace_call(LIBDYLIB_TRACE_CLOSE, NULL, NULL, start, failed == 0);
+    if (failed)
+    {
+        int len = snprintf(set_error_buffer(first_code), ERR_MAX_SIZE, "%lu of %lu libraries failed to close: %s",
+            (unsigned long)failed, (unsigned long)total, first_error);
+        stats_add_global(error_bytes, len > 0 ? (uint64_t)len : 0);
+    }
+    return failed == 0;
+}
+
+// Instance pools: copies of the same library in namespaces of their own,
+// which don't share any state besides the kernel's (files, signals, etc.)
+LIBDYLIB_DEFINE(dylib_instance_pool, instance_pool_open)(const char *path, size_t n, int flags)
+{
+    check_null_path(path, NULL);
+    if (n == 0)
+    {
+        set_error(LIBDYLIB_E_NULL_ARG, "Instance pools need at least one instance");
+        return NULL;
+    }
+    dylib_instance_pool pool = (dylib_instance_pool)mem_calloc(1, sizeof(*pool));
+    if (pool)
+        pool->instances = (dylib_ref*)mem_calloc(n, sizeof(dylib_ref));
+    if (pool == NULL || pool->instances == NULL)
+    {
+        mem_free(pool);
+        set_error(LIBDYLIB_E_NO_MEMORY, "Out of memory");
+        return NULL;
+    }
+    for (pool->count = 0; pool->count < n; ++pool->count)
+    {
+        dylib_ref lib = LIBDYLIB_NAME(open_namespace)(path, LIBDYLIB_NAMESPACE_NEW, flags);
+        if (lib == NULL)
+        {
+            // keep the error of the failed open
+            struct error_state err = last_err;
+            LIBDYLIB_NAME(instance_pool_free)(pool);
+            last_err = err;
+            return NULL;
+        }
+        pool->instances[pool->count] = lib;
+    }
+    return pool;
+}
+
+LIBDYLIB_DEFINE(size_t, instance_pool_size)(dylib_instance_pool pool)
+{
+    check_null_arg(pool, "NULL instance pool", 0);
+    return pool->count;
+}
+
+LIBDYLIB_DEFINE(dylib_ref, instance_pool_get)(dylib_instance_pool pool, size_t index)
+{
+    check_null_arg(pool, "NULL instance pool", NULL);
+    if (index >= pool->count)
+    {
+        set_error(LIBDYLIB_E_NOT_FOUND, "Instance index out of range");
+        return NULL;
+    }
+    return pool->instances[index];
+}
+
+LIBDYLIB_DEFINE(dylib_ref, instance_pool_next)(dylib_instance_pool pool)
+{
+    check_null_arg(pool, "NULL instance pool", NULL);
+    return pool->instances[atomic_add64(&pool->next, 1) % pool->count];
+}
+
+LIBDYLIB_DEFINE(bool, instance_pool_free)(dylib_instance_pool pool)
+{
+    if (pool == NULL)
+        return true;
+    bool ret = LIBDYLIB_NAME(close_many)(pool->instances, pool->count);
+    mem_free(pool->instances);
+    mem_free(pool);
+    return ret;
+}
+
+// resolves a symbol with a precomputed hash (0 if unknown) without setting an
+// error on failure - the platform computes its own hash
+static void *resolve_symbol_untraced (dylib_ref lib, const char *symbol, uint32_t hash)
+{
+    if (!(lib->flags & (LIBDYLIB_OPEN_CACHE | LIBDYLIB_OPEN_ELF_LOOKUP)))
+        return platform_raw_lookup((void*)lib->handle, symbol);
+    if (!hash)
+        hash = symbol_hash(symbol);
+    if (lib->flags & LIBDYLIB_OPEN_CACHE)
+        return symbol_cache_lookup(lib, symbol, hash);
+    return engine_lookup(lib, symbol, hash);
+}
+
+// lookups through a handle are made between handle_enter() and
+// handle_exit(), so that a concurrent close() of the last reference to lib
+// doesn't unload it until they are done
+static void *resolve_symbol_counted (dylib_ref lib, const char *symbol, uint32_t hash, bool member)
+{
+    uint64_t start = trace_enabled() ? stats_now() : 0;
+    void *addr = resolve_symbol_untraced(lib, symbol, hash);
+    if (member)
+        stats_add_member_lookup(lib, addr != NULL);
+    else
+        stats_add_lookup(lib, addr != NULL);
+    if (start)
+        trace_call(LIBDYLIB_TRACE_LOOKUP, lib, symbol, start, addr != NULL);
+    return addr;
+}
+
+static void *resolve_symbol_hash (dylib_ref lib, const char *symbol, uint32_t hash)
+{
+    return resolve_symbol_counted(lib, symbol, hash, false);
+}
+
+// resolves a symbol without setting an error on failure
+static void *resolve_symbol (dylib_ref lib, const char *symbol)
+{
+    return resolve_symbol_hash(lib, symbol, 0);
+}
+
+static void set_lookup_error (const char *symbol)
+{
+    set_error_detail(LIBDYLIB_E_NOT_FOUND, "Symbol not found", symbol);
+}
+
+LIBDYLIB_DEFINE(void*, lookup)(dylib_ref ref, const char *symbol)
+{
+    dylib_ref lib = handle_enter(ref);
+    if (lib == NULL)
+        return NULL;
+    void *ret = resolve_symbol(lib, symbol);
+    handle_exit();
+    if (ret == NULL)
+        set_lookup_error(symbol);
+    return ret;
+}
+
+LIBDYLIB_DEFINE(void*, lookup_hash)(dylib_ref ref, const char *symbol, uint32_t hash)
+{
+    dylib_ref lib = handle_enter(ref);
+    if (lib == NULL)
+        return NULL;
+    void *ret = resolve_symbol_hash(lib, symbol, hash);
+    handle_exit();
+    if (ret == NULL)
+        set_lookup_error(symbol);
+    return ret;
+}
+
+LIBDYLIB_DEFINE(uint32_t, hash_symbol)(const char *symbol)
+{
+    return symbol_hash(symbol);
+}
+
+// resolves a specific version of a symbol, without setting an error
+static void *resolve_versioned (dylib_ref lib, const char *symbol, const char *version)
+{
+    void *addr = NULL;
+#if defined(LIBDYLIB_LINUX) && defined(__GLIBC__)
+    addr = dlvsym(lib->handle, symbol, version);
+    if (addr == NULL)
+        dlerror();
+#else
+    (void)symbol; (void)version;
+#endif
+    stats_add_lookup(lib, addr != NULL);
+    return addr;
+}
+
+LIBDYLIB_DEFINE(void*, lookup_versioned)(dylib_ref ref, const char *symbol, const char *version)
+{
+    check_null_handle(ref, NULL);
+    check_null_arg(symbol, "NULL symbol", NULL);
+    if (version == NULL)
+        return LIBDYLIB_NAME(lookup)(ref, symbol);
+#if defined(LIBDYLIB_LINUX) && defined(__GLIBC__)
+    dylib_ref lib = handle_enter(ref);
+    if (lib == NULL)
+        return NULL;
+    void *ret = resolve_versioned(lib, symbol, version);
+    handle_exit();
+    if (ret == NULL)
+        set_lookup_error(symbol);
+    return ret;
+#else
+    set_error(LIBDYLIB_E_UNSUPPORTED, "Symbol versions are not supported on this platform");
+    return NULL;
+#endif
+}
+
+// resolves a lookup_first() candidate, which may be "symbol@version"
+static void *resolve_candidate (dylib_ref lib, const char *name, uint32_t hash)
+{
+    const char *at = strchr(name, '@');
+    if (at == NULL)
+        return resolve_symbol_hash(lib, name, hash);
+    char symbol[256];
+    size_t len = at - name;
+    if (len >= sizeof(symbol))
+        return NULL;
+    memcpy(symbol, name, len);
+    symbol[len] = 0;
+    return resolve_versioned(lib, symbol, at + 1);
+}
+
+// Results of lookup_first() are remembered per handle in a small direct-mapped
+// table, indexed by a hash of the whole candidate list. Each entry holds a
+// copy of the candidate list, which is compared with the given one before the
+// entry is used, and the index of the winning candidate + 1, or
+// LOOKUP_FIRST_NONE if no candidate was found. Entries are set once and live
+// as long as the handle, so no lock is needed - candidate lists whose slot
+// is taken by another list are looked up in full every time.
+#define LOOKUP_FIRST_NONE 0xffffffffu
+
+struct first_memo {
+    uint32_t key;
+    uint32_t winner;
+    size_t n;
+    const char *names[1]; // n entries, stored after them
+};
+
+static bool first_memo_matches (const struct first_memo *memo, uint32_t key, const char *const *names, size_t n)
+{
+    size_t i;
+    if (memo->key != key || memo->n != n)
+        return false;
+    for (i = 0; i < n; ++i)
+    {
+        if (strcmp(memo->names[i], names[i]))
+            return false;
+    }
+    return true;
+}
+
+// sets the entry in *slot if it is still free
+static void first_memo_set (struct first_memo **slot, uint32_t key, const char *const *names, size_t n, uint32_t winner)
+{
+    size_t i, size = sizeof(struct first_memo) + (n - 1) * sizeof(const char*);
+    for (i = 0; i < n; ++i)
+        size += strlen(names[i]) + 1;
+    struct first_memo *memo = (struct first_memo*)mem_alloc(size);
+    if (memo == NULL)
+        return;
+    memo->key = key;
+    memo->winner = winner;
+    memo->n = n;
+    char *p = (char*)&memo->names[n];
+    for (i = 0; i < n; ++i)
+    {
+        size_t len = strlen(names[i]) + 1;
+        memcpy(p, names[i], len);
+        memo->names[i] = p;
+        p += len;
+    }
+    if (!atomic_cas_ptr(slot, (struct first_memo*)NULL, memo))
+        mem_free(memo);
+}
+
+static uint32_t lookup_first_key (const uint32_t *hashes, size_t n)
+{
+    uint32_t key = (uint32_t)n;
+    size_t i;
+    for (i = 0; i < n; ++i)
+        key = (key ^ hashes[i]) * 16777619u;
+    return key;
+}
+
+LIBDYLIB_DEFINE(void*, va_lookup_first)(dylib_ref ref, va_list args)
+{
+    check_null_handle(ref, NULL);
+    const char *names[LOOKUP_FIRST_MAX];
+    uint32_t hashes[LOOKUP_FIRST_MAX];
+    size_t i, n = 0;
+    while (n < LOOKUP_FIRST_MAX && (names[n] = va_arg(args, const char*)))
+    {
+        hashes[n] = symbol_hash(names[n]);
+        ++n;
+    }
+    if (n == 0)
+    {
+        set_error(LIBDYLIB_E_NULL_ARG, "No symbols given");
+        return NULL;
+    }
+    dylib_ref lib = handle_enter(ref);
+    if (lib == NULL)
+        return NULL;
+    uint32_t key = lookup_first_key(hashes, n);
+    struct first_memo **slot = &lib->first_memo[key % LOOKUP_FIRST_MEMO];
+    const struct first_memo *memo = (const struct first_memo*)atomic_load_ptr(slot);
+    void *addr = NULL;
+    bool known = false;
+    if (memo && first_memo_matches(memo, key, names, n))
+    {
+        known = memo->winner == LOOKUP_FIRST_NONE;
+        if (!known)
+            addr = resolve_candidate(lib, names[memo->winner - 1], hashes[memo->winner - 1]);
+    }
+    if (!addr && !known)
+    {
+        for (i = 0; i < n && !addr; ++i)
+            addr = resolve_candidate(lib, names[i], hashes[i]);
+        if (memo == NULL)
+            first_memo_set(slot, key, names, n, addr ? (uint32_t)i : LOOKUP_FIRST_NONE);
+    }
+    handle_exit();
+    // like find_any(), only the last failure is reported
+    if (addr == NULL)
+        set_lookup_error(names[n - 1]);
+    return addr;
+}
+
+LIBDYLIB_DEFINE(void*, lookup_first)(dylib_ref ref, ...)
+{
+    va_list args;
+    va_start(args, ref);
+    void *ret = LIBDYLIB_NAME(va_lookup_first)(ref, args);
+    va_end(args);
+    return ret;
+}
+
+LIBDYLIB_DEFINE(bool, get_cache_stats)(dylib_ref ref, size_t *hits, size_t *misses)
+{
+    dylib_ref lib = handle_enter(ref);
+    if (lib == NULL)
+        return false;
+    bool cached = (lib->flags & LIBDYLIB_OPEN_CACHE) != 0;
+    if (cached && hits)
+        *hits = (size_t)lookup_total((struct lookup_stripe*)atomic_load_ptr(&lib->counters), cache_hits);
+    if (cached && misses)
+        *misses = (size_t)lookup_total((struct lookup_stripe*)atomic_load_ptr(&lib->counters), cache_misses);
+    handle_exit();
+    return cached;
+}
+
+LIBDYLIB_DEFINE(bool, get_stats)(dylib_ref ref, dylib_stats *stats)
+{
+    check_null_arg(stats, "NULL stats", 0);
+#ifndef LIBDYLIB_NO_STATS
+    dylib_ref lib = NULL;
+    if (ref && (lib = handle_enter(ref)) == NULL)
+        return false;
+    const dylib_stats *src = lib ? &lib->stats : &global_stats;
+    stats->opens = atomic_load64(&src->opens);
+    stats->open_failures = atomic_load64(&src->open_failures);
+    stats->open_ns = atomic_load64(&src->open_ns);
+    struct lookup_stripe *counters = lib ? (struct lookup_stripe*)atomic_load_ptr(&lib->counters) : global_counters;
+    stats->lookups = lookup_total(counters, lookups);
+    stats->lookup_misses = lookup_total(counters, lookup_misses);
+    stats->lookup_hits = stats->lookups - stats->lookup_misses;
+    stats->cache_hits = lookup_total(counters, cache_hits);
+    stats->cache_misses = lookup_total(counters, cache_misses);
+    stats->closes = atomic_load64(&src->closes);
+    stats->close_ns = atomic_load64(&src->close_ns);
+    stats->error_bytes = atomic_load64(&src->error_bytes);
+    stats->persist_hits = atomic_load64(&src->persist_hits);
+    stats->persist_writes = atomic_load64(&src->persist_writes);
+    if (lib)
+        handle_exit();
+    return true;
+#else
+    (void)ref;
+    set_error(LIBDYLIB_E_UNSUPPORTED, "Statistics are disabled in this build");
+    return false;
+#endif
+}
+
+LIBDYLIB_DEFINE(void, set_stats_enabled)(bool enabled)
+{
+#ifndef LIBDYLIB_NO_STATS
+    atomic_store64(&stats_enabled, enabled ? 1 : 0);
+#else
+    (void)enabled;
+#endif
+}
+
+LIBDYLIB_DEFINE(void, set_trace_callback)(dylib_trace_func func, void *ctx)
+{
+#ifndef LIBDYLIB_NO_STATS
+    struct trace_callback *callback = NULL;
+    mutex_lock(&trace.lock);
+    if (func)
+    {
+        for (callback = trace.all; callback; callback = callback->next)
+        {
+            if (callback->func == func && callback->ctx == ctx)
+                break;
+        }
+        if (callback == NULL && (callback = (struct trace_callback*)mem_alloc(sizeof(*callback))) != NULL)
+        {
+            callback->func = func;
+            callback->ctx = ctx;
+            callback->next = trace.all;
+            trace.all = callback;
+        }
+    }
+    // the previous callback stays set if out of memory
+    if (func == NULL || callback)
+        atomic_store_ptr(&trace.current, callback);
+    mutex_unlock(&trace.lock);
+    if (func && callback == NULL)
+        set_error(LIBDYLIB_E_NO_MEMORY, "Out of memory");
+#else
+    (void)func; (void)ctx;
+#endif
+}
+
+LIBDYLIB_DEFINE(dylib_ref, open_list)(const char *path, ...)
+{
+    va_list args;
+    va_start(args, path);
+    dylib_ref ret = LIBDYLIB_NAME(va_open_list)(path, args);
+    va_end(args);
+    return ret;
+}
+
+LIBDYLIB_DEFINE(dylib_ref, va_open_list)(const char *path, va_list args)
+{
+    return LIBDYLIB_NAME(va_open_list_ex)(0, path, args);
+}
+
+LIBDYLIB_DEFINE(dylib_ref, open_list_ex)(int flags, const char *path, ...)
+{
+    va_list args;
+    va_start(args, path);
+    dylib_ref ret = LIBDYLIB_NAME(va_open_list_ex)(flags, path, args);
+    va_end(args);
+    return ret;
+}
+
+LIBDYLIB_DEFINE(dylib_ref, va_open_list_ex)(int flags, const char *path, va_list args)
+{
+    const char *curpath = path;
+    dylib_ref ret = NULL;
+    while (curpath)
+    {
+        ret = LIBDYLIB_NAME(open_ex)(curpath, flags);
+        if (ret)
+            break;
+        curpath = va_arg(args, const char*);
+    }
+    return ret;
+}
+
+const char *locate_patterns[] =
+#if defined(LIBDYLIB_APPLE)
+    {"lib%s.dylib", "%s.framework/%s", "%s.dylib", "lib%s.so", "%s.so"}
+#elif defined(LIBDYLIB_LINUX)
+    {"lib%s.so", "%s.so"}
+#elif defined(LIBDYLIB_WINDOWS)
+    {"%s.dll", "lib%s.dll"}
+#else
+    #warning "Falling back to default open_locate patterns"
+    {"lib%s.so", "%s.so"}
+#endif
+;
+
+#define locate_pattern_count (sizeof(locate_patterns) / sizeof(locate_patterns[0]))
+
+// formats "dir/pattern" into buf, where "%s" in pattern is replaced by name
+// returns false if the result doesn't fit in size bytes
+static bool format_candidate (char *buf, size_t size, const char *dir, const char *pattern, const char *name)
+{
+    size_t out = 0, len_name = strlen(name);
+    if (dir && *dir)
+    {
+        size_t len_dir = strlen(dir);
+        if (len_dir + 1 >= size)
+            return false;
+        memcpy(buf, dir, len_dir);
+        out = len_dir;
+        if (dir[len_dir - 1] != '/' && dir[len_dir - 1] != '\\')
+            buf[out++] = '/';
+    }
+    while (*pattern)
+    {
+        if (pattern[0] == '%' && pattern[1] == 's')
+        {
+            if (out + len_name >= size)
+                return false;
+            memcpy(buf + out, name, len_name);
+            out += len_name;
+            pattern += 2;
+            continue;
+        }
+        if (out + 1 >= size)
+            return false;
+        buf[out++] = *pattern;
+        pattern += (pattern[0] == '%' && pattern[1] == '%') ? 2 : 1;
+    }
+    buf[out] = 0;
+    return true;
+}
+
+LIBDYLIB_DEFINE(dylib_ref, open_locate)(const char *name)
+{
+    return LIBDYLIB_NAME(open_locate_ex)(name, 0);
+}
+
+LIBDYLIB_DEFINE(dylib_ref, open_locate_ex)(const char *name, int flags)
+{
+    check_null_arg(name, "NULL library name", NULL);
+    char path[PATH_BUF_SIZE];
+    dylib_ref lib = NULL;
+    size_t i;
+    for (i = 0; i < locate_pattern_count && !lib; ++i)
+    {
+        if (format_candidate(path, sizeof(path), NULL, locate_patterns[i], name))
+            lib = LIBDYLIB_NAME(open_ex)(path, flags);
+    }
+    if (lib == NULL)
+        lib = LIBDYLIB_NAME(open_ex)(name, flags);
+    return lib;
+}
+
+static char *copy_string (const char *str)
+{
+    size_t len = strlen(str);
+    char *copy = (char*)mem_alloc(len + 1);
+    if (copy)
+        memcpy(copy, str, len + 1);
+    return copy;
+}
+
+static void free_strings (char **strings, size_t n)
+{
+    size_t i;
+    for (i = 0; i < n; ++i)
+        mem_free(strings[i]);
+    mem_free(strings);
+}
+
+LIBDYLIB_DEFINE(dylib_search_path, search_path_create)()
+{
+    dylib_search_path sp = (dylib_search_path)mem_alloc(sizeof(*sp));
+    if (sp == NULL)
+    {
+        set_error(LIBDYLIB_E_NO_MEMORY, "Out of memory");
+        return NULL;
+    }
+    memset(sp, 0, sizeof(*sp));
+    rwlock_init(&sp->lock);
+    return sp;
+}
+
+LIBDYLIB_DEFINE(bool, search_path_add_dir)(dylib_search_path sp, const char *dir)
+{
+    check_null_arg(sp, "NULL search path", false);
+    check_null_arg(dir, "NULL directory", false);
+    char *copy = copy_string(dir);
+    char **dirs = copy ? (char**)mem_realloc(sp->dirs, sp->dir_count * sizeof(char*), (sp->dir_count + 1) * sizeof(char*)) : NULL;
+    if (dirs == NULL)
+    {
+        mem_free(copy);
+        set_error(LIBDYLIB_E_NO_MEMORY, "Out of memory");
+        return false;
+    }
+    dirs[sp->dir_count++] = copy;
+    sp->dirs = dirs;
+    return true;
+}
+
+LIBDYLIB_DEFINE(bool, search_path_set_patterns)(dylib_search_path sp, const char *const *patterns, size_t n)
+{
+    check_null_arg(sp, "NULL search path", false);
+    char **copies = NULL;
+    size_t i;
+    if (n)
+    {
+        check_null_arg(patterns, "NULL pattern list", false);
+        copies = (char**)mem_calloc(n, sizeof(char*));
+        for (i = 0; copies && i < n; ++i)
+        {
+            if (!(copies[i] = copy_string(patterns[i])))
+            {
+                free_strings(copies, i);
+                copies = NULL;
+            }
+        }
+        if (copies == NULL)
+        {
+            set_error(LIBDYLIB_E_NO_MEMORY, "Out of memory");
+            return false;
+        }
+    }
+    free_strings(sp->patterns, sp->pattern_count);
+    sp->patterns = copies;
+    sp->pattern_count = n;
+    LIBDYLIB_NAME(search_path_invalidate)(sp);
+    return true;
+}
+
+LIBDYLIB_DEFINE(void, search_path_invalidate)(dylib_search_path sp)
+{
+    size_t i;
+    if (sp == NULL)
+        return;
+    rwlock_write(&sp->lock);
+    for (i = 0; i < SEARCH_PATH_BUCKETS; ++i)
+    {
+        while (sp->misses[i])
+        {
+            struct search_path_miss *miss = sp->misses[i];
+            sp->misses[i] = miss->next;
+            mem_free(miss);
+        }
+    }
+    rwlock_unlock_write(&sp->lock);
+}
+
+LIBDYLIB_DEFINE(void, search_path_free)(dylib_search_path sp)
+{
+    if (sp == NULL)
+        return;
+    LIBDYLIB_NAME(search_path_invalidate)(sp);
+    free_strings(sp->dirs, sp->dir_count);
+    free_strings(sp->patterns, sp->pattern_count);
+    rwlock_destroy(&sp->lock);
+    mem_free(sp);
+}
+
+// returns true if path failed before, copying the loader's error then to
+// error (ERR_MAX_SIZE bytes, or NULL)
+static bool search_path_missed (dylib_search_path sp, const char *path, uint32_t hash, char *error)
+{
+    struct search_path_miss *miss;
+    rwlock_read(&sp->lock);
+    for (miss = sp->misses[hash % SEARCH_PATH_BUCKETS]; miss; miss = miss->next)
+    {
+        if (miss->hash == hash && strcmp(miss->path, path) == 0)
+            break;
+    }
+    if (miss && miss->error && error)
+        snprintf(error, ERR_MAX_SIZE, "%s", miss->error);
+    rwlock_unlock_read(&sp->lock);
+    return miss != NULL;
+}
+
+static void search_path_add_miss (dylib_search_path sp, const char *path, uint32_t hash, const char *error)
+{
+    size_t len = strlen(path), error_len = error ? strlen(error) + 1 : 0;
+    struct search_path_miss *miss = (struct search_path_miss*)mem_alloc(sizeof(*miss) + len + error_len);
+    if (miss == NULL)
+        return;
+    miss->hash = hash;
+    memcpy(miss->path, path, len + 1);
+    miss->error = error ? miss->path + len + 1 : NULL;
+    if (error)
+        memcpy(miss->path + len + 1, error, error_len);
+    rwlock_write(&sp->lock);
+    miss->next = sp->misses[hash % SEARCH_PATH_BUCKETS];
+    sp->misses[hash % SEARCH_PATH_BUCKETS] = miss;
+    rwlock_unlock_write(&sp->lock);
+}
+
+// cheap checks before asking the loader to open a candidate - only possible
+// for candidates that don't go through the platform's search
+static bool search_path_probe (const char *path)
+{
+    if (!platform_is_file(path))
+        return false;
+#ifdef LIBDYLIB_ELF
+    return elf_file_probe(path);
+#else
+    return true;
+#endif
+}
+
+// opens a candidate, unless a search failed on it before - if the loader
+// failed on it (now or then), its error is copied to error (unless NULL)
+static dylib_ref search_path_try (dylib_search_path sp, const char *path, bool probe, int flags, char *error)
+{
+    uint32_t hash = symbol_hash(path);
+    if (search_path_missed(sp, path, hash, error))
+        return NULL;
+    if (probe && !search_path_probe(path))
+    {
+        search_path_add_miss(sp, path, hash, NULL);
+        return NULL;
+    }
+    dylib_ref lib = LIBDYLIB_NAME(open_ex)(path, flags);
+    if (lib == NULL)
+    {
+        const char *msg = LIBDYLIB_NAME(last_error)();
+        if (error)
+            snprintf(error, ERR_MAX_SIZE, "%s", msg);
+        // a library that isn't loaded yet may still be loaded by a later open
+        if (!(flags & LIBDYLIB_OPEN_NOLOAD))
+            search_path_add_miss(sp, path, hash, msg);
+    }
+    return lib;
+}
+
+LIBDYLIB_DEFINE(dylib_ref, open_search)(dylib_search_path sp, const char *name, int flags)
+{
+    check_null_arg(sp, "NULL search path", NULL);
+    check_null_arg(name, "NULL library name", NULL);
+    char path[PATH_BUF_SIZE];
+    // the loader's error for the last candidate it failed on - files found in
+    // the directories of sp take precedence over the fallback to name
+    char error[ERR_MAX_SIZE];
+    error[0] = 0;
+    size_t n_patterns = sp->patterns ? sp->pattern_count : locate_pattern_count;
+    size_t n_dirs = sp->dir_count ? sp->dir_count : 1;
+    size_t d, i;
+    for (d = 0; d < n_dirs; ++d)
+    {
+        const char *dir = sp->dir_count ? sp->dirs[d] : NULL;
+        for (i = 0; i < n_patterns; ++i)
+        {
+            const char *pattern = sp->patterns ? sp->patterns[i] : locate_patterns[i];
+            if (!format_candidate(path, sizeof(path), dir, pattern, name))
+                continue;
+            dylib_ref lib = search_path_try(sp, path, dir != NULL, flags, error);
+            if (lib)
+                return lib;
+        }
+    }
+    dylib_ref lib = search_path_try(sp, name, strchr(name, '/') != NULL, flags,
+        sp->dir_count && error[0] ? NULL : error);
+    if (lib == NULL && error[0])
+        set_error_copy(LIBDYLIB_E_OPEN_FAILED, error);
+    else if (lib == NULL)
+        set_error_detail(LIBDYLIB_E_OPEN_FAILED, "Library not found in search path", name);
+    return lib;
+}
+
+LIBDYLIB_DEFINE(bool, bind)(dylib_ref lib, const char *symbol, void **dest)
+{
+    *dest = LIBDYLIB_NAME(lookup)(lib, symbol);
+    return *dest != 0;
+}
+
+LIBDYLIB_DEFINE(bool, find)(dylib_ref lib, const char *symbol)
+{
+    return LIBDYLIB_NAME(lookup)(lib, symbol) != NULL;
+}
+
+LIBDYLIB_DEFINE(bool, find_any)(dylib_ref ref, ...)
+{
+    va_list args;
+    va_start(args, ref);
+    bool ret = LIBDYLIB_NAME(va_find_any)(ref, args);
+    va_end(args);
+    return ret;
+}
+LIBDYLIB_DEFINE(bool, va_find_any)(dylib_ref ref, va_list args)
+{
+    dylib_ref lib = handle_enter(ref);
+    if (lib == NULL)
+        return 0;
+    const char *cursym = NULL, *lastsym = NULL;
+    bool ret = 0;
+    while (!ret && (cursym = va_arg(args, const char*)))
+    {
+        lastsym = cursym;
+        if (resolve_symbol(lib, cursym))
+            ret = 1;
+    }
+    handle_exit();
+    // only report the last failure, once
+    if (!ret && lastsym)
+        set_lookup_error(lastsym);
+    return ret;
+}
+LIBDYLIB_DEFINE(bool, find_all)(dylib_ref ref, ...)
+{
+    va_list args;
+    va_start(args, ref);
+    bool ret = LIBDYLIB_NAME(va_find_all)(ref, args);
+    va_end(args);
+    return ret;
+}
+LIBDYLIB_DEFINE(bool, va_find_all)(dylib_ref ref, va_list args)
+{
+    dylib_ref lib = handle_enter(ref);
+    if (lib == NULL)
+        return 0;
+    const char *cursym = NULL;
+    bool ret = 1;
+    while (ret && (cursym = va_arg(args, const char*)))
+    {
+        if (!resolve_symbol(lib, cursym))
+        {
+            set_lookup_error(cursym);
+            ret = 0;
+        }
+    }
+    handle_exit();
+    return ret;
+}
+
+// Persistent symbol offsets (LIBDYLIB_OPEN_PERSIST): bind_table() stores the
+// offset from the load base of each symbol it resolves in a small file per
+// library, and later binds through that file instead of looking the symbols
+// up. Files are keyed by the library's build ID, or by its size and
+// modification time if it has none, and are rebuilt when the key does not
+// match or when a table contains a symbol that is not in the file. Only plain
+// definitions in the library itself have offsets - anything else (symbols of
+// dependencies, IFUNCs, TLS, missing symbols) is marked as resolved by the
+// platform every time.
+static struct {
+    mutex_t lock;
+    char *dir; // NULL until set_persist_dir()
+} persist_config = {MUTEX_INIT, NULL};
+
+LIBDYLIB_DEFINE(bool, set_persist_dir)(const char *dir)
+{
+    char *copy = NULL;
+    if (dir && (copy = copy_string(dir)) == NULL)
+    {
+        set_error(LIBDYLIB_E_NO_MEMORY, "Out of memory");
+        return false;
+    }
+    mutex_lock(&persist_config.lock);
+    char *old = persist_config.dir;
+    persist_config.dir = copy;
+    mutex_unlock(&persist_config.lock);
+    mem_free(old);
+    return true;
+}
+
+#ifdef LIBDYLIB_ELF
+#define PERSIST_MAGIC "dylibsym"
+#define PERSIST_VERSION (2 | (uint32_t)sizeof(void*) << 16)
+#define PERSIST_KEY_MAX 64
+#define PERSIST_KEY_BUILD_ID 1
+#define PERSIST_KEY_FILE 2
+#define PERSIST_PLATFORM UINT64_MAX // resolved by the platform every time
+#define PERSIST_SUFFIX ".dylibsym"
+
+struct persist_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t key_size;
+    unsigned char key[PERSIST_KEY_MAX];
+    uint32_t slot_count; // a power of 2, at most half of them used
+    uint32_t strings_size;
+    uint32_t checksum; // of the slots and names
+    uint32_t reserved; // keeps the slots 8-byte aligned
+};
+// slots are followed by the names, which start with an empty string so that
+// a name offset of 0 marks an empty slot
+struct persist_slot {
+    uint32_t hash;
+    uint32_t name;
+    uint64_t offset;
+};
+
+struct persist_file {
+    char path[PATH_BUF_SIZE];
+    struct elf_object elf;
+    uint64_t extent; // end of the highest load segment
+    unsigned char key[PERSIST_KEY_MAX];
+    uint32_t key_size;
+    const unsigned char *map; // NULL if there is no usable file
+    size_t map_size;
+    const struct persist_slot *slots;
+    uint32_t slot_count;
+    const char *strings;
+    uint32_t strings_size;
+    bool dirty; // a symbol was not in the file
+};
+
+// copies the NT_GNU_BUILD_ID note of a loaded object into key
+static uint32_t persist_build_id (const struct elf_object *elf, unsigned char *key)
+{
+    ElfW(Half) i;
+    for (i = 0; i < elf->phnum; ++i)
+    {
+        const ElfW(Phdr) *ph = &elf->phdr[i];
+        if (ph->p_type != PT_NOTE)
+            continue;
+        const unsigned char *note = (const unsigned char*)(elf->base + ph->p_vaddr), *end = note + ph->p_memsz;
+        size_t align = ph->p_align == 8 ? 8 : 4;
+        while (end - note >= (ptrdiff_t)sizeof(ElfW(Nhdr)))
+        {
+            const ElfW(Nhdr) *nh = (const ElfW(Nhdr)*)note;
+            size_t name_size = (nh->n_namesz + align - 1) & ~(align - 1);
+            size_t desc_size = (nh->n_descsz + align - 1) & ~(align - 1);
+            const unsigned char *name = note + sizeof(*nh), *desc = name + name_size;
+            if (name_size > (size_t)(end - name) || desc_size > (size_t)(end - desc))
+                break;
+            if (nh->n_type == NT_GNU_BUILD_ID && nh->n_namesz == 4 && !memcmp(name, "GNU", 4) &&
+                nh->n_descsz && nh->n_descsz < PERSIST_KEY_MAX)
+            {
+                key[0] = PERSIST_KEY_BUILD_ID;
+                memcpy(key + 1, desc, nh->n_descsz);
+                return nh->n_descsz + 1;
+            }
+            note = desc + desc_size;
+        }
+    }
+    return 0;
+}
+
+// finds the file for lib and its key - returns false if lib can't be persisted
+static bool persist_locate (dylib_ref lib, struct persist_file *pf)
+{
+    char name[2 * PERSIST_KEY_MAX + 1];
+    struct stat st;
+    uint32_t i;
+    ElfW(Half) j;
+    // the object is needed for its notes and segments, if not its symbols
+    if (!elf_object_from_handle(&pf->elf, lib->handle) && pf->elf.phdr == NULL)
+        return false;
+    for (j = 0; j < pf->elf.phnum; ++j)
+    {
+        const ElfW(Phdr) *ph = &pf->elf.phdr[j];
+        if (ph->p_type == PT_LOAD && ph->p_vaddr + ph->p_memsz > pf->extent)
+            pf->extent = ph->p_vaddr + ph->p_memsz;
+    }
+    pf->key_size = persist_build_id(&pf->elf, pf->key);
+    if (pf->key_size)
+    {
+        for (i = 1; i < pf->key_size; ++i)
+            snprintf(name + 2 * (i - 1), 3, "%02x", pf->key[i]);
+    }
+    else
+    {
+        // without a build ID, the file is named after the library's path
+        const char *path = platform_loaded_path(lib->handle);
+        if (path == NULL || stat(path, &st) != 0)
+            return false;
+        uint64_t size = (uint64_t)st.st_size, mtime = (uint64_t)st.st_mtime, path_hash = 14695981039346656037ULL;
+#ifdef LIBDYLIB_LINUX
+        mtime = mtime * 1000000000 + (uint64_t)st.st_mtim.tv_nsec;
+#endif
+        pf->key[0] = PERSIST_KEY_FILE;
+        memcpy(pf->key + 1, &size, sizeof(size));
+        memcpy(pf->key + 1 + sizeof(size), &mtime, sizeof(mtime));
+        pf->key_size = 1 + sizeof(size) + sizeof(mtime);
+        for (; *path; ++path)
+            path_hash = (path_hash ^ (unsigned char)*path) * 1099511628211ULL;
+        snprintf(name, sizeof(name), "path-%016llx", (unsigned long long)path_hash);
+    }
+    mutex_lock(&persist_config.lock);
+    bool ok = persist_config.dir && format_candidate(pf->path, sizeof(pf->path), persist_config.dir, "%s" PERSIST_SUFFIX, name);
+    mutex_unlock(&persist_config.lock);
+    return ok;
+}
+
+// FNV-1a of the slots and names, which are only read after it matches
+static uint32_t persist_checksum (const unsigned char *data, size_t size)
+{
+    uint32_t h = 2166136261u;
+    size_t i;
+    for (i = 0; i < size; ++i)
+        h = (h ^ data[i]) * 16777619u;
+    return h;
+}
+
+// maps the file and checks it against the library - a missing, stale or
+// damaged file is not an error, but it is rewritten after binding
+static void persist_map (struct persist_file *pf)
+{
+    struct persist_header header;
+    uint32_t i, used = 0;
+    if (!map_file(pf->path, &pf->map, &pf->map_size))
+    {
+        pf->map = NULL;
+        pf->dirty = true;
+        return;
+    }
+    bool valid = pf->map_size >= sizeof(header);
+    if (valid)
+    {
+        memcpy(&header, pf->map, sizeof(header));
+        valid = !memcmp(header.magic, PERSIST_MAGIC, sizeof(header.magic)) && header.version == PERSIST_VERSION &&
+            header.key_size == pf->key_size && !memcmp(header.key, pf->key, pf->key_size) &&
+            header.slot_count && !(header.slot_count & (header.slot_count - 1)) &&
+            header.slot_count < (pf->map_size - sizeof(header)) / sizeof(struct persist_slot) &&
+            pf->map_size - sizeof(header) - header.slot_count * sizeof(struct persist_slot) == header.strings_size &&
+            header.strings_size && pf->map[pf->map_size - 1] == 0 &&
+            persist_checksum(pf->map + sizeof(header), pf->map_size - sizeof(header)) == header.checksum;
+    }
+    if (valid)
+    {
+        pf->slots = (const struct persist_slot*)(pf->map + sizeof(header));
+        pf->slot_count = header.slot_count;
+        pf->strings = (const char*)(pf->slots + pf->slot_count);
+        pf->strings_size = header.strings_size;
+        for (i = 0; i < pf->slot_count && valid; ++i)
+        {
+            valid = pf->slots[i].name < pf->strings_size &&
+                (pf->slots[i].offset == PERSIST_PLATFORM || pf->slots[i].offset < pf->extent);
+            if (pf->slots[i].name)
+                ++used;
+        }
+        // probes end at an empty slot
+        valid = valid && used <= pf->slot_count / 2;
+    }
+    if (!valid)
+    {
+        munmap((void*)pf->map, pf->map_size);
+        pf->map = NULL;
+        pf->dirty = true;
+    }
+}
+
+static const struct persist_slot *persist_find (const struct persist_file *pf, const char *symbol, uint32_t hash)
+{
+    uint32_t i, probes, mask = pf->slot_count - 1;
+    if (pf->map == NULL)
+        return NULL;
+    for (i = hash & mask, probes = 0; pf->slots[i].name && probes < pf->slot_count; i = (i + 1) & mask, ++probes)
+    {
+        if (pf->slots[i].hash == hash && !strcmp(pf->strings + pf->slots[i].name, symbol))
+            return &pf->slots[i];
+    }
+    return NULL;
+}
+
+// returns true and sets *addr if symbol has an offset in the file
+static bool persist_lookup (struct persist_file *pf, dylib_ref lib, const char *symbol, uint32_t hash, void **addr)
+{
+    const struct persist_slot *slot = persist_find(pf, symbol, hash ? hash : symbol_hash(symbol));
+    if (slot == NULL)
+    {
+        pf->dirty = true;
+        return false;
+    }
+    if (slot->offset == PERSIST_PLATFORM)
+        return false;
+    *addr = (void*)(pf->elf.base + (ElfW(Addr))slot->offset);
+    stats_add(lib, persist_hits, 1);
+    return true;
+}
+
+// the offset to store for a symbol resolved to addr
+static uint64_t persist_offset (const struct persist_file *pf, const char *symbol, uint32_t hash, void *addr)
+{
+    void *elf_addr;
+    if (addr == NULL || !pf->elf.valid || !elf_lookup(&pf->elf, symbol, hash, &elf_addr) || elf_addr != addr)
+        return PERSIST_PLATFORM;
+    return (uint64_t)((ElfW(Addr))addr - pf->elf.base);
+}
+
+// adds an entry to a table being written, unless it already has symbol
+static void persist_insert (struct persist_slot *slots, uint32_t slot_count, char *strings, size_t *strings_size,
+    const char *symbol, uint32_t hash, uint64_t offset)
+{
+    uint32_t i, mask = slot_count - 1;
+    for (i = hash & mask; slots[i].name; i = (i + 1) & mask)
+    {
+        if (slots[i].hash == hash && !strcmp(strings + slots[i].name, symbol))
+            return;
+    }
+    slots[i].hash = hash;
+    slots[i].name = (uint32_t)*strings_size;
+    slots[i].offset = offset;
+    memcpy(strings + *strings_size, symbol, strlen(symbol) + 1);
+    *strings_size += strlen(symbol) + 1;
+}
+
+// writes a new file with the entries of the old one and the symbols of table,
+// whose addresses are in addrs (or in their destinations if addrs is NULL)
+static void persist_write (struct persist_file *pf, dylib_ref lib, const dylib_bind_entry *table, size_t n, void **addrs)
+{
+    char tmp_path[PATH_BUF_SIZE + 32];
+    struct persist_header header;
+    size_t i, count = n, strings_size = 1;
+    uint32_t slot_count = 8;
+    for (i = 0; i < pf->slot_count; ++i)
+    {
+        if (pf->slots[i].name)
+        {
+            ++count;
+            strings_size += strlen(pf->strings + pf->slots[i].name) + 1;
+        }
+    }
+    for (i = 0; i < n; ++i)
+        strings_size += strlen(table[i].name) + 1;
+    while (slot_count < 2 * count && slot_count < UINT32_MAX / 2)
+        slot_count *= 2;
+    if (strings_size > UINT32_MAX || slot_count < 2 * count)
+        return;
+    unsigned char *data = (unsigned char*)mem_calloc(1, sizeof(header) + slot_count * sizeof(struct persist_slot) + strings_size);
+    if (data == NULL)
+        return;
+    struct persist_slot *slots = (struct persist_slot*)(data + sizeof(header));
+    char *strings = (char*)(slots + slot_count);
+    strings_size = 1;
+    for (i = 0; i < pf->slot_count; ++i)
+    {
+        if (pf->slots[i].name)
+            persist_insert(slots, slot_count, strings, &strings_size,
+                pf->strings + pf->slots[i].name, pf->slots[i].hash, pf->slots[i].offset);
+    }
+    for (i = 0; i < n; ++i)
+    {
+        uint32_t hash = symbol_hash(table[i].name);
+        void *addr = addrs ? addrs[i] : table[i].dest ? *table[i].dest : resolve_symbol_hash(lib, table[i].name, hash);
+        persist_insert(slots, slot_count, strings, &strings_size, table[i].name, hash,
+            persist_offset(pf, table[i].name, hash, addr));
+    }
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, PERSIST_MAGIC, sizeof(header.magic));
+    header.version = PERSIST_VERSION;
+    header.key_size = pf->key_size;
+    memcpy(header.key, pf->key, pf->key_size);
+    header.slot_count = slot_count;
+    header.strings_size = (uint32_t)strings_size;
+    size_t size = (size_t)(strings + strings_size - (char*)data);
+    header.checksum = persist_checksum(data + sizeof(header), size - sizeof(header));
+    memcpy(data, &header, sizeof(header));
+    // written under a temporary name, so that readers only see complete files
+    static long tmp_counter;
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%ld.%ld", pf->path, (long)getpid(), (long)atomic_increment(&tmp_counter));
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd >= 0)
+    {
+        bool written = write(fd, data, size) == (ssize_t)size;
+        if (close(fd) == 0 && written && rename(tmp_path, pf->path) == 0)
+            stats_add(lib, persist_writes, 1);
+        else
+            unlink(tmp_path);
+    }
+    mem_free(data);
+}
+
+// returns the file for lib, mapped if it is usable, or NULL if lib can't be
+// persisted - errors are not reported, since binding works without the file
+static struct persist_file *persist_open (dylib_ref lib)
+{
+    struct error_state err = last_err;
+    struct persist_file *pf = (struct persist_file*)mem_calloc(1, sizeof(*pf));
+    if (pf && (lib->is_self || !persist_locate(lib, pf)))
+    {
+        mem_free(pf);
+        pf = NULL;
+    }
+    if (pf)
+        persist_map(pf);
+    last_err = err;
+    return pf;
+}
+
+static void persist_close (struct persist_file *pf, dylib_ref lib, const dylib_bind_entry *table, size_t n, void **addrs)
+{
+    struct error_state err = last_err;
+    if (pf->dirty)
+        persist_write(pf, lib, table, n, addrs);
+    if (pf->map)
+        munmap((void*)pf->map, pf->map_size);
+    mem_free(pf);
+    last_err = err;
+}
+#else
+struct persist_file;
+
+static struct persist_file *persist_open (dylib_ref lib)
+{
+    (void)lib;
+    return NULL;
+}
+
+static bool persist_lookup (struct persist_file *pf, dylib_ref lib, const char *symbol, uint32_t hash, void **addr)
+{
+    (void)pf; (void)lib; (void)symbol; (void)hash; (void)addr;
+    return false;
+}
+
+static void persist_close (struct persist_file *pf, dylib_ref lib, const dylib_bind_entry *table, size_t n, void **addrs)
+{
+    (void)pf; (void)lib; (void)table; (void)n; (void)addrs;
+}
+#endif
+
+// resolves the symbols of table into addrs[i], or into table[i].dest if addrs
+// is NULL - returns false and sets an error if a required symbol is missing
+static bool resolve_table (dylib_ref lib, const dylib_bind_entry *table, size_t n, void **addrs)
+{
+    // collect the names of missing required symbols, formatting the error
+    // only if something is actually missing
+    size_t i, missing = 0;
+    struct persist_file *pf = (lib->flags & LIBDYLIB_OPEN_PERSIST) && n ? persist_open(lib) : NULL;
+    for (i = 0; i < n; ++i)
+    {
+        void *addr = NULL;
+        uint32_t hash = symbol_hash(table[i].name);
+        if (!pf || !persist_lookup(pf, lib, table[i].name, hash, &addr))
+            addr = resolve_symbol_hash(lib, table[i].name, hash);
+        if (addrs)
+            addrs[i] = addr;
+        else if (table[i].dest)
+            *table[i].dest = addr;
+        if (!addr && !table[i].optional)
+            ++missing;
+    }
+    if (pf)
+        persist_close(pf, lib, table, n, addrs);
+    if (!missing)
+        return true;
+    char *err = set_error_buffer(LIBDYLIB_E_NOT_FOUND);
+    const char *prefix = "Missing required symbols: ";
+    size_t err_len = strlen(prefix);
+    memcpy(err, prefix, err_len);
+    for (i = 0, missing = 0; i < n; ++i)
+    {
+        void **addr = addrs ? &addrs[i] : table[i].dest;
+        if (table[i].optional || (addr ? *addr : resolve_symbol(lib, table[i].name)))
+            continue;
+        size_t len = strlen(table[i].name);
+        if (missing++ && err_len + 2 < ERR_MAX_SIZE)
+        {
+            memcpy(err + err_len, ", ", 2);
+            err_len += 2;
+        }
+        if (err_len + len < ERR_MAX_SIZE)
+        {
+            memcpy(err + err_len, table[i].name, len);
+            err_len += len;
+        }
+    }
+    err[err_len] = 0;
+    stats_add_global(error_bytes, err_len);
+    return false;
+}
+
+LIBDYLIB_DEFINE(bool, bind_table)(dylib_ref ref, const dylib_bind_entry *table, size_t n)
+{
+    check_null_handle(ref, 0);
+    if (n)
+        check_null_arg(table, "NULL symbol table", 0);
+    dylib_ref lib = handle_enter(ref);
+    if (lib == NULL)
+        return false;
+    bool ret = resolve_table(lib, table, n, NULL);
+    handle_exit();
+    return ret;
+}
+
+// Lazy calls: the stubs defined by LIBDYLIB_LAZY() (and by lazy_function in
+// C++) call lazy_resolve() on their first call, which replaces the stub in
+// its function pointer. A lookup that fails can't return to the caller.
+static dylib_lazy_fail_func lazy_fail_handler;
+
+LIBDYLIB_DEFINE(void, set_lazy_fail_handler)(dylib_lazy_fail_func func)
+{
+    atomic_store_ptr(&lazy_fail_handler, func);
+}
+
+LIBDYLIB_DEFINE(void*, lazy_resolve)(dylib_ref ref, const char *symbol, uint32_t hash, void **slot)
+{
+    void *addr = NULL;
+    dylib_ref lib = handle_enter(ref);
+    if (lib)
+    {
+        addr = resolve_symbol_hash(lib, symbol, hash);
+        handle_exit();
+        if (addr == NULL)
+            set_lookup_error(symbol);
+    }
+    if (addr == NULL)
+    {
+        dylib_lazy_fail_func func = (dylib_lazy_fail_func)atomic_load_ptr(&lazy_fail_handler);
+        if (func)
+            func(ref, symbol);
+        fprintf(stderr, "libdylib: lazy call to %s failed: %s\n", symbol, LIBDYLIB_NAME(last_error)());
+        abort();
+    }
+    // concurrent first calls all store the same address
+    atomic_store_ptr(slot, addr);
+    return addr;
+}
+
+// Background opening: tasks are queued for a small pool of worker threads,
+// which is started on demand and lives until the process exits. Each task
+// keeps a copy of the error state of the thread that ran it, which wait()
+// copies to the waiting thread.
+#ifndef LIBDYLIB_ASYNC_THREADS
+    #define LIBDYLIB_ASYNC_THREADS 4
+#endif
+
+#ifdef LIBDYLIB_CXX
+namespace libdylib {
+#endif
+struct dylib_open_task_data {
+    char *path;
+    int flags;
+    const dylib_bind_entry *table;
+    size_t table_size;
+    bool done;  // protected by the pool lock
+    bool taken; // true once wait() has returned result to the caller
+    dylib_ref result;
+    struct error_state err;
+    struct dylib_open_task_data *next;
+};
+#ifdef LIBDYLIB_CXX
+}
+#endif
+
+static struct {
+    mutex_t lock;
+    cond_t work, done;
+    dylib_open_task head, tail;
+    int threads, idle;
+} open_pool = {MUTEX_INIT, COND_INIT, COND_INIT, NULL, NULL, 0, 0};
+
+static void open_task_run (dylib_open_task task)
+{
+    set_error(LIBDYLIB_E_NONE, NULL);
+    dylib_ref lib = LIBDYLIB_NAME(open_ex)(task->path, task->flags);
+    if (lib && task->table && !LIBDYLIB_NAME(bind_table)(lib, task->table, task->table_size))
+    {
+        struct error_state err = last_err;
+        LIBDYLIB_NAME(close)(lib);
+        last_err = err;
+        lib = NULL;
+    }
+    task->result = lib;
+    task->err = last_err;
+}
+
+static thread_result THREAD_CALL open_pool_worker (void *arg)
+{
+    (void)arg;
+    mutex_lock(&open_pool.lock);
+    while (true)
+    {
+        while (open_pool.head == NULL)
+        {
+            ++open_pool.idle;
+            cond_wait(&open_pool.work, &open_pool.lock);
+            --open_pool.idle;
+        }
+        dylib_open_task task = open_pool.head;
+        open_pool.head = task->next;
+        if (open_pool.head == NULL)
+            open_pool.tail = NULL;
+        mutex_unlock(&open_pool.lock);
+        open_task_run(task);
+        mutex_lock(&open_pool.lock);
+        task->done = true;
+        cond_broadcast(&open_pool.done);
+    }
+    return 0;
+}
+
+static dylib_open_task open_task_submit (const char *path, int flags, const dylib_bind_entry *table, size_t n)
+{
+    check_null_path(path, NULL);
+    size_t len = strlen(path);
+    dylib_open_task task = (dylib_open_task)mem_alloc(sizeof(*task) + len + 1);
+    if (task == NULL)
+    {
+        set_error(LIBDYLIB_E_NO_MEMORY, "Out of memory");
+        return NULL;
+    }
+    task->path = (char*)(task + 1);
+    memcpy(task->path, path, len + 1);
+    task->flags = flags;
+    task->table = table;
+    task->table_size = n;
+    task->done = false;
+    task->taken = false;
+    task->result = NULL;
+    task->next = NULL;
+    mutex_lock(&open_pool.lock);
+    if (open_pool.idle == 0 && open_pool.threads < LIBDYLIB_ASYNC_THREADS && thread_start(open_pool_worker, NULL))
+        ++open_pool.threads;
+    if (open_pool.threads == 0)
+    {
+        // no worker could be started - run the task in this thread instead
+        mutex_unlock(&open_pool.lock);
+        struct error_state err = last_err;
+        open_task_run(task);
+        last_err = err;
+        task->done = true;
+        return task;
+    }
+    if (open_pool.tail)
+        open_pool.tail->next = task;
+    else
+        open_pool.head = task;
+    open_pool.tail = task;
+    cond_signal(&open_pool.work);
+    mutex_unlock(&open_pool.lock);
+    return task;
+}
+
+LIBDYLIB_DEFINE(dylib_open_task, open_async)(const char *path, int flags)
+{
+    return open_task_submit(path, flags, NULL, 0);
+}
+
+LIBDYLIB_DEFINE(dylib_open_task, open_async_bind)(const char *path, int flags, const dylib_bind_entry *table, size_t n)
+{
+    return open_task_submit(path, flags, table, n);
+}
+
+LIBDYLIB_DEFINE(bool, open_task_poll)(dylib_open_task task)
+{
+    check_null_arg(task, "NULL open task", false);
+    mutex_lock(&open_pool.lock);
+    bool done = task->done;
+    mutex_unlock(&open_pool.lock);
+    return done;
+}
+
+static void open_task_join (dylib_open_task task)
+{
+    mutex_lock(&open_pool.lock);
+    while (!task->done)
+        cond_wait(&open_pool.done, &open_pool.lock);
+    mutex_unlock(&open_pool.lock);
+}
+
+LIBDYLIB_DEFINE(dylib_ref, open_task_wait)(dylib_open_task task)
+{
+    check_null_arg(task, "NULL open task", NULL);
+    open_task_join(task);
+    last_err = task->err;
+    task->taken = true;
+    return task->result;
+}
+
+LIBDYLIB_DEFINE(void, open_task_free)(dylib_open_task task)
+{
+    if (task == NULL)
+        return;
+    open_task_join(task);
+    if (task->result && !task->taken)
+        LIBDYLIB_NAME(close)(task->result);
+    mem_free(task);
+}
+
+LIBDYLIB_DEFINE(size_t, preload)(const char *const *paths, size_t n, int flags, dylib_ref *libs)
+{
+    check_null_arg(paths, "NULL path list", 0);
+    check_null_arg(libs, "NULL library list", 0);
+    size_t i, loaded = 0;
+    dylib_open_task *tasks = (dylib_open_task*)mem_alloc((n ? n : 1) * sizeof(dylib_open_task));
+    if (tasks == NULL)
+    {
+        set_error(LIBDYLIB_E_NO_MEMORY, "Out of memory");
+        return 0;
+    }
+    // start reading every file before the loader gets to any of them
+    for (i = 0; i < n; ++i)
+        platform_prefetch(paths[i]);
+    for (i = 0; i < n; ++i)
+        tasks[i] = LIBDYLIB_NAME(open_async)(paths[i], flags);
+    for (i = 0; i < n; ++i)
+    {
+        libs[i] = tasks[i] ? LIBDYLIB_NAME(open_task_wait)(tasks[i]) : NULL;
+        LIBDYLIB_NAME(open_task_free)(tasks[i]);
+        if (libs[i])
+            ++loaded;
+    }
+    mem_free(tasks);
+    return loaded;
+}
+
+// Reader sections and handle sections: each thread gets a reader record on
+// first use, which is never freed (records of exited threads are reused, on
+// Unix). Reader sections (reader_enter()) are epoch-based: they announce the
+// epoch they entered in, and memory retired in epoch e is freed once no reader
+// entered before e. Threads that can't get a record are counted instead, and
+// block all reclamation while they are inside a section.
+// Calls given a handle (handle_enter()) publish the library they use as a
+// hazard in the record instead, which only delays the unloading of that
+// library. A hazard is a single store followed by a check that the handle is
+// still valid - handle_unpublish() and readers_hold() do the same the other
+// way around, so either the lookup sees the handle closed or the closing
+// thread sees the hazard. Sections nested deeper than READER_HAZARDS fall
+// back to reader sections.
+#define READER_HAZARDS 4
+struct reader_record {
+    uint64_t epoch; // 0 outside reader sections
+    dylib_ref hazards[READER_HAZARDS]; // libraries in use by handle sections
+    struct reader_record *next;
+    bool in_use; // protected by the list lock
+    // records are written on every lookup, so each gets its own cache lines
+    char pad[128 - sizeof(uint64_t) - READER_HAZARDS * sizeof(dylib_ref) - sizeof(void*) - sizeof(bool)];
+};
+
+static struct {
+    mutex_t lock; // protects adding to the list, and claiming records
+    struct reader_record *head;
+    uint64_t epoch;
+    uint64_t unregistered;
+} readers = {MUTEX_INIT, NULL, 1, 0};
+
+static LIBDYLIB_TLS struct reader_record *reader_self;
+static LIBDYLIB_TLS unsigned long reader_depth;
+static LIBDYLIB_TLS bool reader_unregistered;
+static LIBDYLIB_TLS unsigned long handle_depth;
+static LIBDYLIB_TLS unsigned handle_hazards; // bit i is set if hazards[i] is used
+
+#if defined(LIBDYLIB_UNIX)
+static pthread_key_t reader_key;
+static pthread_once_t reader_key_once = PTHREAD_ONCE_INIT;
+
+// releases the record of an exiting thread
+static void reader_thread_exit (void *ptr)
+{
+    struct reader_record *rec = (struct reader_record*)ptr;
+    atomic_store_seq(&rec->epoch, 0);
+    mutex_lock(&readers.lock);
+    rec->in_use = false;
+    mutex_unlock(&readers.lock);
+}
+
+static void reader_key_create ()
+{
+    pthread_key_create(&reader_key, reader_thread_exit);
+}
+#endif
+
+// the calling thread's record, or NULL if it can't get one
+static struct reader_record *reader_record_self ()
+{
+    struct reader_record *rec = reader_self;
+    if (rec)
+        return rec;
+    mutex_lock(&readers.lock);
+    for (rec = readers.head; rec && rec->in_use; rec = rec->next)
+        ;
+    if (rec == NULL)
+    {
+        // aligned by hand - records are never freed, so the block isn't kept
+        char *block = (char*)mem_calloc(1, sizeof(*rec) + 64);
+        if (block)
+        {
+            rec = (struct reader_record*)(block + (64 - (uintptr_t)block % 64));
+            rec->next = readers.head;
+            atomic_store_ptr(&readers.head, rec);
+        }
+    }
+    if (rec)
+        rec->in_use = true;
+    mutex_unlock(&readers.lock);
+    if (rec == NULL)
+        return NULL;
+    reader_self = rec;
+#if defined(LIBDYLIB_UNIX)
+    pthread_once(&reader_key_once, reader_key_create);
+    pthread_setspecific(reader_key, rec);
+#endif
+    return rec;
+}
+
+LIBDYLIB_DEFINE(void, reader_enter)()
+{
+    if (reader_depth++)
+        return;
+    struct reader_record *rec = reader_record_self();
+    if (rec == NULL)
+    {
+        reader_unregistered = true;
+        atomic_fetch_add_seq(&readers.unregistered, 1);
+        return;
+    }
+    // sequentially consistent, so that the store is visible before anything
+    // published in a later epoch is read
+    atomic_store_seq(&rec->epoch, atomic_load_seq(&readers.epoch));
+}
+
+LIBDYLIB_DEFINE(void, reader_exit)()
+{
+    if (reader_depth == 0 || --reader_depth)
+        return;
+    if (reader_unregistered)
+    {
+        reader_unregistered = false;
+        atomic_fetch_add_seq(&readers.unregistered, (uint64_t)-1);
+    }
+    else
+        atomic_store_seq(&reader_self->epoch, 0);
+    retired_libs_reclaim();
+}
+
+static dylib_ref handle_enter (dylib_ref ref)
+{
+    check_null_handle(ref, NULL);
+    unsigned long depth = handle_depth;
+    struct reader_record *rec = depth < READER_HAZARDS ? reader_record_self() : NULL;
+    dylib_ref lib = handle_lookup(ref);
+    if (lib && rec)
+    {
+        atomic_store_ptr_seq(&rec->hazards[depth], lib);
+        struct handle_slot *slot = handle_slot(handle_index(ref));
+        if (atomic_load_ptr_seq(&slot->lib) == lib && (dylib_ref)atomic_load_ptr(&lib->ref) == ref)
+            handle_hazards |= 1u << depth;
+        else
+        {
+            atomic_store_ptr(&rec->hazards[depth], NULL);
+            lib = NULL;
+        }
+    }
+    else if (lib)
+    {
+        LIBDYLIB_NAME(reader_enter)();
+        if ((lib = handle_lookup(ref)) == NULL)
+            LIBDYLIB_NAME(reader_exit)();
+    }
+    if (lib == NULL)
+    {
+        set_invalid_handle_error();
+        return NULL;
+    }
+    handle_depth = depth + 1;
+    return lib;
+}
+
+static void handle_exit()
+{
+    unsigned long depth = --handle_depth;
+    if (depth < READER_HAZARDS && (handle_hazards & (1u << depth)))
+    {
+        handle_hazards &= ~(1u << depth);
+        atomic_store_ptr(&reader_self->hazards[depth], NULL);
+        retired_libs_reclaim();
+    }
+    else
+        LIBDYLIB_NAME(reader_exit)();
+}
+
+// starts a new epoch, and returns it - anything unpublished before this call
+// may be freed once readers_quiesced() returns true for the result
+static uint64_t readers_advance()
+{
+    return atomic_fetch_add_seq(&readers.epoch, 1) + 1;
+}
+
+static bool readers_quiesced (uint64_t epoch)
+{
+    if (atomic_load_seq(&readers.unregistered))
+        return false;
+    struct reader_record *rec = (struct reader_record*)atomic_load_ptr(&readers.head);
+    for (; rec; rec = rec->next)
+    {
+        uint64_t e = atomic_load_seq(&rec->epoch);
+        if (e && e < epoch)
+            return false;
+    }
+    return true;
+}
+
+// whether a handle section may be using lib, whose handle was unpublished
+static bool readers_hold (dylib_ref lib)
+{
+    struct reader_record *rec = (struct reader_record*)atomic_load_ptr(&readers.head);
+    size_t i;
+    for (; rec; rec = rec->next)
+    {
+        for (i = 0; i < READER_HAZARDS; ++i)
+        {
+            if (atomic_load_ptr_seq(&rec->hazards[i]) == lib)
+                return true;
+        }
+    }
+    return false;
+}
+
+// Reloadable libraries: each version is loaded next to the previous one,
+// bound, and published with a single pointer store. Retired versions are
+// unloaded once all reader sections that could still be using them have
+// ended. On Linux, versions are loaded through /proc/self/fd/<fd> with the
+// descriptor kept open while the version is loaded (for the life of the
+// process with LIBDYLIB_OPEN_NODELETE), so that the loader doesn't match them
+// to an earlier version by name, and changes are watched with inotify on the
+// containing directory.
+#if defined(LIBDYLIB_LINUX)
+    #include <sys/inotify.h>
+#endif
+
+struct reload_version {
+    dylib_ref lib;  // not registered, so close() rejects it
+    int fd;         // -1 if the version was loaded by path
+    unsigned long generation;
+    uint64_t dev, ino, size, mtime;
+    uint64_t retired_epoch;
+    struct reload_version *next_retired;
+    void *symbols[1]; // table_size entries
+};
+
+#ifdef LIBDYLIB_CXX
+namespace libdylib {
+#endif
+struct dylib_reloadable_data {
+    mutex_t lock; // serializes reloads
+    char *path;
+    const char *name; // last component of path
+    int flags;
+    const dylib_bind_entry *table;
+    size_t table_size;
+    struct reload_version *current; // read with atomic_load_ptr()
+    struct reload_version *retired;
+    void **kept; // handles of freed versions that stay loaded (NODELETE)
+    size_t kept_count;
+    int watch_fd;
+};
+#ifdef LIBDYLIB_CXX
+}
+#endif
+
+static void reload_version_free (dylib_reloadable r, struct reload_version *v)
+{
+    void *handle = v->lib->handle;
+    platform_raw_close(handle);
+    dylib_ref_free(v->lib);
+    if (r->flags & LIBDYLIB_OPEN_NODELETE)
+    {
+        // the version stays loaded under /proc/self/fd/<fd>, so the
+        // descriptor can't be reused for a later version
+        void **kept = (void**)mem_realloc(r->kept, r->kept_count * sizeof(void*),
+            (r->kept_count + 1) * sizeof(void*));
+        if (kept)
+        {
+            kept[r->kept_count++] = handle;
+            r->kept = kept;
+        }
+    }
+#if defined(LIBDYLIB_UNIX)
+    else if (v->fd >= 0)
+        close(v->fd);
+#endif
+    mem_free(v);
+}
+
+// returns true if handle belongs to a version of r that is still loaded
+static bool reload_is_known (dylib_reloadable r, void *handle)
+{
+    const struct reload_version *v;
+    size_t i;
+    if (r->current && r->current->lib->handle == handle)
+        return true;
+    for (v = r->retired; v; v = v->next_retired)
+    {
+        if (v->lib->handle == handle)
+            return true;
+    }
+    for (i = 0; i < r->kept_count; ++i)
+    {
+        if (r->kept[i] == handle)
+            return true;
+    }
+    return false;
+}
+
+static void reload_unwatch (dylib_reloadable r)
+{
+#if defined(LIBDYLIB_UNIX)
+    if (r->watch_fd >= 0)
+        close(r->watch_fd);
+#endif
+    r->watch_fd = -1;
+}
+
+// frees the retired versions that no reader can still see - the handle of a
+// version stays valid until no reader section can be using the version, and
+// the version is freed once no lookup on that handle is either
+static void reload_reclaim (dylib_reloadable r)
+{
+    struct reload_version **link = &r->retired;
+    while (*link)
+    {
+        struct reload_version *v = *link;
+        bool in_use = !readers_quiesced(v->retired_epoch);
+        if (!in_use)
+        {
+            handle_unpublish(v->lib);
+            in_use = readers_hold(v->lib);
+        }
+        if (!in_use)
+        {
+            *link = v->next_retired;
+            reload_version_free(r, v);
+        }
+        else
+            link = &v->next_retired;
+    }
+}
+
+#if defined(LIBDYLIB_UNIX)
+static bool reload_stat (int fd, const char *path, struct reload_version *v)
+{
+    struct stat st;
+    if ((fd >= 0 ? fstat(fd, &st) : stat(path, &st)) != 0)
+        return false;
+    v->dev = (uint64_t)st.st_dev;
+    v->ino = (uint64_t)st.st_ino;
+    v->size = (uint64_t)st.st_size;
+    v->mtime = (uint64_t)st.st_mtime;
+    return true;
+}
+
+// loads and binds a new version of r->path - the caller must hold r->lock
+static struct reload_version *reload_load (dylib_reloadable r)
+{
+    struct reload_version *v = (struct reload_version*)mem_calloc(1,
+        sizeof(*v) + (r->table_size ? r->table_size - 1 : 0) * sizeof(void*));
+    if (v == NULL)
+    {
+        set_error(LIBDYLIB_E_NO_MEMORY, "Out of memory");
+        return NULL;
+    }
+    const char *load_path = r->path;
+    v->fd = -1;
+#if defined(LIBDYLIB_LINUX)
+    char fd_path[32];
+    v->fd = open(r->path, O_RDONLY | O_CLOEXEC);
+    if (v->fd < 0)
+    {
+        set_error_errno(LIBDYLIB_E_OPEN_FAILED, r->path);
+        mem_free(v);
+        return NULL;
+    }
+    snprintf(fd_path, sizeof(fd_path), "/proc/self/fd/%i", v->fd);
+    load_path = fd_path;
+#endif
+    reload_stat(v->fd, r->path, v);
+    void *handle = platform_raw_open(load_path, r->flags);
+    struct reload_version *current = r->current;
+    if (handle && reload_is_known(r, handle))
+    {
+        // only possible if the file was modified in place
+        platform_raw_close(handle);
+        set_error_detail(LIBDYLIB_E_OPEN_FAILED, "Library was not replaced", r->path);
+        handle = NULL;
+    }
+    else if (handle == NULL)
+        platform_set_last_error(LIBDYLIB_E_OPEN_FAILED);
+    if (handle)
+    {
+        v->lib = dylib_ref_alloc(handle, r->path);
+        if (v->lib == NULL)
+        {
+            platform_raw_close(handle);
+            set_error(LIBDYLIB_E_NO_MEMORY, "Out of memory");
+        }
+    }
+    if (v->lib == NULL)
+    {
+        if (v->fd >= 0)
+            close(v->fd);
+        mem_free(v);
+        return NULL;
+    }
+    v->lib->flags = r->flags & open_feature_flags;
+    // versions belong to r, and can't be retained or closed through their handle
+    v->lib->refcount = 0;
+#ifdef LIBDYLIB_ELF
+    if (r->flags & LIBDYLIB_OPEN_ELF_LOOKUP)
+        elf_object_from_handle(&v->lib->elf, handle);
+#endif
+    if (!resolve_table(v->lib, r->table, r->table_size, v->symbols))
+    {
+        reload_version_free(r, v);
+        return NULL;
+    }
+    v->generation = current ? current->generation + 1 : 1;
+    return v;
+}
+
+// publishes v as the current version of r - the caller must hold r->lock
+static void reload_publish (dylib_reloadable r, struct reload_version *v)
+{
+    size_t i;
+    struct reload_version *old = r->current;
+    for (i = 0; i < r->table_size; ++i)
+    {
+        if (r->table[i].dest)
+            atomic_store_ptr(r->table[i].dest, v->symbols[i]);
+    }
+    atomic_store_ptr(&r->current, v);
+    if (old)
+    {
+        old->retired_epoch = readers_advance();
+        old->next_retired = r->retired;
+        r->retired = old;
+    }
+    reload_reclaim(r);
+}
+
+// returns true if the file at r->path may differ from the current version
+static bool reload_changed (dylib_reloadable r)
+{
+#if defined(LIBDYLIB_LINUX)
+    if (r->watch_fd >= 0)
+    {
+        union {
+            struct inotify_event event;
+            char buf[4096];
+        } events;
+        bool changed = false;
+        ssize_t len;
+        while ((len = read(r->watch_fd, events.buf, sizeof(events.buf))) > 0)
+        {
+            const char *p = events.buf;
+            while (p < events.buf + len)
+            {
+                const struct inotify_event *event = (const struct inotify_event*)p;
+                if ((event->mask & IN_Q_OVERFLOW) || (event->len && !strcmp(event->name, r->name)))
+                    changed = true;
+                p += sizeof(*event) + event->len;
+            }
+        }
+        if (!changed)
+            return false;
+    }
+#endif
+    // also filters out events that didn't change the file
+    struct reload_version st;
+    const struct reload_version *current = r->current;
+    if (!reload_stat(-1, r->path, &st))
+        return false;
+    return st.dev != current->dev || st.ino != current->ino ||
+        st.size != current->size || st.mtime != current->mtime;
+}
+#endif
+
+LIBDYLIB_DEFINE(dylib_reloadable, reloadable_open)(const char *path, int flags, const dylib_bind_entry *table, size_t n)
+{
+    check_null_path(path, NULL);
+    if (n)
+        check_null_arg(table, "NULL symbol table", NULL);
+#if defined(LIBDYLIB_UNIX)
+    dylib_reloadable r = (dylib_reloadable)mem_calloc(1, sizeof(*r));
+    char *path_copy = copy_string(path);
+    if (r == NULL || path_copy == NULL)
+    {
+        mem_free(r);
+        mem_free(path_copy);
+        set_error(LIBDYLIB_E_NO_MEMORY, "Out of memory");
+        return NULL;
+    }
+    mutex_t lock = MUTEX_INIT;
+    r->lock = lock;
+    r->path = path_copy;
+    r->name = strrchr(path_copy, '/') ? strrchr(path_copy, '/') + 1 : path_copy;
+    r->flags = flags & ~LIBDYLIB_OPEN_NOLOAD;
+    r->table = table;
+    r->table_size = n;
+    r->watch_fd = -1;
+    struct reload_version *v = reload_load(r);
+    if (v == NULL)
+    {
+        mem_free(path_copy);
+        mem_free(r);
+        return NULL;
+    }
+    reload_publish(r, v);
+#if defined(LIBDYLIB_LINUX)
+    r->watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (r->watch_fd >= 0)
+    {
+        char dir[PATH_BUF_SIZE];
+        size_t dir_len = r->name - path_copy;
+        if (dir_len >= sizeof(dir))
+            dir_len = 0;
+        if (dir_len)
+            memcpy(dir, path_copy, dir_len);
+        else
+            dir[dir_len++] = '.';
+        dir[dir_len] = 0;
+        // changes are only picked up once the new file is complete
+        if (inotify_add_watch(r->watch_fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+            reload_unwatch(r);
+    }
+#endif
+    return r;
+#else
+    (void)flags;
+    set_error(LIBDYLIB_E_UNSUPPORTED, "Reloadable libraries are not supported on this platform");
+    return NULL;
+#endif
+}
+
+LIBDYLIB_DEFINE(bool, reloadable_reload)(dylib_reloadable r)
+{
+    check_null_arg(r, "NULL reloadable library", false);
+#if defined(LIBDYLIB_UNIX)
+    mutex_lock(&r->lock);
+    struct reload_version *v = reload_load(r);
+    if (v)
+        reload_publish(r, v);
+    else
+        reload_reclaim(r);
+    mutex_unlock(&r->lock);
+    return v != NULL;
+#else
+    return false;
+#endif
+}
+
+LIBDYLIB_DEFINE(int, reloadable_poll)(dylib_reloadable r)
+{
+    check_null_arg(r, "NULL reloadable library", -1);
+#if defined(LIBDYLIB_UNIX)
+    mutex_lock(&r->lock);
+    int ret = 0;
+    if (reload_changed(r))
+    {
+        struct reload_version *v = reload_load(r);
+        if (v)
+            reload_publish(r, v);
+        ret = v ? 1 : -1;
+    }
+    reload_reclaim(r);
+    mutex_unlock(&r->lock);
+    return ret;
+#else
+    return 0;
+#endif
+}
+
+LIBDYLIB_DEFINE(int, reloadable_fd)(dylib_reloadable r)
+{
+    return r ? r->watch_fd : -1;
+}
+
+LIBDYLIB_DEFINE(dylib_ref, reloadable_get)(dylib_reloadable r)
+{
+    check_null_arg(r, "NULL reloadable library", NULL);
+    return ((struct reload_version*)atomic_load_ptr(&r->current))->lib->ref;
+}
+
+LIBDYLIB_DEFINE(void *const*, reloadable_symbols)(dylib_reloadable r)
+{
+    check_null_arg(r, "NULL reloadable library", NULL);
+    return ((struct reload_version*)atomic_load_ptr(&r->current))->symbols;
+}
+
+LIBDYLIB_DEFINE(unsigned long, reloadable_generation)(dylib_reloadable r)
+{
+    check_null_arg(r, "NULL reloadable library", 0);
+    return ((struct reload_version*)atomic_load_ptr(&r->current))->generation;
+}
+
+LIBDYLIB_DEFINE(void, reloadable_free)(dylib_reloadable r)
+{
+    if (r == NULL)
+        return;
+    mutex_lock(&r->lock);
+    struct reload_version *v = r->current;
+    v->retired_epoch = readers_advance();
+    v->next_retired = r->retired;
+    r->retired = v;
+    r->current = NULL;
+    while (r->retired)
+    {
+        reload_reclaim(r);
+        if (r->retired)
+            thread_yield();
+    }
+    mutex_unlock(&r->lock);
+    reload_unwatch(r);
+    mem_free(r->kept);
+    mem_free(r->path);
+    mem_free(r);
+}
+
+// Reverse lookup: address-to-symbol indexes hold the defined dynamic symbols
+// of each object sorted by address, and are searched with binary search.
+// Indexes of single libraries are built on first use and live as long as the
+// library. The index of all loaded objects is brought up to date on the first
+// reverse lookup after libdylib has loaded or unloaded anything, and only
+// indexes the objects that weren't loaded at the previous update, unless
+// objects were both loaded and unloaded in between. Elsewhere than ELF
+// platforms, addresses are resolved with dladdr().
+struct addr_symbol {
+    uintptr_t addr;
+    const char *name;
+};
+
+struct addr_object {
+    uintptr_t start, end;
+    uintptr_t base;
+    const char *path;
+    const char *name; // the loader's name, in the index of all objects
+    dylib_ref lib;
+    struct addr_symbol *symbols;
+    size_t count;
+    bool reused; // taken over by the next index of all objects
+};
+
+static void addr_object_free (struct addr_object *obj)
+{
+    if (obj)
+        mem_free(obj->symbols);
+}
+
+static int addr_symbol_compare (const void *a, const void *b)
+{
+    uintptr_t x = ((const struct addr_symbol*)a)->addr, y = ((const struct addr_symbol*)b)->addr;
+    return x < y ? -1 : x > y;
+}
+
+static int addr_object_compare (const void *a, const void *b)
+{
+    uintptr_t x = ((const struct addr_object*)a)->start, y = ((const struct addr_object*)b)->start;
+    return x < y ? -1 : x > y;
+}
+
+// fills info from obj, returning false if addr is outside obj
+static bool addr_object_find (const struct addr_object *obj, uintptr_t addr, dylib_addr_info *info)
+{
+    if (addr < obj->start || addr >= obj->end)
+        return false;
+    // last symbol at or before addr
+    size_t lo = 0, hi = obj->count;
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (obj->symbols[mid].addr <= addr)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    info->lib = obj->lib;
+    info->path = obj->path;
+    info->base = (const void*)obj->base;
+    if (lo)
+    {
+        info->symbol = obj->symbols[lo - 1].name;
+        info->symbol_addr = (const void*)obj->symbols[lo - 1].addr;
+        info->offset = addr - obj->symbols[lo - 1].addr;
+    }
+    else
+    {
+        info->symbol = NULL;
+        info->symbol_addr = NULL;
+        info->offset = addr - obj->base;
+    }
+    return true;
+}
+
+static void addr_info_clear (dylib_addr_info *info)
+{
+    memset(info, 0, sizeof(*info));
+}
+
+#ifdef LIBDYLIB_ELF
+// the number of entries in the dynamic symbol table, which ELF only records
+// in the hash tables
+static uint32_t elf_symbol_count (const struct elf_object *elf)
+{
+    if (!elf->gnu_buckets)
+        return elf->sysv_hash[1];
+    uint32_t i, last = 0;
+    for (i = 0; i < elf->gnu_nbuckets; ++i)
+    {
+        if (elf->gnu_buckets[i] > last)
+            last = elf->gnu_buckets[i];
+    }
+    if (last < elf->gnu_symoffset)
+        return elf->gnu_symoffset;
+    while (!(elf->gnu_chain[last - elf->gnu_symoffset] & 1))
+        ++last;
+    return last + 1;
+}
+
+// builds the index of an object from its program headers - elf may be invalid
+static bool addr_object_init (struct addr_object *obj, const struct elf_object *elf,
+    ElfW(Addr) base, const ElfW(Phdr) *phdr, ElfW(Half) phnum)
+{
+    ElfW(Half) i;
+    uint32_t idx, count = 0;
+    memset(obj, 0, sizeof(*obj));
+    obj->base = base;
+    obj->start = UINTPTR_MAX;
+    for (i = 0; i < phnum; ++i)
+    {
+        if (phdr[i].p_type != PT_LOAD)
+            continue;
+        if (base + phdr[i].p_vaddr < obj->start)
+            obj->start = base + phdr[i].p_vaddr;
+        if (base + phdr[i].p_vaddr + phdr[i].p_memsz > obj->end)
+            obj->end = base + phdr[i].p_vaddr + phdr[i].p_memsz;
+    }
+    if (obj->start >= obj->end)
+        return false;
+    if (!elf->valid)
+        return true;
+    count = elf_symbol_count(elf);
+    obj->symbols = (struct addr_symbol*)mem_alloc(count * sizeof(*obj->symbols) + 1);
+    if (obj->symbols == NULL)
+        return false;
+    for (idx = 1; idx < count; ++idx)
+    {
+        const ElfW(Sym) *sym = &elf->symtab[idx];
+        if (sym->st_shndx == SHN_UNDEF || sym->st_shndx == SHN_ABS || ELF_ST_TYPE(sym->st_info) == STT_TLS)
+            continue;
+        obj->symbols[obj->count].addr = base + sym->st_value;
+        obj->symbols[obj->count].name = elf->strtab + sym->st_name;
+        ++obj->count;
+    }
+    qsort(obj->symbols, obj->count, sizeof(*obj->symbols), addr_symbol_compare);
+    return true;
+}
+
+static bool addr_object_from_handle (struct addr_object *obj, void *handle)
+{
+    struct elf_object elf;
+    if (!elf_object_from_handle(&elf, handle) && elf.phdr == NULL)
+        return false;
+    return addr_object_init(obj, &elf, elf.base, elf.phdr, elf.phnum);
+}
+#endif
+
+// the index of lib, built on first use
+static const struct addr_object *addr_object_get (dylib_ref lib)
+{
+    struct addr_object *obj = (struct addr_object*)atomic_load_ptr(&lib->addr_index);
+    if (obj)
+        return obj;
+#ifdef LIBDYLIB_ELF
+    static mutex_t build_lock = MUTEX_INIT;
+    mutex_lock(&build_lock);
+    obj = lib->addr_index;
+    if (obj == NULL)
+    {
+        obj = (struct addr_object*)mem_alloc(sizeof(*obj));
+        if (obj && addr_object_from_handle(obj, lib->handle))
+        {
+            obj->path = lib->path;
+            obj->lib = lib->ref;
+            atomic_store_ptr(&lib->addr_index, obj);
+        }
+        else
+        {
+            mem_free(obj);
+            obj = NULL;
+        }
+    }
+    mutex_unlock(&build_lock);
+#endif
+    return obj;
+}
+
+static struct {
+    rwlock_t lock;
+    struct addr_object *objects; // sorted by start address
+    size_t count;
+    uint64_t generation; // loaded_generation when built, 0 if never built
+    unsigned long long adds, subs; // loader counters when built
+    bool counted; // false if the loader doesn't keep the counters
+} addr_index = {RWLOCK_INIT, NULL, 0, 0, 0, 0, false};
+
+#ifdef LIBDYLIB_ELF
+struct addr_index_build {
+    struct addr_object *objects;
+    size_t count, capacity;
+    bool failed;
+    bool started;
+    bool reuse; // whether objects of the previous index can be taken over
+};
+
+// the object of the current index starting at start, if any
+static struct addr_object *addr_index_at (uintptr_t start)
+{
+    size_t lo = 0, hi = addr_index.count;
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (addr_index.objects[mid].start < start)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo < addr_index.count && addr_index.objects[lo].start == start ? &addr_index.objects[lo] : NULL;
+}
+
+static int addr_index_callback (struct dl_phdr_info *info, size_t size, void *data)
+{
+    struct addr_index_build *build = (struct addr_index_build*)data;
+    struct elf_object elf;
+    if (!build->started)
+    {
+        // the loader lock is held for the whole iteration, so the counters
+        // describe exactly the objects that are about to be listed
+        build->started = true;
+        bool counted = size >= offsetof(struct dl_phdr_info, dlpi_subs) + sizeof(info->dlpi_subs);
+        // address ranges are only ambiguous if objects were both loaded and
+        // unloaded since the previous build
+        build->reuse = counted && addr_index.counted &&
+            (info->dlpi_adds == addr_index.adds || info->dlpi_subs == addr_index.subs);
+        addr_index.counted = counted;
+        if (counted)
+        {
+            addr_index.adds = info->dlpi_adds;
+            addr_index.subs = info->dlpi_subs;
+        }
+    }
+    if (build->count == build->capacity)
+    {
+        size_t capacity = build->capacity ? build->capacity * 2 : 64;
+        struct addr_object *objects = (struct addr_object*)mem_realloc(build->objects,
+            build->capacity * sizeof(*objects), capacity * sizeof(*objects));
+        if (objects == NULL)
+        {
+            build->failed = true;
+            return 1;
+        }
+        build->objects = objects;
+        build->capacity = capacity;
+    }
+    struct addr_object *obj = &build->objects[build->count];
+    struct addr_object *prev = NULL;
+    if (build->reuse)
+    {
+        uintptr_t start = UINTPTR_MAX;
+        ElfW(Half) i;
+        for (i = 0; i < info->dlpi_phnum; ++i)
+        {
+            if (info->dlpi_phdr[i].p_type == PT_LOAD && info->dlpi_addr + info->dlpi_phdr[i].p_vaddr < start)
+                start = info->dlpi_addr + info->dlpi_phdr[i].p_vaddr;
+        }
+        prev = addr_index_at(start);
+        if (prev && (prev->base != (uintptr_t)info->dlpi_addr || prev->reused))
+            prev = NULL;
+    }
+    if (prev)
+    {
+        // still loaded since the previous build: only its name can change
+        prev->reused = true;
+        *obj = *prev;
+        obj->name = info->dlpi_name;
+        ++build->count;
+        return 0;
+    }
+    elf_object_init(&elf, info->dlpi_addr, info->dlpi_phdr, info->dlpi_phnum);
+    if (addr_object_init(obj, &elf, info->dlpi_addr, info->dlpi_phdr, info->dlpi_phnum))
+    {
+        obj->name = info->dlpi_name;
+        ++build->count;
+    }
+    return 0;
+}
+
+// sets the lib of each object that is open through libdylib
+static void addr_index_match_libs (struct addr_object *objects, size_t count)
+{
+    size_t i, j;
+    for (j = 0; j < count; ++j)
+    {
+        objects[j].lib = NULL;
+        objects[j].path = objects[j].name;
+    }
+    rwlock_read(&registry.lock);
+    for (i = 0; i < registry.count; ++i)
+    {
+        dylib_ref lib = registry.refs[i];
+        struct link_map *map = NULL;
+        if (lib->is_self || dlinfo(lib->handle, RTLD_DI_LINKMAP, &map) != 0 || map == NULL)
+            continue;
+        for (j = 0; j < count; ++j)
+        {
+            if (objects[j].base == (uintptr_t)map->l_addr && map->l_name && objects[j].name &&
+                !strcmp(objects[j].name, map->l_name))
+            {
+                objects[j].lib = lib->ref;
+                objects[j].path = lib->path;
+                break;
+            }
+        }
+    }
+    rwlock_unlock_read(&registry.lock);
+    dlerror();
+}
+#endif
+
+// brings the index of all objects up to date, reusing the objects that are
+// still loaded - the caller must hold the lock for writing
+static bool addr_index_rebuild (uint64_t generation)
+{
+#ifdef LIBDYLIB_ELF
+    struct addr_index_build build = {NULL, 0, 0, false, false, false};
+    size_t i;
+    dl_iterate_phdr(addr_index_callback, &build);
+    if (build.failed)
+    {
+        for (i = 0; i < build.count; ++i)
+        {
+            if (!build.objects[i].reused)
+                addr_object_free(&build.objects[i]);
+        }
+        mem_free(build.objects);
+        for (i = 0; i < addr_index.count; ++i)
+            addr_index.objects[i].reused = false;
+        // the counters no longer describe the index
+        addr_index.counted = false;
+        return false;
+    }
+    qsort(build.objects, build.count, sizeof(*build.objects), addr_object_compare);
+    addr_index_match_libs(build.objects, build.count);
+    for (i = 0; i < addr_index.count; ++i)
+    {
+        if (!addr_index.objects[i].reused)
+            addr_object_free(&addr_index.objects[i]);
+    }
+    for (i = 0; i < build.count; ++i)
+        build.objects[i].reused = false;
+    mem_free(addr_index.objects);
+    addr_index.objects = build.objects;
+    addr_index.count = build.count;
+#endif
+    addr_index.generation = generation;
+    return true;
+}
+
+// takes the index lock for reading, with the index up to date
+static bool addr_index_read()
+{
+    rwlock_read(&addr_index.lock);
+    uint64_t generation = atomic_load64(&loaded_generation);
+    if (addr_index.generation == generation)
+        return true;
+    rwlock_unlock_read(&addr_index.lock);
+    rwlock_write(&addr_index.lock);
+    bool ok = addr_index.generation == generation || addr_index_rebuild(generation);
+    rwlock_unlock_write(&addr_index.lock);
+    if (!ok)
+        return false;
+    // another rebuild may happen in between, which is just as good
+    rwlock_read(&addr_index.lock);
+    return true;
+}
+
+static bool addr_index_find (const void *addr, dylib_addr_info *info)
+{
+    size_t lo = 0, hi = addr_index.count;
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (addr_index.objects[mid].start <= (uintptr_t)addr)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo && addr_object_find(&addr_index.objects[lo - 1], (uintptr_t)addr, info);
+}
+
+#if defined(LIBDYLIB_UNIX) && !defined(LIBDYLIB_ELF)
+static bool addr_dladdr (dylib_ref lib, const void *addr, dylib_addr_info *info)
+{
+    Dl_info dl;
+    if (!dladdr(addr, &dl) || dl.dli_fname == NULL)
+        return false;
+    if (lib)
+    {
+        void *handle = dlopen(dl.dli_fname, RTLD_LAZY | RTLD_NOLOAD);
+        if (handle)
+            dlclose(handle);
+        if (handle != lib->handle)
+            return false;
+    }
+    info->lib = lib ? lib->ref : NULL;
+    info->path = lib ? lib->path : dl.dli_fname;
+    info->base = dl.dli_fbase;
+    info->symbol = dl.dli_sname;
+    info->symbol_addr = dl.dli_saddr;
+    info->offset = (const char*)addr - (const char*)(dl.dli_saddr ? dl.dli_saddr : dl.dli_fbase);
+    return true;
+}
+#endif
+
+// resolves n addresses - the caller must hold the index lock if lib is NULL
+static size_t addr_resolve (dylib_ref lib, const struct addr_object *obj,
+    const void *const *addrs, size_t n, dylib_addr_info *infos)
+{
+    size_t i, found = 0;
+    for (i = 0; i < n; ++i)
+    {
+        bool ok;
+#if defined(LIBDYLIB_UNIX) && !defined(LIBDYLIB_ELF)
+        (void)obj;
+        ok = addr_dladdr(lib, addrs[i], &infos[i]);
+#else
+        ok = lib ? obj && addr_object_find(obj, (uintptr_t)addrs[i], &infos[i]) : addr_index_find(addrs[i], &infos[i]);
+#endif
+        if (ok)
+            ++found;
+        else
+            addr_info_clear(&infos[i]);
+    }
+    return found;
+}
+
+// sets *ok to false and sets an error if the index can't be used
+static size_t addr_lookup (dylib_ref lib, const void *const *addrs, size_t n, dylib_addr_info *infos, bool *ok)
+{
+    *ok = true;
+#if defined(LIBDYLIB_WINDOWS)
+    (void)lib; (void)addrs; (void)n; (void)infos;
+    *ok = false;
+    set_error(LIBDYLIB_E_UNSUPPORTED, "Reverse lookups are not supported on this platform");
+    return 0;
+#else
+    size_t found;
+    if (lib)
+        return addr_resolve(lib, addr_object_get(lib), addrs, n, infos);
+    if (!addr_index_read())
+    {
+        *ok = false;
+        set_error(LIBDYLIB_E_NO_MEMORY, "Out of memory");
+        return 0;
+    }
+    found = addr_resolve(NULL, NULL, addrs, n, infos);
+    rwlock_unlock_read(&addr_index.lock);
+    return found;
+#endif
+}
+
+LIBDYLIB_DEFINE(bool, addr_to_symbol)(dylib_ref ref, const void *addr, dylib_addr_info *info)
+{
+    check_null_arg(info, "NULL address info", false);
+    dylib_ref lib = NULL;
+    if (ref && (lib = handle_enter(ref)) == NULL)
+        return false;
+    bool ok;
+    size_t found = addr_lookup(lib, &addr, 1, info, &ok);
+    if (lib)
+        handle_exit();
+    if (!found && ok)
+        set_error(LIBDYLIB_E_NOT_FOUND, "Address is not in a loaded object");
+    return found != 0;
+}
+
+LIBDYLIB_DEFINE(size_t, addr_to_symbols)(dylib_ref ref, const void *const *addrs, size_t n, dylib_addr_info *infos)
+{
+    if (n)
+    {
+        check_null_arg(addrs, "NULL address list", 0);
+        check_null_arg(infos, "NULL address info list", 0);
+    }
+    dylib_ref lib = NULL;
+    if (ref && (lib = handle_enter(ref)) == NULL)
+        return 0;
+    bool ok;
+    size_t found = addr_lookup(lib, addrs, n, infos, &ok);
+    if (lib)
+        handle_exit();
+    return found;
+}
+
+// Resolution scopes: an ordered list of libraries, searched as a whole
+// through a single hash table of the symbols they define, which maps each
+// name to the first library in the scope that defines it. The table is
+// built on the first lookup and then updated as libraries are inserted and
+// removed. Libraries whose symbol tables can't be read (everywhere but ELF
+// platforms) are searched with lookups, in order, before the table result.
+struct scope_entry {
+    const char *name; // NULL for empty slots
+    uint32_t hash;
+    uint32_t pos;     // the index of the defining library in the scope
+    void *addr;       // NULL if resolved by the platform (thread-local symbols)
+};
+
+struct scope_member {
+    dylib_ref lib;
+#ifdef LIBDYLIB_ELF
+    struct elf_object elf;
+#endif
+    bool indexed;
+};
+
+#ifdef LIBDYLIB_CXX
+namespace libdylib {
+#endif
+struct dylib_scope_data {
+    rwlock_t lock;
+    struct scope_member *members;
+    size_t count, capacity;
+    size_t first_unindexed; // count if every library is indexed
+    bool built;
+    struct scope_entry *entries;
+    size_t entry_count, entry_capacity; // always a power of 2, or 0
+};
+#ifdef LIBDYLIB_CXX
+}
+#endif
+
+static struct scope_entry *scope_find (dylib_scope scope, const char *symbol, uint32_t hash)
+{
+    if (!scope->entry_capacity)
+        return NULL;
+    size_t mask = scope->entry_capacity - 1, i = symbol_cache_slot(hash, scope->entry_capacity);
+    for (; scope->entries[i].name; i = (i + 1) & mask)
+    {
+        if (scope->entries[i].hash == hash && !strcmp(scope->entries[i].name, symbol))
+            return &scope->entries[i];
+    }
+    return NULL;
+}
+
+// removes an entry, moving later entries of the same probe sequence back
+static void scope_delete (dylib_scope scope, struct scope_entry *entry)
+{
+    size_t mask = scope->entry_capacity - 1, hole = entry - scope->entries, i = hole;
+    while (true)
+    {
+        i = (i + 1) & mask;
+        if (!scope->entries[i].name)
+            break;
+        size_t home = symbol_cache_slot(scope->entries[i].hash, scope->entry_capacity);
+        // move entry i into the hole unless its home slot lies after the hole
+        if (((i - home) & mask) >= ((i - hole) & mask))
+        {
+            scope->entries[hole] = scope->entries[i];
+            hole = i;
+        }
+    }
+    scope->entries[hole].name = NULL;
+    --scope->entry_count;
+}
+
+static bool scope_grow (dylib_scope scope)
+{
+    size_t capacity = scope->entry_capacity ? scope->entry_capacity * 2 : 1024, i;
+    struct scope_entry *entries = (struct scope_entry*)mem_calloc(capacity, sizeof(*entries));
+    if (entries == NULL)
+        return false;
+    for (i = 0; i < scope->entry_capacity; ++i)
+    {
+        const struct scope_entry *entry = &scope->entries[i];
+        if (!entry->name)
+            continue;
+        size_t j = symbol_cache_slot(entry->hash, capacity);
+        while (entries[j].name)
+            j = (j + 1) & (capacity - 1);
+        entries[j] = *entry;
+    }
+    mem_free(scope->entries);
+    scope->entries = entries;
+    scope->entry_capacity = capacity;
+    return true;
+}
+
+// records that the library at pos defines symbol, unless a library before it
+// does too
+static bool scope_put (dylib_scope scope, const char *symbol, uint32_t hash, uint32_t pos, void *addr)
+{
+    struct scope_entry *entry = scope_find(scope, symbol, hash);
+    if (entry)
+    {
+        if (entry->pos > pos)
+        {
+            entry->pos = pos;
+            entry->addr = addr;
+        }
+        return true;
+    }
+    // keep the table at most half full
+    if ((scope->entry_count + 1) * 2 > scope->entry_capacity && !scope_grow(scope))
+        return false;
+    size_t i = symbol_cache_slot(hash, scope->entry_capacity);
+    while (scope->entries[i].name)
+        i = (i + 1) & (scope->entry_capacity - 1);
+    entry = &scope->entries[i];
+    entry->name = symbol;
+    entry->hash = hash;
+    entry->pos = pos;
+    entry->addr = addr;
+    ++scope->entry_count;
+    return true;
+}
+
+#ifdef LIBDYLIB_ELF
+// calls func for each symbol that a lookup in obj would find - the address
+// is NULL for thread-local symbols
+static bool scope_each_symbol (const struct scope_member *member,
+    bool (*func)(dylib_scope, const char*, void*, void*), dylib_scope scope, void *data)
+{
+    const struct elf_object *obj = &member->elf;
+    uint32_t idx, count = elf_symbol_count(obj);
+    for (idx = 1; idx < count; ++idx)
+    {
+        const ElfW(Sym) *sym = &obj->symtab[idx];
+        int bind = ELF_ST_BIND(sym->st_info), type = ELF_ST_TYPE(sym->st_info);
+        if (sym->st_shndx == SHN_UNDEF || sym->st_shndx == SHN_ABS)
+            continue;
+        if (bind != STB_GLOBAL && bind != STB_WEAK && bind != STB_GNU_UNIQUE)
+            continue;
+        if (obj->versym && ((obj->versym[idx] & ELF_VERSYM_HIDDEN) || obj->versym[idx] == 0))
+            continue;
+        const char *name = obj->strtab + sym->st_name;
+        void *addr = (void*)(obj->base + sym->st_value);
+        if (type == STT_GNU_IFUNC)
+            addr = platform_raw_lookup(member->lib->handle, name);
+        else if (type == STT_TLS)
+            addr = NULL;
+        if (!func(scope, name, addr, data))
+            return false;
+    }
+    return true;
+}
+
+static bool scope_merge_symbol (dylib_scope scope, const char *name, void *addr, void *data)
+{
+    return scope_put(scope, name, symbol_hash(name), *(uint32_t*)data, addr);
+}
+
+static bool scope_unmerge_symbol (dylib_scope scope, const char *name, void *addr, void *data)
+{
+    struct scope_entry *entry = scope_find(scope, name, symbol_hash(name));
+    (void)addr;
+    if (entry && entry->pos == *(uint32_t*)data)
+        scope_delete(scope, entry);
+    return true;
+}
+#endif
+
+// adds the symbols of the library at pos to the table
+static bool scope_merge (dylib_scope scope, size_t pos)
+{
+#ifdef LIBDYLIB_ELF
+    uint32_t pos32 = (uint32_t)pos;
+    if (scope->members[pos].indexed)
+        return scope_each_symbol(&scope->members[pos], scope_merge_symbol, scope, &pos32);
+#else
+    (void)scope; (void)pos;
+#endif
+    return true;
+}
+
+static void scope_shift (dylib_scope scope, size_t from, int by)
+{
+    size_t i;
+    for (i = 0; i < scope->entry_capacity; ++i)
+    {
+        if (scope->entries[i].name && scope->entries[i].pos >= from)
+            scope->entries[i].pos += by;
+    }
+    for (scope->first_unindexed = 0; scope->first_unindexed < scope->count; ++scope->first_unindexed)
+    {
+        if (!scope->members[scope->first_unindexed].indexed)
+            break;
+    }
+}
+
+static void scope_clear (dylib_scope scope)
+{
+    mem_free(scope->entries);
+    scope->entries = NULL;
+    scope->entry_count = scope->entry_capacity = 0;
+    scope->built = false;
+}
+
+// builds the table - the caller must hold the lock for writing
+static bool scope_build (dylib_scope scope)
+{
+    size_t i;
+    for (i = 0; i < scope->count; ++i)
+    {
+        if (!scope_merge(scope, i))
+        {
+            scope_clear(scope);
+            return false;
+        }
+    }
+    scope->built = true;
+    return true;
+}
+
+LIBDYLIB_DEFINE(dylib_scope, scope_create)()
+{
+    dylib_scope scope = (dylib_scope)mem_calloc(1, sizeof(*scope));
+    if (scope == NULL)
+    {
+        set_error(LIBDYLIB_E_NO_MEMORY, "Out of memory");
+        return NULL;
+    }
+    rwlock_init(&scope->lock);
+    return scope;
+}
+
+static size_t scope_index (dylib_scope scope, dylib_ref ref)
+{
+    size_t i;
+    for (i = 0; i < scope->count; ++i)
+    {
+        if (scope->members[i].lib->ref == ref)
+            break;
+    }
+    return i;
+}
+
+LIBDYLIB_DEFINE(bool, scope_insert)(dylib_scope scope, size_t index, dylib_ref ref)
+{
+    check_null_arg(scope, "NULL scope", false);
+    check_null_handle(ref, false);
+    rwlock_write(&scope->lock);
+    if (scope_index(scope, ref) != scope->count)
+    {
+        rwlock_unlock_write(&scope->lock);
+        return true;
+    }
+    if (scope->count == scope->capacity)
+    {
+        size_t capacity = scope->capacity ? scope->capacity * 2 : 8;
+        struct scope_member *members = (struct scope_member*)mem_realloc(scope->members,
+            scope->capacity * sizeof(*members), capacity * sizeof(*members));
+        if (members == NULL)
+        {
+            rwlock_unlock_write(&scope->lock);
+            set_error(LIBDYLIB_E_NO_MEMORY, "Out of memory");
+            return false;
+        }
+        scope->members = members;
+        scope->capacity = capacity;
+    }
+    if (!LIBDYLIB_NAME(retain)(ref))
+    {
+        rwlock_unlock_write(&scope->lock);
+        return false;
+    }
+    // the scope's reference keeps lib valid
+    dylib_ref lib = handle_lookup(ref);
+    if (index > scope->count)
+        index = scope->count;
+    memmove(&scope->members[index + 1], &scope->members[index], (scope->count - index) * sizeof(*scope->members));
+    struct scope_member *member = &scope->members[index];
+    member->lib = lib;
+    member->indexed = false;
+#ifdef LIBDYLIB_ELF
+    member->indexed = elf_object_from_handle(&member->elf, lib->handle);
+#endif
+    ++scope->count;
+    if (scope->built)
+    {
+        scope_shift(scope, index, 1);
+        if (!scope_merge(scope, index))
+            scope_clear(scope); // rebuilt by the next lookup
+    }
+    else
+        scope_shift(scope, 0, 0);
+    rwlock_unlock_write(&scope->lock);
+    return true;
+}
+
+LIBDYLIB_DEFINE(bool, scope_add)(dylib_scope scope, dylib_ref ref)
+{
+    return LIBDYLIB_NAME(scope_insert)(scope, (size_t)-1, ref);
+}
+
+LIBDYLIB_DEFINE(bool, scope_remove)(dylib_scope scope, dylib_ref ref)
+{
+    check_null_arg(scope, "NULL scope", false);
+    check_null_handle(ref, false);
+    rwlock_write(&scope->lock);
+    size_t i, index = scope_index(scope, ref);
+    if (index == scope->count)
+    {
+        rwlock_unlock_write(&scope->lock);
+        set_error(LIBDYLIB_E_INVALID_HANDLE, "Library is not in the scope");
+        return false;
+    }
+#ifdef LIBDYLIB_ELF
+    // forget the symbols the library provided, and look for them in the
+    // libraries after it instead
+    uint32_t pos32 = (uint32_t)index;
+    if (scope->built && scope->members[index].indexed)
+        scope_each_symbol(&scope->members[index], scope_unmerge_symbol, scope, &pos32);
+#endif
+    --scope->count;
+    memmove(&scope->members[index], &scope->members[index + 1], (scope->count - index) * sizeof(*scope->members));
+    if (scope->built)
+    {
+        scope_shift(scope, index + 1, -1);
+        for (i = index; i < scope->count && scope->built; ++i)
+        {
+            if (!scope_merge(scope, i))
+                scope_clear(scope);
+        }
+    }
+    else
+        scope_shift(scope, 0, 0);
+    rwlock_unlock_write(&scope->lock);
+    LIBDYLIB_NAME(close)(ref);
+    return true;
+}
+
+LIBDYLIB_DEFINE(size_t, scope_size)(dylib_scope scope)
+{
+    check_null_arg(scope, "NULL scope", 0);
+    rwlock_read(&scope->lock);
+    size_t count = scope->count;
+    rwlock_unlock_read(&scope->lock);
+    return count;
+}
+
+LIBDYLIB_DEFINE(void*, scope_lookup)(dylib_scope scope, const char *symbol, dylib_ref *lib)
+{
+    check_null_arg(scope, "NULL scope", NULL);
+    check_null_arg(symbol, "NULL symbol", NULL);
+    rwlock_read(&scope->lock);
+    while (!scope->built)
+    {
+        rwlock_unlock_read(&scope->lock);
+        rwlock_write(&scope->lock);
+        bool ok = scope->built || scope_build(scope);
+        rwlock_unlock_write(&scope->lock);
+        if (!ok)
+        {
+            set_error(LIBDYLIB_E_NO_MEMORY, "Out of memory");
+            return NULL;
+        }
+        rwlock_read(&scope->lock);
+    }
+    uint32_t hash = symbol_hash(symbol);
+    const struct scope_entry *entry = scope_find(scope, symbol, hash);
+    size_t i, end = entry ? entry->pos : scope->count;
+    void *addr = NULL;
+    dylib_ref found = NULL;
+    for (i = scope->first_unindexed; i < end && !addr; ++i)
+    {
+        if (!scope->members[i].indexed)
+        {
+            found = scope->members[i].lib;
+            addr = resolve_symbol_counted(found, symbol, hash, true);
+        }
+    }
+    if (!addr && entry)
+    {
+        found = scope->members[entry->pos].lib;
+        addr = entry->addr ? entry->addr : resolve_symbol_counted(found, symbol, hash, true);
+    }
+    rwlock_unlock_read(&scope->lock);
+    // members only count their own lookups
+    stats_add_lookup(NULL, addr != NULL);
+    if (lib)
+        *lib = addr ? found->ref : NULL;
+    if (addr == NULL)
+        set_lookup_error(symbol);
+    return addr;
+}
+
+LIBDYLIB_DEFINE(void, scope_free)(dylib_scope scope)
+{
+    size_t i;
+    if (scope == NULL)
+        return;
+    for (i = 0; i < scope->count; ++i)
+        LIBDYLIB_NAME(close)(scope->members[i].lib->ref);
+    mem_free(scope->members);
+    mem_free(scope->entries);
+    rwlock_destroy(&scope->lock);
+    mem_free(scope);
+}
+
+// Dependency graphs: the DT_NEEDED entries of a library file and of its
+// dependencies, resolved breadth-first (the order in which the loader loads
+// them) without loading anything. Names are searched for the way glibc does:
+// in the DT_RPATH of the object and of the objects that led to it (unless
+// the object has DT_RUNPATH), LD_LIBRARY_PATH (as it was when the process
+// started), DT_RUNPATH, /etc/ld.so.cache and the default directories,
+// skipping files for other machines. Names that are already loaded are not
+// followed, and all files of each level of the graph are prefetched before
+// any of them is read.
+#define DEPS_NONE ((size_t)-1)
+
+struct deps_node {
+    dylib_dependency info;
+    char *rpath, *runpath; // NULL if the object has none
+    uint64_t dev, ino;
+    bool has_file_id;
+};
+
+#ifdef LIBDYLIB_CXX
+namespace libdylib {
+#endif
+struct dylib_deps_data {
+    struct deps_node *nodes;
+    size_t count, capacity;
+};
+#ifdef LIBDYLIB_CXX
+}
+#endif
+
+static void deps_free_nodes (dylib_deps deps)
+{
+    size_t i;
+    for (i = 0; i < deps->count; ++i)
+    {
+        mem_free((void*)deps->nodes[i].info.name);
+        mem_free((void*)deps->nodes[i].info.path);
+        mem_free(deps->nodes[i].rpath);
+        mem_free(deps->nodes[i].runpath);
+    }
+    mem_free(deps->nodes);
+}
+
+#ifdef LIBDYLIB_ELF
+struct elf_file_segment {
+    uint32_t type;
+    uint64_t offset, vaddr, filesz;
+};
+
+static bool elf_file_segment (const struct elf_file *f, uint32_t idx, struct elf_file_segment *seg)
+{
+    if (idx >= f->phnum)
+        return false;
+    uint64_t offset = f->phoff + (uint64_t)idx * f->phentsize;
+    if (f->is64)
+    {
+        const Elf64_Phdr *ph = (const Elf64_Phdr*)elf_file_range(f, offset, sizeof(Elf64_Phdr), 8);
+        if (ph == NULL)
+            return false;
+        seg->type = ph->p_type;
+        seg->offset = ph->p_offset;
+        seg->vaddr = ph->p_vaddr;
+        seg->filesz = ph->p_filesz;
+    }
+    else
+    {
+        const Elf32_Phdr *ph = (const Elf32_Phdr*)elf_file_range(f, offset, sizeof(Elf32_Phdr), 4);
+        if (ph == NULL)
+            return false;
+        seg->type = ph->p_type;
+        seg->offset = ph->p_offset;
+        seg->vaddr = ph->p_vaddr;
+        seg->filesz = ph->p_filesz;
+    }
+    return true;
+}
+
+// the dynamic section of an ELF file, with its string table
+struct elf_file_dynamic {
+    const unsigned char *entries;
+    uint64_t count;
+    const char *strtab;
+    uint64_t strtab_size;
+};
+
+static bool elf_file_dyn (const struct elf_file *f, const struct elf_file_dynamic *dyn, uint64_t i, int64_t *tag, uint64_t *val)
+{
+    if (i >= dyn->count)
+        return false;
+    if (f->is64)
+    {
+        const Elf64_Dyn *d = (const Elf64_Dyn*)dyn->entries + i;
+        *tag = d->d_tag;
+        *val = d->d_un.d_val;
+    }
+    else
+    {
+        const Elf32_Dyn *d = (const Elf32_Dyn*)dyn->entries + i;
+        *tag = d->d_tag;
+        *val = d->d_un.d_val;
+    }
+    return *tag != DT_NULL;
+}
+
+// returns the string at offset in the dynamic string table, or NULL
+static const char *elf_file_dyn_string (const struct elf_file_dynamic *dyn, uint64_t offset)
+{
+    if (offset >= dyn->strtab_size || !memchr(dyn->strtab + offset, 0, dyn->strtab_size - offset))
+        return NULL;
+    return dyn->strtab + offset;
+}
+
+// finds the dynamic section through the program headers, as the loader does
+static bool elf_file_dynamic_init (const struct elf_file *f, struct elf_file_dynamic *dyn)
+{
+    struct elf_file_segment seg;
+    uint64_t i, strtab_vaddr = 0, entsize = f->is64 ? sizeof(Elf64_Dyn) : sizeof(Elf32_Dyn);
+    int64_t tag;
+    uint64_t val;
+    memset(dyn, 0, sizeof(*dyn));
+    for (i = 0; i < f->phnum && elf_file_segment(f, (uint32_t)i, &seg); ++i)
+    {
+        if (seg.type == PT_DYNAMIC)
+        {
+            dyn->count = seg.filesz / entsize;
+            dyn->entries = (const unsigned char*)elf_file_range(f, seg.offset, dyn->count * entsize, f->is64 ? 8 : 4);
+        }
+    }
+    if (dyn->entries == NULL)
+        return false;
+    for (i = 0; elf_file_dyn(f, dyn, i, &tag, &val); ++i)
+    {
+        if (tag == DT_STRTAB)
+            strtab_vaddr = val;
+        else if (tag == DT_STRSZ)
+            dyn->strtab_size = val;
+    }
+    // DT_STRTAB is an address, found in the file through the load segments
+    for (i = 0; i < f->phnum && elf_file_segment(f, (uint32_t)i, &seg); ++i)
+    {
+        if (seg.type == PT_LOAD && strtab_vaddr >= seg.vaddr && strtab_vaddr - seg.vaddr < seg.filesz)
+        {
+            dyn->strtab = (const char*)elf_file_range(f, seg.offset + (strtab_vaddr - seg.vaddr), dyn->strtab_size, 1);
+            break;
+        }
+    }
+    return dyn->strtab != NULL && dyn->strtab_size;
+}
+
+// /etc/ld.so.cache, in the format used since glibc 2.32 (and included in
+// the older combined format)
+#define LD_CACHE_MAGIC "glibc-ld.so.cache1.1"
+#define LD_CACHE_OLD_MAGIC "ld.so-1.7.0"
+#define LD_CACHE_HEADER_SIZE 48
+#define LD_CACHE_ENTRY_SIZE 24
+#define LD_CACHE_FLAG_TYPE_MASK 0xff
+#define LD_CACHE_FLAG_ELF_LIBC6 3
+
+struct ld_cache {
+    const unsigned char *map;
+    size_t map_size;
+    const unsigned char *data; // the new format header, to which offsets are relative
+    size_t size;
+    uint32_t count;
+};
+
+static void ld_cache_open (struct ld_cache *cache)
+{
+    struct error_state err = last_err;
+    size_t offset = 0;
+    uint32_t count;
+    memset(cache, 0, sizeof(*cache));
+    if (!map_file("/etc/ld.so.cache", &cache->map, &cache->map_size))
+    {
+        // not having a cache is not an error
+        last_err = err;
+        return;
+    }
+    if (cache->map_size >= 16 && !memcmp(cache->map, LD_CACHE_OLD_MAGIC, sizeof(LD_CACHE_OLD_MAGIC) - 1))
+    {
+        memcpy(&count, cache->map + 12, sizeof(count));
+        offset = (16 + (size_t)count * 12 + 7) & ~(size_t)7;
+    }
+    if (offset >= cache->map_size || cache->map_size - offset < LD_CACHE_HEADER_SIZE ||
+        memcmp(cache->map + offset, LD_CACHE_MAGIC, sizeof(LD_CACHE_MAGIC) - 1) != 0)
+        return;
+    cache->data = cache->map + offset;
+    cache->size = cache->map_size - offset;
+    memcpy(&count, cache->data + sizeof(LD_CACHE_MAGIC) - 1, sizeof(count));
+    if (count > (cache->size - LD_CACHE_HEADER_SIZE) / LD_CACHE_ENTRY_SIZE)
+        count = 0;
+    cache->count = count;
+}
+
+static void ld_cache_close (struct ld_cache *cache)
+{
+    if (cache->map)
+        munmap((void*)cache->map, cache->map_size);
+    memset(cache, 0, sizeof(*cache));
+}
+
+static const char *ld_cache_string (const struct ld_cache *cache, uint32_t offset)
+{
+    if (offset >= cache->size || !memchr(cache->data + offset, 0, cache->size - offset))
+        return NULL;
+    return (const char*)cache->data + offset;
+}
+
+// copies the first usable path for name into buf
+static bool ld_cache_find (const struct ld_cache *cache, const char *name, char *buf)
+{
+    uint32_t i;
+    for (i = 0; i < cache->count; ++i)
+    {
+        const unsigned char *entry = cache->data + LD_CACHE_HEADER_SIZE + (size_t)i * LD_CACHE_ENTRY_SIZE;
+        int32_t flags;
+        uint32_t key, value;
+        memcpy(&flags, entry, 4);
+        memcpy(&key, entry + 4, 4);
+        memcpy(&value, entry + 8, 4);
+        if ((flags & LD_CACHE_FLAG_TYPE_MASK) != LD_CACHE_FLAG_ELF_LIBC6)
+            continue;
+        const char *entry_name = ld_cache_string(cache, key), *path = ld_cache_string(cache, value);
+        if (entry_name && path && !strcmp(entry_name, name) && strlen(path) < PATH_BUF_SIZE && elf_file_probe(path))
+        {
+            strcpy(buf, path);
+            return true;
+        }
+    }
+    return false;
+}
+
+// an object loaded in the process, which the loader would reuse
+struct deps_loaded {
+    char *path;
+    const char *base; // file name part of path
+    uint64_t dev, ino;
+    bool has_file_id;
+};
+
+// state of a dependency graph being resolved
+struct deps_walk {
+    struct ld_cache cache;
+    struct deps_loaded *loaded;
+    size_t loaded_count, loaded_capacity;
+    bool failed;
+};
+
+static int deps_loaded_callback (struct dl_phdr_info *info, size_t size, void *data)
+{
+    struct deps_walk *walk = (struct deps_walk*)data;
+    (void)size;
+    // the main program and the vDSO have no file name to match
+    if (info->dlpi_name == NULL || !strchr(info->dlpi_name, '/'))
+        return 0;
+    if (walk->loaded_count == walk->loaded_capacity)
+    {
+        size_t capacity = walk->loaded_capacity ? walk->loaded_capacity * 2 : 32;
+        struct deps_loaded *loaded = (struct deps_loaded*)mem_realloc(walk->loaded,
+            walk->loaded_capacity * sizeof(*loaded), capacity * sizeof(*loaded));
+        if (loaded == NULL)
+        {
+            walk->failed = true;
+            return 1;
+        }
+        walk->loaded = loaded;
+        walk->loaded_capacity = capacity;
+    }
+    struct deps_loaded *obj = &walk->loaded[walk->loaded_count];
+    if ((obj->path = copy_string(info->dlpi_name)) == NULL)
+    {
+        walk->failed = true;
+        return 1;
+    }
+    obj->base = strrchr(obj->path, '/') + 1;
+    obj->has_file_id = platform_file_id(obj->path, &obj->dev, &obj->ino);
+    ++walk->loaded_count;
+    return 0;
+}
+
+static bool deps_walk_init (struct deps_walk *walk)
+{
+    memset(walk, 0, sizeof(*walk));
+    ld_cache_open(&walk->cache);
+    dl_iterate_phdr(deps_loaded_callback, walk);
+    return !walk->failed;
+}
+
+static void deps_walk_free (struct deps_walk *walk)
+{
+    size_t i;
+    for (i = 0; i < walk->loaded_count; ++i)
+        mem_free(walk->loaded[i].path);
+    mem_free(walk->loaded);
+    ld_cache_close(&walk->cache);
+}
+
+// returns the loaded object named name (the loader compares needed names
+// with the names of loaded objects before searching), or NULL
+static const struct deps_loaded *deps_find_loaded (const struct deps_walk *walk, const char *name)
+{
+    size_t i;
+    const char *base = strrchr(name, '/');
+    for (i = 0; i < walk->loaded_count; ++i)
+    {
+        if (base ? !strcmp(walk->loaded[i].path, name) : !strcmp(walk->loaded[i].base, name))
+            return &walk->loaded[i];
+    }
+    return NULL;
+}
+
+// the directory of the object at index, for $ORIGIN
+static bool deps_origin (dylib_deps deps, size_t index, char *buf)
+{
+    const char *path = deps->nodes[index].info.path;
+    if (path == NULL || !platform_canonical_path(path, buf))
+        return false;
+    char *slash = strrchr(buf, '/');
+    if (slash == NULL)
+        return false;
+    if (slash == buf)
+        ++slash;
+    *slash = 0;
+    return true;
+}
+
+// copies dir (len bytes) into buf, replacing $ORIGIN and ${ORIGIN} by origin
+static bool deps_expand_dir (const char *dir, size_t len, const char *origin, char *buf)
+{
+    size_t in = 0, out = 0;
+    while (in < len)
+    {
+        size_t skip = 0;
+        if (len - in >= 7 && !memcmp(dir + in, "$ORIGIN", 7))
+            skip = 7;
+        else if (len - in >= 9 && !memcmp(dir + in, "${ORIGIN}", 9))
+            skip = 9;
+        if (skip)
+        {
+            if (origin == NULL || out + strlen(origin) >= PATH_BUF_SIZE)
+                return false;
+            memcpy(buf + out, origin, strlen(origin));
+            out += strlen(origin);
+            in += skip;
+        }
+        else
+        {
+            if (out + 1 >= PATH_BUF_SIZE)
+                return false;
+            buf[out++] = dir[in++];
+        }
+    }
+    // an empty entry is the current directory
+    if (out == 0)
+        buf[out++] = '.';
+    buf[out] = 0;
+    return true;
+}
+
+// searches a list of directories separated by ':' or ';' for name
+static bool deps_search_dirs (const char *dirs, const char *origin, const char *name, char *buf)
+{
+    char dir[PATH_BUF_SIZE];
+    while (dirs)
+    {
+        const char *end = strpbrk(dirs, ":;");
+        size_t len = end ? (size_t)(end - dirs) : strlen(dirs);
+        if (deps_expand_dir(dirs, len, origin, dir) &&
+            format_candidate(buf, PATH_BUF_SIZE, dir, "%s", name) && elf_file_probe(buf))
+            return true;
+        dirs = end ? end + 1 : NULL;
+    }
+    return false;
+}
+
+// copies the value of LD_LIBRARY_PATH in the initial environment of the
+// process, or returns NULL if it can't be read
+static char *deps_initial_library_path()
+{
+#if defined(LIBDYLIB_LINUX)
+    static const char var[] = "LD_LIBRARY_PATH=";
+    int fd = open("/proc/self/environ", O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+    char *env = NULL, *ret = NULL;
+    size_t len = 0, capacity = 0;
+    ssize_t n = 1;
+    while (n > 0)
+    {
+        if (len + 1 >= capacity)
+        {
+            size_t grown = capacity ? capacity * 2 : 4096;
+            char *buf = (char*)mem_realloc(env, capacity, grown);
+            if (buf == NULL)
+                break;
+            env = buf;
+            capacity = grown;
+        }
+        n = read(fd, env + len, capacity - len - 1);
+        if (n > 0)
+            len += (size_t)n;
+    }
+    close(fd);
+    if (n == 0)
+    {
+        const char *p = env;
+        env[len] = 0;
+        for (; p < env + len; p += strlen(p) + 1)
+        {
+            if (!strncmp(p, var, sizeof(var) - 1))
+                break;
+        }
+        ret = copy_string(p < env + len ? p + sizeof(var) - 1 : "");
+    }
+    mem_free(env);
+    return ret;
+#else
+    return NULL;
+#endif
+}
+
+// LD_LIBRARY_PATH as the loader saw it, or NULL if it is unset or empty - the
+// loader only reads it at startup, so changes to the environment made by the
+// process afterwards are ignored too
+static const char *deps_library_path()
+{
+    static mutex_t lock = MUTEX_INIT;
+    static char *value; // read with atomic_load_ptr(), never freed
+    const char *ret = (const char*)atomic_load_ptr(&value);
+    if (ret == NULL)
+    {
+        mutex_lock(&lock);
+        if (value == NULL)
+        {
+            char *initial = deps_initial_library_path();
+            if (initial == NULL && getenv("LD_LIBRARY_PATH"))
+                initial = copy_string(getenv("LD_LIBRARY_PATH"));
+            else if (initial == NULL)
+                initial = copy_string("");
+            if (initial)
+                atomic_store_ptr(&value, initial);
+        }
+        ret = value;
+        mutex_unlock(&lock);
+        if (ret == NULL)
+            ret = getenv("LD_LIBRARY_PATH");
+    }
+    return ret && *ret ? ret : NULL;
+}
+
+static const char *const deps_default_dirs[] = {"/lib64", "/usr/lib64", "/lib", "/usr/lib"};
+
+// finds the file the loader would load for name, needed by the object at
+// parent (or DEPS_NONE), and copies its path into buf
+static bool deps_search (dylib_deps deps, const struct deps_walk *walk, size_t parent, const char *name, char *buf)
+{
+    char origin[PATH_BUF_SIZE];
+    size_t i;
+    if (strchr(name, '/'))
+    {
+        if (strlen(name) >= PATH_BUF_SIZE)
+            return false;
+        strcpy(buf, name);
+        return platform_is_file(buf);
+    }
+    if (parent != DEPS_NONE && !deps->nodes[parent].runpath)
+    {
+        for (i = parent; i != DEPS_NONE; i = deps->nodes[i].info.parent)
+        {
+            if (deps->nodes[i].rpath && deps_search_dirs(deps->nodes[i].rpath,
+                    deps_origin(deps, i, origin) ? origin : NULL, name, buf))
+                return true;
+        }
+    }
+    if (deps_library_path() && deps_search_dirs(deps_library_path(), NULL, name, buf))
+        return true;
+    if (parent != DEPS_NONE && deps->nodes[parent].runpath && deps_search_dirs(deps->nodes[parent].runpath,
+            deps_origin(deps, parent, origin) ? origin : NULL, name, buf))
+        return true;
+    if (ld_cache_find(&walk->cache, name, buf))
+        return true;
+    for (i = 0; i < sizeof(deps_default_dirs) / sizeof(deps_default_dirs[0]); ++i)
+    {
+        if (format_candidate(buf, PATH_BUF_SIZE, deps_default_dirs[i], "%s", name) && elf_file_probe(buf))
+            return true;
+    }
+    return false;
+}
+
+// adds a node for name unless the graph already has it - returns false if
+// out of memory
+static bool deps_add (dylib_deps deps, const struct deps_walk *walk, size_t parent, const char *name)
+{
+    char path[PATH_BUF_SIZE];
+    struct deps_node node;
+    struct stat st;
+    size_t i;
+    for (i = 0; i < deps->count; ++i)
+    {
+        if (!strcmp(deps->nodes[i].info.name, name))
+            return true;
+    }
+    if (deps->count == deps->capacity)
+    {
+        size_t capacity = deps->capacity ? deps->capacity * 2 : 16;
+        struct deps_node *nodes = (struct deps_node*)mem_realloc(deps->nodes,
+            deps->capacity * sizeof(*nodes), capacity * sizeof(*nodes));
+        if (nodes == NULL)
+            return false;
+        deps->nodes = nodes;
+        deps->capacity = capacity;
+    }
+    memset(&node, 0, sizeof(node));
+    node.info.parent = parent;
+    node.info.depth = parent == DEPS_NONE ? 0 : deps->nodes[parent].info.depth + 1;
+    const struct deps_loaded *loaded = deps_find_loaded(walk, name);
+    bool found = loaded ? strlen(loaded->path) < sizeof(path) : deps_search(deps, walk, parent, name, path);
+    if (loaded && found)
+        strcpy(path, loaded->path);
+    if (found && stat(path, &st) == 0)
+    {
+        node.info.size = (uint64_t)st.st_size;
+        node.dev = (uint64_t)st.st_dev;
+        node.ino = (uint64_t)st.st_ino;
+        node.has_file_id = true;
+        // the same file under another name is the same object
+        for (i = 0; i < deps->count; ++i)
+        {
+            if (deps->nodes[i].has_file_id && deps->nodes[i].dev == node.dev && deps->nodes[i].ino == node.ino)
+                return true;
+        }
+        for (i = 0; i < walk->loaded_count && !loaded; ++i)
+        {
+            if (walk->loaded[i].has_file_id && walk->loaded[i].dev == node.dev && walk->loaded[i].ino == node.ino)
+                loaded = &walk->loaded[i];
+        }
+    }
+    node.info.loaded = loaded != NULL;
+    node.info.name = copy_string(name);
+    node.info.path = found ? copy_string(path) : NULL;
+    if (node.info.name == NULL || (found && node.info.path == NULL))
+    {
+        mem_free((void*)node.info.name);
+        mem_free((void*)node.info.path);
+        return false;
+    }
+    deps->nodes[deps->count++] = node;
+    return true;
+}
+
+// reads the dynamic section of the object at index, and adds its dependencies
+static bool deps_expand (dylib_deps deps, const struct deps_walk *walk, size_t index)
+{
+    struct elf_file f;
+    struct elf_file_dynamic dyn;
+    struct error_state err = last_err;
+    int64_t tag;
+    uint64_t val, i;
+    bool ok = true;
+    const char *str;
+    // unreadable or unusual files are left as leaves of the graph
+    if (!elf_file_map(&f, deps->nodes[index].info.path))
+    {
+        last_err = err;
+        return true;
+    }
+    if (elf_file_dynamic_init(&f, &dyn))
+    {
+        for (i = 0; elf_file_dyn(&f, &dyn, i, &tag, &val) && ok; ++i)
+        {
+            char **dest = tag == DT_RPATH ? &deps->nodes[index].rpath : tag == DT_RUNPATH ? &deps->nodes[index].runpath : NULL;
+            if (dest && !*dest && (str = elf_file_dyn_string(&dyn, val)))
+                ok = (*dest = copy_string(str)) != NULL;
+        }
+        for (i = 0; elf_file_dyn(&f, &dyn, i, &tag, &val) && ok; ++i)
+        {
+            if (tag == DT_NEEDED && (str = elf_file_dyn_string(&dyn, val)))
+                ok = deps_add(deps, walk, index, str);
+        }
+    }
+    elf_file_unmap(&f);
+    return ok;
+}
+#endif
+
+LIBDYLIB_DEFINE(dylib_deps, deps_resolve)(const char *path)
+{
+    check_null_path(path, NULL);
+#ifdef LIBDYLIB_ELF
+    dylib_deps deps = (dylib_deps)mem_calloc(1, sizeof(*deps));
+    struct deps_walk walk;
+    size_t i, level = 0, level_end;
+    bool ok = deps_walk_init(&walk) && deps != NULL && deps_add(deps, &walk, DEPS_NONE, path);
+    if (ok && !deps->nodes[0].info.path)
+    {
+        set_error_detail(LIBDYLIB_E_OPEN_FAILED, "Library not found", path);
+        deps_walk_free(&walk);
+        LIBDYLIB_NAME(deps_free)(deps);
+        return NULL;
+    }
+    while (ok && level < deps->count)
+    {
+        level_end = deps->count;
+        // start reading the whole level before parsing any of it
+        for (i = level; i < level_end; ++i)
+        {
+            if (deps->nodes[i].info.path && !deps->nodes[i].info.loaded)
+                platform_prefetch(deps->nodes[i].info.path);
+        }
+        for (i = level; i < level_end && ok; ++i)
+        {
+            // the dependencies of loaded objects are loaded too, except
+            // for the root, whose graph was asked for
+            if (deps->nodes[i].info.path && (!deps->nodes[i].info.loaded || i == 0))
+                ok = deps_expand(deps, &walk, i);
+        }
+        level = level_end;
+    }
+    deps_walk_free(&walk);
+    if (!ok)
+    {
+        set_error(LIBDYLIB_E_NO_MEMORY, "Out of memory");
+        LIBDYLIB_NAME(deps_free)(deps);
+        return NULL;
+    }
+    return deps;
+#else
+    set_error(LIBDYLIB_E_UNSUPPORTED, "Dependency graphs are only supported on ELF platforms");
+    return NULL;
+#endif
+}
+
+LIBDYLIB_DEFINE(size_t, deps_count)(dylib_deps deps)
+{
+    check_null_arg(deps, "NULL dependency graph", 0);
+    return deps->count;
+}
+
+LIBDYLIB_DEFINE(const dylib_dependency*, deps_get)(dylib_deps deps, size_t index)
+{
+    check_null_arg(deps, "NULL dependency graph", NULL);
+    if (index >= deps->count)
+    {
+        set_error(LIBDYLIB_E_NOT_FOUND, "Dependency index out of range");
+        return NULL;
+    }
+    return &deps->nodes[index].info;
+}
+
+LIBDYLIB_DEFINE(size_t, deps_prefetch)(dylib_deps deps)
+{
+    check_null_arg(deps, "NULL dependency graph", 0);
+    size_t i, count = 0;
+    for (i = 0; i < deps->count; ++i)
+    {
+        if (deps->nodes[i].info.path && !deps->nodes[i].info.loaded)
+        {
+            platform_prefetch(deps->nodes[i].info.path);
+            ++count;
+        }
+    }
+    return count;
+}
+
+LIBDYLIB_DEFINE(size_t, deps_report)(dylib_deps deps, char *buf, size_t size)
+{
+    check_null_arg(deps, "NULL dependency graph", 0);
+    size_t i, len = 0, files = 0;
+    uint64_t bytes = 0;
+    char empty[1];
+    if (buf == NULL || size == 0)
+    {
+        buf = empty;
+        size = 1;
+    }
+    for (i = 0; i < deps->count; ++i)
+    {
+        const dylib_dependency *dep = &deps->nodes[i].info;
+        int n = snprintf(len < size ? buf + len : NULL, len < size ? size - len : 0, "%*s%s => %s (%lu bytes)%s\n",
+            (int)dep->depth * 2, "", dep->name, dep->path ? dep->path : "not found",
+            (unsigned long)dep->size, dep->loaded ? " [already loaded]" : "");
+        len += n > 0 ? (size_t)n : 0;
+        if (dep->path && !dep->loaded)
+        {
+            ++files;
+            bytes += dep->size;
+        }
+    }
+    int n = snprintf(len < size ? buf + len : NULL, len < size ? size - len : 0,
+        "%lu objects, %lu files to read, %lu bytes\n", (unsigned long)deps->count, (unsigned long)files, (unsigned long)bytes);
+    len += n > 0 ? (size_t)n : 0;
+    return len;
+}
+
+LIBDYLIB_DEFINE(void, deps_free)(dylib_deps deps)
+{
+    if (deps == NULL)
+        return;
+    deps_free_nodes(deps);
+    mem_free(deps);
+}
+
+// LIBDYLIB_OPEN_PREFETCH: resolving the graph reads everything ahead
+static void prefetch_dependencies (const char *path)
+{
+    struct error_state err = last_err;
+    LIBDYLIB_NAME(deps_free)(LIBDYLIB_NAME(deps_resolve)(path));
+    last_err = err;
+}
+
+LIBDYLIB_DEFINE(dylib_symbols_ref, symbols_open)(const char *path)
+{
+    check_null_path(path, NULL);
+#ifdef LIBDYLIB_ELF
+    struct dylib_symbols_data it;
+    memset(&it, 0, sizeof(it));
+    if (!elf_file_map(&it.file, path))
+        return NULL;
+    if (!elf_symbols_init(&it))
+    {
+        set_error_detail(LIBDYLIB_E_BAD_FORMAT, "No dynamic symbol table", path);
+        elf_file_unmap(&it.file);
+        return NULL;
+    }
+    dylib_symbols_ref ref = (dylib_symbols_ref)mem_alloc(sizeof(*ref));
+    if (ref == NULL)
+    {
+        set_error(LIBDYLIB_E_NO_MEMORY, "Out of memory");
+        elf_file_unmap(&it.file);
+        return NULL;
+    }
+    *ref = it;
+    return ref;
+#else
+    set_error(LIBDYLIB_E_UNSUPPORTED, "Symbol enumeration is not supported on this platform");
+    return NULL;
+#endif
+}
+
+LIBDYLIB_DEFINE(bool, symbols_next)(dylib_symbols_ref iter, dylib_symbol_info *info)
+{
+    check_null_arg(iter, "NULL symbol iterator", 0);
+    check_null_arg(info, "NULL symbol info", 0);
+#ifdef LIBDYLIB_ELF
+    return elf_symbols_next(iter, info);
+#else
+    return false;
+#endif
+}
+
+LIBDYLIB_DEFINE(void, symbols_rewind)(dylib_symbols_ref iter)
+{
+    if (iter)
+        iter->next = 0;
+}
+
+LIBDYLIB_DEFINE(void, symbols_close)(dylib_symbols_ref iter)
+{
+    if (iter == NULL)
+        return;
+#ifdef LIBDYLIB_ELF
+    elf_file_unmap(&iter->file);
+#endif
+    mem_free(iter);
+}
+
+LIBDYLIB_DEFINE(void, set_allocator)(dylib_alloc_func alloc, dylib_free_func free_func, void *ctx)
+{
+    if (alloc == NULL || free_func == NULL)
+    {
+        alloc = default_alloc;
+        free_func = default_free;
+        ctx = NULL;
+    }
+    allocator.alloc = alloc;
+    allocator.free = free_func;
+    allocator.ctx = ctx;
+}
+
+LIBDYLIB_DEFINE(const char*, last_error)()
+{
+    if (last_err.code == LIBDYLIB_E_NONE)
+        return NULL;
+    if (last_err.formatted)
+        return last_err.buf;
+    if (!last_err.detail[0])
+        return last_err.msg;
+    snprintf(last_err.buf, ERR_MAX_SIZE, "%s: %s", last_err.msg, last_err.detail);
+    last_err.formatted = true;
+    return last_err.buf;
+}
+
+LIBDYLIB_DEFINE(dylib_error, last_error_code)()
+{
+    return last_err.code;
 }
 
 LIBDYLIB_DEFINE(int, get_version)()
@@ -6,6 +6,8 @@
 
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 #if !defined(LIBDYLIB_UNIX) && (defined(__APPLE__) || defined(__linux__) || defined(__UNIX__))
     #define LIBDYLIB_UNIX
@@ -59,33 +61,178 @@
 namespace libdylib {
 #endif
 
+    // Threads: every function can be called from any thread, and errors are
+    // kept per thread. Lookups in an open library don't take locks (except to
+    // add a miss to its symbol cache) and never wait for other threads, so
+    // they scale with the number of threads looking up symbols. Reference
+    // counts are atomic: retain() and close() only take a lock shared by all
+    // handles when the last reference is released, and opens only while they
+    // update the list of open libraries - neither while the platform loads or
+    // unloads one. A close() that releases the last reference never waits:
+    // if lookups of other threads in the library are still running, the last
+    // of them to finish unloads it.
+    // Handles are not pointers: functions given the handle of a library that
+    // was closed fail with LIBDYLIB_E_INVALID_HANDLE, even if other libraries
+    // were opened since.
     typedef struct dylib_data* dylib_ref;
     LIBDYLIB_DECLARE(const void*, get_handle)(dylib_ref lib);
     LIBDYLIB_DECLARE(const char*, get_path)(dylib_ref lib);
 
     // attempt to load a dynamic library from a path
     // return a library handle or NULL
+    // opening a library that is already open returns the same handle, with
+    // its reference count incremented - close() must be called once per open()
     LIBDYLIB_DECLARE(dylib_ref, open)(const char *path);
 
+    // flags for open_ex() and related functions, combined with bitwise OR
+    // resolve function references when they are first called, instead of
+    // when the library is loaded - ignored on Windows
+    #define LIBDYLIB_OPEN_LAZY 0x1
+    // make the library's symbols available to libraries loaded later - ignored
+    // on Windows
+    #define LIBDYLIB_OPEN_GLOBAL 0x2
+    // only succeed if the library is already loaded, without loading it
+    #define LIBDYLIB_OPEN_NOLOAD 0x4
+    // never unload the library, even after it is closed
+    #define LIBDYLIB_OPEN_NODELETE 0x8
+    // cache symbol lookups (including failed lookups) per library handle
+    #define LIBDYLIB_OPEN_CACHE 0x100
+    // resolve symbols directly from the library's ELF hash tables instead of
+    // through the platform (dlsym), falling back to the platform for symbols
+    // that need the dynamic linker - ignored on non-ELF platforms
+    #define LIBDYLIB_OPEN_ELF_LOOKUP 0x200
+    // read the library's dependency graph (see deps_resolve()) ahead of the
+    // loader, so that the files it needs are read in parallel instead of one
+    // at a time - ignored on non-ELF platforms
+    #define LIBDYLIB_OPEN_PREFETCH 0x400
+    // keep the offsets of symbols bound by bind_table() in a file, and bind
+    // through it in later processes instead of looking the symbols up (see
+    // set_persist_dir()) - ignored on non-ELF platforms
+    #define LIBDYLIB_OPEN_PERSIST 0x800
+
+    // same as open(), with additional LIBDYLIB_OPEN_* flags
+    LIBDYLIB_DECLARE(dylib_ref, open_ex)(const char *path, int flags);
+
+    // load a library from an image in memory, without writing it to disk
+    // (Linux only) - name is used for diagnostics, and the image is copied,
+    // so buf can be freed once this returns
+    // handles work like those returned by open(), but are only shared by
+    // opens of their /proc/self/fd path (see get_path())
+    LIBDYLIB_DECLARE(dylib_ref, open_memory)(const void *buf, size_t len, const char *name);
+    LIBDYLIB_DECLARE(dylib_ref, open_memory_ex)(const void *buf, size_t len, const char *name, int flags);
+
+    // link-map namespaces (glibc only): a library loaded into a namespace
+    // other than the program's gets its own copy, along with every dependency
+    // (including the C library) that isn't loaded in that namespace yet, so
+    // its global state and symbol bindings are separate from other copies
+    // Memory and other resources must not be passed between copies of the C
+    // library, and glibc supports at most 15 namespaces besides the program's.
+    typedef long dylib_namespace;
+    // the program's namespace, which open() loads libraries into
+    #define LIBDYLIB_NAMESPACE_BASE 0L
+    // a new namespace, for open_namespace()
+    #define LIBDYLIB_NAMESPACE_NEW (-1L)
+    // open a library in namespace ns (as returned by get_namespace()), or in
+    // a new namespace - handles outside the program's namespace are only
+    // shared by opens of the same path in the same namespace
+    // LIBDYLIB_OPEN_GLOBAL makes symbols available to that namespace only
+    LIBDYLIB_DECLARE(dylib_ref, open_namespace)(const char *path, dylib_namespace ns, int flags);
+    // the namespace lib was loaded in, or LIBDYLIB_NAMESPACE_NEW on error
+    LIBDYLIB_DECLARE(dylib_namespace, get_namespace)(dylib_ref lib);
+
+    // n independent copies of a library, each in a namespace of its own (see
+    // open_namespace()), e.g. one per group of worker threads so that they
+    // don't share the library's global state or locks
+    typedef struct dylib_instance_pool_data* dylib_instance_pool;
+    // returns NULL unless all n copies were loaded
+    LIBDYLIB_DECLARE(dylib_instance_pool, instance_pool_open)(const char *path, size_t n, int flags);
+    LIBDYLIB_DECLARE(size_t, instance_pool_size)(dylib_instance_pool pool);
+    // copy index, which must not be closed - NULL if index is out of range
+    LIBDYLIB_DECLARE(dylib_ref, instance_pool_get)(dylib_instance_pool pool, size_t index);
+    // the next copy in turn, for handing copies out to threads as they start
+    LIBDYLIB_DECLARE(dylib_ref, instance_pool_next)(dylib_instance_pool pool);
+    // closes every copy (see close_many())
+    LIBDYLIB_DECLARE(bool, instance_pool_free)(dylib_instance_pool pool);
+
     // return a handle to the current executable
+    // this is always the same handle, which close() leaves open
     LIBDYLIB_DECLARE(dylib_ref, open_self)();
 
-    // close the specified dynamic library
+    // add a reference to an open library, which must be released by close()
+    // returns lib, or NULL if lib is not open
+    LIBDYLIB_DECLARE(dylib_ref, retain)(dylib_ref lib);
+
+    // close the specified dynamic library, or drop a reference to it if it was
+    // opened more than once
+    // inside a reader section, the library is unloaded when the section ends
     // returns 1 on success, 0 on failure
     LIBDYLIB_DECLARE(bool, close)(dylib_ref lib);
 
+    // close several libraries at once (e.g. at shutdown), dropping one
+    // reference per element - NULL elements are skipped
+    // libraries are unloaded in reverse order of loading, and always before
+    // the libraries they depend on (on ELF platforms)
+    // returns 1 if all were closed, or 0 with a single error for all failures
+    LIBDYLIB_DECLARE(bool, close_many)(const dylib_ref *libs, size_t n);
+    // flags for close_many_ex()
+    // only release libdylib's handles, leaving the libraries loaded (and their
+    // finalizers to process exit)
+    #define LIBDYLIB_CLOSE_FAST_EXIT 0x1
+    LIBDYLIB_DECLARE(bool, close_many_ex)(const dylib_ref *libs, size_t n, int flags);
+
     // attempt to load a dynamic library from all paths given
     // return a library handle of the first successfully-loaded library, or NULL if none were successfully loaded
     // NOTE: the last argument must be NULL
     LIBDYLIB_DECLARE(dylib_ref, open_list)(const char *path, ...);
     LIBDYLIB_DECLARE(dylib_ref, va_open_list)(const char *path, va_list args);
+    LIBDYLIB_DECLARE(dylib_ref, open_list_ex)(int flags, const char *path, ...);
+    LIBDYLIB_DECLARE(dylib_ref, va_open_list_ex)(int flags, const char *path, va_list args);
 
     // attempt to load a dynamic library using platform-specific prefixes/suffixes
     // e.g. open_locate("foo") would attempt to open libfoo.so and foo.so on Linux
     LIBDYLIB_DECLARE(dylib_ref, open_locate)(const char *name);
+    LIBDYLIB_DECLARE(dylib_ref, open_locate_ex)(const char *name, int flags);
+
+    // a list of directories and name patterns to search for libraries in
+    // candidates that don't exist, aren't libraries for this platform or fail
+    // to load are remembered and skipped by later searches until invalidated
+    // (LIBDYLIB_OPEN_NOLOAD opens don't remember candidates that aren't loaded)
+    typedef struct dylib_search_path_data* dylib_search_path;
+    // create an empty search path, using the same patterns as open_locate()
+    LIBDYLIB_DECLARE(dylib_search_path, search_path_create)();
+    // append a directory - with no directories, candidates are passed to the
+    // platform's own library search
+    LIBDYLIB_DECLARE(bool, search_path_add_dir)(dylib_search_path sp, const char *dir);
+    // replace the name patterns, where "%s" is replaced by the library name and
+    // "%%" by a single "%" - n = 0 restores the default patterns
+    LIBDYLIB_DECLARE(bool, search_path_set_patterns)(dylib_search_path sp, const char *const *patterns, size_t n);
+    // forget all failed candidates, e.g. after installing a library
+    LIBDYLIB_DECLARE(void, search_path_invalidate)(dylib_search_path sp);
+    LIBDYLIB_DECLARE(void, search_path_free)(dylib_search_path sp);
+    // open the first candidate (each directory with each pattern, in order)
+    // that loads, falling back to name itself as in open_locate()
+    // on failure, the error is the loader's for the last candidate it failed
+    // to load (preferring files found in the directories), or "not found"
+    LIBDYLIB_DECLARE(dylib_ref, open_search)(dylib_search_path sp, const char *name, int flags);
 
     // return the address of a symbol in a library, or NULL if the symbol does not exist
     LIBDYLIB_DECLARE(void*, lookup)(dylib_ref lib, const char *symbol);
+    // same as lookup(), with the symbol's hash computed in advance by
+    // hash_symbol() (or 0 to compute it) - the hash is only used by handles
+    // with LIBDYLIB_OPEN_CACHE or LIBDYLIB_OPEN_ELF_LOOKUP
+    LIBDYLIB_DECLARE(void*, lookup_hash)(dylib_ref lib, const char *symbol, uint32_t hash);
+    // the GNU hash of a symbol name: h = h * 33 + c for each byte, from h = 5381
+    LIBDYLIB_DECLARE(uint32_t, hash_symbol)(const char *symbol);
+    // return the address of a specific version of a symbol (glibc only), or of
+    // the default version if version is NULL
+    LIBDYLIB_DECLARE(void*, lookup_versioned)(dylib_ref lib, const char *symbol, const char *version);
+    // return the address of the first symbol found out of a NULL-terminated
+    // list of up to 32 candidates, each of which may be "symbol@version"
+    // The result for each list is remembered per handle, so later calls with
+    // the same list only look up the candidate that was found (or nothing, if
+    // none was).
+    LIBDYLIB_DECLARE(void*, lookup_first)(dylib_ref lib, ...);
+    LIBDYLIB_DECLARE(void*, va_lookup_first)(dylib_ref lib, va_list args);
 
     // set the contents of dest to the result of lookup(lib, symbol) and returns 1,
     // or set dest to NULL and returns 0 if the symbol was not found
@@ -94,6 +241,185 @@ namespace libdylib {
     #define LIBDYLIB_BIND(lib, symbol, dest) LIBDYLIB_NAME(bind)(lib, symbol, (void**)&dest)
     #define LIBDYLIB_BINDNAME(lib, name) LIBDYLIB_BIND(lib, #name, name)
 
+    // an entry for bind_table(): the symbol name, where to store its address
+    // (may be NULL to only check for existence), and whether it may be missing
+    typedef struct dylib_bind_entry {
+        const char *name;
+        void **dest;
+        bool optional;
+    } dylib_bind_entry;
+    // helper macros for table entries - dest is a simple pointer, as in LIBDYLIB_BIND
+    #define LIBDYLIB_BIND_ENTRY(symbol, dest) {symbol, (void**)&dest, false}
+    #define LIBDYLIB_BIND_ENTRY_OPTIONAL(symbol, dest) {symbol, (void**)&dest, true}
+    #define LIBDYLIB_BIND_ENTRY_NAME(name) LIBDYLIB_BIND_ENTRY(#name, name)
+
+    // resolve all n entries of table in one pass, setting the destination of
+    // each missing symbol to NULL
+    // returns 1 if all required symbols were found, or 0 with a single error
+    // listing every missing required symbol
+    LIBDYLIB_DECLARE(bool, bind_table)(dylib_ref lib, const dylib_bind_entry *table, size_t n);
+
+    // set the directory, which must exist, for the files of libraries opened
+    // with LIBDYLIB_OPEN_PERSIST (NULL, the default, disables them)
+    // There is one file per library build, named after its build ID (or its
+    // path, if it has none), which is rewritten when it is stale or does not
+    // have every symbol of a table.
+    LIBDYLIB_DECLARE(bool, set_persist_dir)(const char *dir);
+
+    // lazy calls: a function pointer that starts out pointing to a stub, which
+    // looks the function up on its first call and replaces itself with it, so
+    // that only the functions actually called are looked up, and later calls
+    // cost one load and one indirect call - concurrent first calls are safe
+    // LIBDYLIB_LAZY() defines a static function named after its symbol, which
+    // calls through the pointer:
+    //     LIBDYLIB_LAZY(plugin, int, render, (float *buf, size_t n), (buf, n))
+    //     render(buf, n);
+    // lib is evaluated on each first call, so it can be opened later
+    // the pointer is read with an acquire load on GCC and Clang (a call
+    // through an _Atomic pointer is a plain load), and is volatile elsewhere
+    #if defined(__GNUC__)
+        #define LIBDYLIB_LAZY_QUALIFIER
+        #define LIBDYLIB_LAZY_LOAD(slot) __atomic_load_n(&(slot), __ATOMIC_ACQUIRE)
+    #else
+        #define LIBDYLIB_LAZY_QUALIFIER volatile
+        #define LIBDYLIB_LAZY_LOAD(slot) (slot)
+    #endif
+    #if defined(__cplusplus)
+        #define LIBDYLIB_LAZY_INLINE static inline
+    #elif defined(__GNUC__)
+        #define LIBDYLIB_LAZY_INLINE static __inline__
+    #elif defined(_MSC_VER)
+        #define LIBDYLIB_LAZY_INLINE static __inline
+    #else
+        #define LIBDYLIB_LAZY_INLINE static
+    #endif
+    #define LIBDYLIB_LAZY(lib, ret, name, params, args) \
+        static ret libdylib_lazy_##name params; \
+        static ret (*LIBDYLIB_LAZY_QUALIFIER libdylib_lazy_ptr_##name) params = libdylib_lazy_##name; \
+        LIBDYLIB_LAZY_INLINE ret name params { \
+            return LIBDYLIB_LAZY_LOAD(libdylib_lazy_ptr_##name) args; \
+        } \
+        static ret libdylib_lazy_##name params { \
+            return ((ret (*) params)LIBDYLIB_NAME(lazy_resolve)(lib, #name, 0, (void**)&libdylib_lazy_ptr_##name)) args; \
+        }
+    #define LIBDYLIB_LAZY_VOID(lib, name, params, args) \
+        static void libdylib_lazy_##name params; \
+        static void (*LIBDYLIB_LAZY_QUALIFIER libdylib_lazy_ptr_##name) params = libdylib_lazy_##name; \
+        LIBDYLIB_LAZY_INLINE void name params { \
+            LIBDYLIB_LAZY_LOAD(libdylib_lazy_ptr_##name) args; \
+        } \
+        static void libdylib_lazy_##name params { \
+            ((void (*) params)LIBDYLIB_NAME(lazy_resolve)(lib, #name, 0, (void**)&libdylib_lazy_ptr_##name)) args; \
+        }
+    // the address name currently calls: its stub until the first call
+    #define LIBDYLIB_LAZY_TARGET(name) ((void*)LIBDYLIB_LAZY_LOAD(libdylib_lazy_ptr_##name))
+    // point name back to its stub (e.g. after its library is reopened), while
+    // no other thread can call it
+    #define LIBDYLIB_LAZY_RESET(name) ((void)(libdylib_lazy_ptr_##name = libdylib_lazy_##name))
+    // look symbol up for a stub, store it in *slot and return it - on failure,
+    // the handler set by set_lazy_fail_handler() is called, and the process is
+    // aborted if it returns (it can throw, in C++, or longjmp instead)
+    LIBDYLIB_DECLARE(void*, lazy_resolve)(dylib_ref lib, const char *symbol, uint32_t hash, void **slot);
+    typedef void (*dylib_lazy_fail_func)(dylib_ref lib, const char *symbol);
+    LIBDYLIB_DECLARE(void, set_lazy_fail_handler)(dylib_lazy_fail_func func);
+
+    // open libraries in the background, on a small pool of worker threads
+    // a task must be freed with open_task_free()
+    typedef struct dylib_open_task_data* dylib_open_task;
+    // same as open_ex(), in the background
+    LIBDYLIB_DECLARE(dylib_open_task, open_async)(const char *path, int flags);
+    // same as open_ex() followed by bind_table(), in the background - the
+    // library is closed if a required symbol is missing
+    // NOTE: table must remain valid until the task completes
+    LIBDYLIB_DECLARE(dylib_open_task, open_async_bind)(const char *path, int flags, const dylib_bind_entry *table, size_t n);
+    // returns 1 if the task has completed
+    LIBDYLIB_DECLARE(bool, open_task_poll)(dylib_open_task task);
+    // wait for the task to complete and return the library handle (owned by
+    // the caller) or NULL, setting the error state as the open would have
+    LIBDYLIB_DECLARE(dylib_ref, open_task_wait)(dylib_open_task task);
+    // wait for the task to complete and free it - the library is closed if it
+    // was never returned by open_task_wait()
+    LIBDYLIB_DECLARE(void, open_task_free)(dylib_open_task task);
+    // open n libraries in parallel, after asking the system to read them ahead
+    // libs[i] is set to the handle for paths[i], or NULL if it failed to load
+    // returns the number of libraries loaded
+    LIBDYLIB_DECLARE(size_t, preload)(const char *const *paths, size_t n, int flags, dylib_ref *libs);
+
+    // reader sections, which may be nested: versions of reloadable libraries
+    // (and the addresses bound from them) that were current at any point
+    // during a section stay loaded until the section ends
+    // NOTE: sections must be short, and must not call reloadable_free()
+    LIBDYLIB_DECLARE(void, reader_enter)();
+    LIBDYLIB_DECLARE(void, reader_exit)();
+
+    // libraries that are reloaded when their file is replaced (Unix only)
+    // Each new version is loaded next to the current one and table is bound
+    // to it. If every required symbol is found, the version is published: the
+    // dest pointers in table are updated one by one, and reloadable_symbols()
+    // switches to the new addresses all at once. The previous version is
+    // unloaded once all reader sections that were active have ended.
+    // Files should be replaced by renaming a new file over them - files that
+    // are modified in place can't be reloaded.
+    // NOTE: table must remain valid until the library is freed
+    typedef struct dylib_reloadable_data* dylib_reloadable;
+    LIBDYLIB_DECLARE(dylib_reloadable, reloadable_open)(const char *path, int flags, const dylib_bind_entry *table, size_t n);
+    // reload if the file has changed - returns 1 if a new version was
+    // published, 0 if nothing changed, and -1 if the new version failed to
+    // load or bind (the current version is kept)
+    LIBDYLIB_DECLARE(int, reloadable_poll)(dylib_reloadable r);
+    // load a new version without checking for changes - fails if the loader
+    // returns the current version, i.e. if the file wasn't replaced
+    LIBDYLIB_DECLARE(bool, reloadable_reload)(dylib_reloadable r);
+    // a descriptor that becomes readable when the file may have changed, for
+    // use with poll() or select(), or -1 if changes aren't watched (in which
+    // case reloadable_poll() compares the file's attributes)
+    LIBDYLIB_DECLARE(int, reloadable_fd)(dylib_reloadable r);
+    // the current version - must only be used inside a reader section, and
+    // must not be closed
+    LIBDYLIB_DECLARE(dylib_ref, reloadable_get)(dylib_reloadable r);
+    // the addresses of the current version's table entries, in table order
+    LIBDYLIB_DECLARE(void *const*, reloadable_symbols)(dylib_reloadable r);
+    // starts at 1 and increases with each published version
+    LIBDYLIB_DECLARE(unsigned long, reloadable_generation)(dylib_reloadable r);
+    // waits for active reader sections to end and unloads every version
+    LIBDYLIB_DECLARE(void, reloadable_free)(dylib_reloadable r);
+
+    // reverse lookups: the object containing an address, and the nearest
+    // exported symbol at or before it
+    typedef struct dylib_addr_info {
+        dylib_ref lib;              // NULL if the object wasn't opened by libdylib
+        const char *path;           // valid while the object is loaded
+        const void *base;           // load address of the object
+        const char *symbol;         // NULL if no symbol precedes addr
+        const void *symbol_addr;
+        size_t offset;              // from symbol_addr, or from base
+    } dylib_addr_info;
+    // look addr up in lib, or in every loaded object if lib is NULL - the
+    // index of all objects is updated after libdylib opens or closes anything,
+    // but not after objects are loaded or unloaded by other means
+    LIBDYLIB_DECLARE(bool, addr_to_symbol)(dylib_ref lib, const void *addr, dylib_addr_info *info);
+    // same as addr_to_symbol() for n addresses - infos[i] is cleared if
+    // addrs[i] is not found, and the number found is returned
+    LIBDYLIB_DECLARE(size_t, addr_to_symbols)(dylib_ref lib, const void *const *addrs, size_t n, dylib_addr_info *infos);
+
+    // an ordered list of libraries (e.g. overrides first, base libraries last)
+    // in which symbols are looked up as a whole, through one table of the
+    // symbols each library defines - symbols that a library only finds in its
+    // dependencies are not part of the scope
+    // Scopes hold a reference to each of their libraries.
+    typedef struct dylib_scope_data* dylib_scope;
+    LIBDYLIB_DECLARE(dylib_scope, scope_create)();
+    // add lib before the library at index, or last if index is out of range
+    // does nothing if lib is already in the scope
+    LIBDYLIB_DECLARE(bool, scope_insert)(dylib_scope scope, size_t index, dylib_ref lib);
+    LIBDYLIB_DECLARE(bool, scope_add)(dylib_scope scope, dylib_ref lib);
+    LIBDYLIB_DECLARE(bool, scope_remove)(dylib_scope scope, dylib_ref lib);
+    LIBDYLIB_DECLARE(size_t, scope_size)(dylib_scope scope);
+    // return the address of symbol in the first library of the scope that
+    // defines it, and set *lib to that library if lib is not NULL
+    LIBDYLIB_DECLARE(void*, scope_lookup)(dylib_scope scope, const char *symbol, dylib_ref *lib);
+    LIBDYLIB_DECLARE(void, scope_free)(dylib_scope scope);
+
     // check for the existence of a symbol in a library
     LIBDYLIB_DECLARE(bool, find)(dylib_ref lib, const char *symbol);
 
@@ -104,8 +430,149 @@ namespace libdylib {
     LIBDYLIB_DECLARE(bool, find_all)(dylib_ref lib, ...);
     LIBDYLIB_DECLARE(bool, va_find_all)(dylib_ref lib, va_list args);
 
-    // returns the last error message set by libdylib functions, or NULL
+    // retrieve symbol cache counters of a library opened with LIBDYLIB_OPEN_CACHE
+    // hits counts lookups answered by the cache (including cached failures),
+    // misses counts lookups that had to be resolved by the platform
+    // returns 0 if the library does not have a symbol cache
+    LIBDYLIB_DECLARE(bool, get_cache_stats)(dylib_ref lib, size_t *hits, size_t *misses);
+
+    // enumerate the symbols exported by a library file without loading it
+    // (ELF platforms only)
+    // the file is mapped read-only and names are not copied, so they are only
+    // valid until symbols_close() is called
+    typedef struct dylib_symbols_data* dylib_symbols_ref;
+    enum {
+        LIBDYLIB_SYMTYPE_NOTYPE,
+        LIBDYLIB_SYMTYPE_OBJECT,
+        LIBDYLIB_SYMTYPE_FUNC,
+        LIBDYLIB_SYMTYPE_TLS,
+        LIBDYLIB_SYMTYPE_IFUNC,     // resolved by calling a function at load time
+        LIBDYLIB_SYMTYPE_OTHER
+    };
+    enum {
+        LIBDYLIB_SYMBIND_GLOBAL,
+        LIBDYLIB_SYMBIND_WEAK,
+        LIBDYLIB_SYMBIND_UNIQUE,    // one definition per process (GNU extension)
+        LIBDYLIB_SYMBIND_OTHER
+    };
+    typedef struct dylib_symbol_info {
+        const char *name;
+        const char *version;        // version name, or NULL if unversioned
+        bool default_version;       // false for hidden (non-default) versions
+        int type;                   // LIBDYLIB_SYMTYPE_*
+        int binding;                // LIBDYLIB_SYMBIND_*
+        uint64_t value;             // address relative to the load base
+        uint64_t size;
+    } dylib_symbol_info;
+
+    // return an iterator over the symbols of the library at path, or NULL
+    LIBDYLIB_DECLARE(dylib_symbols_ref, symbols_open)(const char *path);
+    // fill info with the next symbol and return 1, or return 0 at the end
+    LIBDYLIB_DECLARE(bool, symbols_next)(dylib_symbols_ref iter, dylib_symbol_info *info);
+    // restart iteration from the first symbol
+    LIBDYLIB_DECLARE(void, symbols_rewind)(dylib_symbols_ref iter);
+    LIBDYLIB_DECLARE(void, symbols_close)(dylib_symbols_ref iter);
+
+    // resolve the dependencies of the library at path the way the loader
+    // would, without loading anything (ELF platforms only) - like the
+    // loader, LD_LIBRARY_PATH is taken from the environment the process
+    // started with
+    // objects are listed in load order (breadth-first), starting with the
+    // library itself, and each appears once
+    typedef struct dylib_dependency {
+        const char *name;           // as listed by the object that needs it
+        const char *path;           // the file found for it, or NULL if not found
+        size_t parent;              // index of the object that needs it, or (size_t)-1
+        unsigned depth;
+        uint64_t size;              // file size in bytes
+        bool loaded;                // already loaded (its dependencies are not listed)
+    } dylib_dependency;
+    typedef struct dylib_deps_data* dylib_deps;
+    LIBDYLIB_DECLARE(dylib_deps, deps_resolve)(const char *path);
+    LIBDYLIB_DECLARE(size_t, deps_count)(dylib_deps deps);
+    LIBDYLIB_DECLARE(const dylib_dependency*, deps_get)(dylib_deps deps, size_t index);
+    // start reading every file that is not loaded yet, all at once, and
+    // return the number of files
+    LIBDYLIB_DECLARE(size_t, deps_prefetch)(dylib_deps deps);
+    // write a readable report of the graph to buf, like snprintf(), and
+    // return its full length
+    LIBDYLIB_DECLARE(size_t, deps_report)(dylib_deps deps, char *buf, size_t size);
+    LIBDYLIB_DECLARE(void, deps_free)(dylib_deps deps);
+
+    // error codes set alongside error messages
+    typedef enum dylib_error {
+        LIBDYLIB_E_NONE = 0,
+        LIBDYLIB_E_NULL_HANDLE,     // a NULL library handle was passed
+        LIBDYLIB_E_NULL_ARG,        // another required argument was NULL
+        LIBDYLIB_E_OPEN_FAILED,     // the platform failed to load a library
+        LIBDYLIB_E_CLOSE_FAILED,    // the platform failed to unload a library
+        LIBDYLIB_E_NOT_FOUND,       // one or more symbols were not found
+        LIBDYLIB_E_NO_MEMORY,       // an allocation failed
+        LIBDYLIB_E_UNSUPPORTED,     // not supported on this platform
+        LIBDYLIB_E_BAD_FORMAT,      // a file is not in a supported library format
+        LIBDYLIB_E_INVALID_HANDLE   // a library handle was already closed
+    } dylib_error;
+
+    // route libdylib's own allocations through alloc and free (NULL for both
+    // restores malloc and free) - ctx is passed to both
+    // NOTE: call this before any other libdylib function, since memory that is
+    // already allocated may otherwise be freed by the wrong function
+    typedef void *(*dylib_alloc_func)(size_t size, void *ctx);
+    typedef void (*dylib_free_func)(void *ptr, void *ctx);
+    LIBDYLIB_DECLARE(void, set_allocator)(dylib_alloc_func alloc, dylib_free_func free, void *ctx);
+
+    // returns the last error message set by libdylib functions in the calling
+    // thread, or NULL
+    // the message is only built when this is called, and remains valid until
+    // the next libdylib call that fails in the same thread
     LIBDYLIB_DECLARE(const char*, last_error)();
+    // returns the code of the last error set in the calling thread, or LIBDYLIB_E_NONE
+    LIBDYLIB_DECLARE(dylib_error, last_error_code)();
+
+    // counters for a library handle (since it was first opened), or totals
+    // for all libraries - only the counters relevant to a handle are set for it
+    typedef struct dylib_stats {
+        uint64_t opens;         // successful opens, including of open libraries
+        uint64_t open_failures; // totals only
+        uint64_t open_ns;       // time spent in successful opens
+        uint64_t lookups;       // symbols resolved, by any function
+        uint64_t lookup_hits;   // symbols that were found
+        uint64_t lookup_misses;
+        uint64_t cache_hits;    // see get_cache_stats()
+        uint64_t cache_misses;
+        uint64_t closes;        // totals include final closes
+        uint64_t close_ns;
+        uint64_t error_bytes;   // error text produced (totals only)
+        uint64_t persist_hits;  // symbols bound from LIBDYLIB_OPEN_PERSIST files,
+                                // which are not counted as lookups
+        uint64_t persist_writes;
+    } dylib_stats;
+    // fills stats for lib, or totals if lib is NULL
+    // returns 0 if libdylib was built with LIBDYLIB_NO_STATS
+    LIBDYLIB_DECLARE(bool, get_stats)(dylib_ref lib, dylib_stats *stats);
+    // start or stop counting - counters only change while enabled, which is
+    // off by default since counting adds atomic operations to every lookup
+    // (symbol cache counters, see get_cache_stats(), are always counted)
+    LIBDYLIB_DECLARE(void, set_stats_enabled)(bool enabled);
+
+    // a callback for opens, lookups and closes, with monotonic timestamps in
+    // nanoseconds - lib is NULL for failed opens and final closes, and name is
+    // the path or symbol (NULL for closes)
+    enum {
+        LIBDYLIB_TRACE_OPEN,
+        LIBDYLIB_TRACE_LOOKUP,
+        LIBDYLIB_TRACE_CLOSE
+    };
+    typedef struct dylib_trace_event {
+        int type;
+        dylib_ref lib;
+        const char *name;
+        uint64_t start_ns, end_ns;
+        bool success;
+    } dylib_trace_event;
+    typedef void (*dylib_trace_func)(const dylib_trace_event *event, void *ctx);
+    // set the callback (NULL to disable), which may be called from any thread
+    LIBDYLIB_DECLARE(void, set_trace_callback)(dylib_trace_func func, void *ctx);
 
     // return compiled version information
     LIBDYLIB_DECLARE(int, get_version)();
@@ -1,15 +1,23 @@
 #include "libdylibxx.h"
 #include "libdylib.c"
 
+using libdylib::dependency_graph;
 using libdylib::dylib;
 using libdylib::dylib_self;
+using libdylib::dylib_set;
+using libdylib::instance_pool;
+using libdylib::open_task;
+using libdylib::reloadable;
+using libdylib::scope;
+using libdylib::search_path;
+using libdylib::symbol_range;
 
 dylib_self libdylib::self;
 
-dylib::dylib(const char *path, bool locate) : handle(NULL)
+dylib::dylib(const char *path, bool locate, int flags) : handle(NULL)
 {
     if (path)
-        open(path, locate);
+        open(path, locate, flags);
 }
 
 dylib::~dylib()
@@ -18,17 +26,41 @@ dylib::~dylib()
         close();
 }
 
-bool dylib::open(const char *path, bool locate)
+bool dylib::open(const char *path, bool locate, int flags)
 {
     if (handle)
         return false;
-    handle = locate ? libdylib::open_locate(path) : libdylib::open(path);
+    handle = locate ? libdylib::open_locate_ex(path, flags) : libdylib::open_ex(path, flags);
     return handle;
 }
 
-bool dylib::open_locate(const char *name)
+bool dylib::open_locate(const char *name, int flags)
 {
-    return open(name, true);
+    return open(name, true, flags);
+}
+
+bool dylib::open_search(search_path &sp, const char *name, int flags)
+{
+    if (handle)
+        return false;
+    handle = libdylib::open_search(sp.get_handle(), name, flags);
+    return handle;
+}
+
+bool dylib::open_memory(const void *buf, size_t len, const char *name, int flags)
+{
+    if (handle)
+        return false;
+    handle = libdylib::open_memory_ex(buf, len, name, flags);
+    return handle;
+}
+
+bool dylib::open_namespace(const char *path, dylib_namespace ns, int flags)
+{
+    if (handle)
+        return false;
+    handle = libdylib::open_namespace(path, ns, flags);
+    return handle;
 }
 
 bool dylib::open_list(const char *path, ...)
@@ -40,6 +72,15 @@ bool dylib::open_list(const char *path, ...)
     return handle;
 }
 
+bool dylib::open_list_ex(int flags, const char *path, ...)
+{
+    va_list args;
+    va_start(args, path);
+    handle = libdylib::va_open_list_ex(flags, path, args);
+    va_end(args);
+    return handle;
+}
+
 bool dylib::close()
 {
     bool ret = libdylib::close(handle);
@@ -75,6 +116,176 @@ bool dylib::find_all(dylib_ref unused, ...)
     return ret;
 }
 
+void *dylib::lookup_first(dylib_ref unused, ...)
+{
+    va_list args;
+    va_start(args, unused);
+    void *ret = libdylib::va_lookup_first(handle, args);
+    va_end(args);
+    return ret;
+}
+
+bool dylib::bind_table(const dylib_bind_entry *table, size_t n)
+{
+    return libdylib::bind_table(handle, table, n);
+}
+
+symbol_range::iterator::iterator(dylib_symbols_ref handle) : handle(handle)
+{
+    if (handle)
+        ++*this;
+}
+
+search_path::search_path() : handle(libdylib::search_path_create()) {}
+
+search_path::~search_path()
+{
+    libdylib::search_path_free(handle);
+}
+
+bool search_path::add_dir(const char *dir)
+{
+    return libdylib::search_path_add_dir(handle, dir);
+}
+
+bool search_path::set_patterns(const char *const *patterns, size_t n)
+{
+    return libdylib::search_path_set_patterns(handle, patterns, n);
+}
+
+void search_path::invalidate()
+{
+    libdylib::search_path_invalidate(handle);
+}
+
+scope::scope() : handle(libdylib::scope_create()) {}
+
+scope::~scope()
+{
+    libdylib::scope_free(handle);
+}
+
+bool scope::add(dylib &lib)
+{
+    return libdylib::scope_add(handle, lib.get_handle());
+}
+
+bool scope::insert(size_t index, dylib &lib)
+{
+    return libdylib::scope_insert(handle, index, lib.get_handle());
+}
+
+bool scope::remove(dylib &lib)
+{
+    return libdylib::scope_remove(handle, lib.get_handle());
+}
+
+open_task::open_task(const char *path, int flags) : handle(libdylib::open_async(path, flags)) {}
+
+open_task::open_task(const char *path, int flags, const dylib_bind_entry *table, size_t n)
+    : handle(libdylib::open_async_bind(path, flags, table, n)) {}
+
+open_task::~open_task()
+{
+    libdylib::open_task_free(handle);
+}
+
+bool open_task::ready()
+{
+    return handle && libdylib::open_task_poll(handle);
+}
+
+bool open_task::get(dylib &lib)
+{
+    if (!handle || lib.is_open())
+        return false;
+    lib.get_handle() = libdylib::open_task_wait(handle);
+    return lib.is_open();
+}
+
+reloadable::reloadable(const char *path, int flags, const dylib_bind_entry *table, size_t n)
+    : handle(libdylib::reloadable_open(path, flags, table, n)) {}
+
+reloadable::~reloadable()
+{
+    libdylib::reloadable_free(handle);
+}
+
+symbol_range::iterator &symbol_range::iterator::operator++()
+{
+    if (handle && !libdylib::symbols_next(handle, &info))
+        handle = NULL;
+    return *this;
+}
+
+symbol_range::symbol_range(const char *path) : handle(libdylib::symbols_open(path)) {}
+
+symbol_range::~symbol_range()
+{
+    libdylib::symbols_close(handle);
+}
+
+symbol_range::iterator symbol_range::begin()
+{
+    libdylib::symbols_rewind(handle);
+    return iterator(handle);
+}
+
+dylib_set::~dylib_set()
+{
+    close_all();
+}
+
+bool dylib_set::open(const char *path, int flags)
+{
+    dylib_ref lib = libdylib::open_ex(path, flags);
+    if (lib)
+        handles.push_back(lib);
+    return lib != NULL;
+}
+
+bool dylib_set::add(dylib &lib)
+{
+    if (!lib.is_open())
+        return false;
+    handles.push_back(lib.get_handle());
+    lib.get_handle() = NULL;
+    return true;
+}
+
+bool dylib_set::close_all(int flags)
+{
+    if (handles.empty())
+        return true;
+    bool ret = libdylib::close_many_ex(&handles[0], handles.size(), flags);
+    handles.clear();
+    return ret;
+}
+
+instance_pool::instance_pool(const char *path, size_t n, int flags)
+    : handle(libdylib::instance_pool_open(path, n, flags)) {}
+
+instance_pool::~instance_pool()
+{
+    libdylib::instance_pool_free(handle);
+}
+
+dependency_graph::dependency_graph(const char *path) : handle(libdylib::deps_resolve(path)) {}
+
+dependency_graph::~dependency_graph()
+{
+    libdylib::deps_free(handle);
+}
+
+std::string dependency_graph::report()
+{
+    if (!handle)
+        return std::string();
+    std::string out(libdylib::deps_report(handle, NULL, 0) + 1, '\0');
+    out.resize(libdylib::deps_report(handle, &out[0], out.size()));
+    return out;
+}
+
 dylib_self::dylib_self()
 {
     handle = libdylib::open_self();
@@ -84,4 +295,5 @@ dylib_self::~dylib_self() {}
 
 bool dylib_self::open(const char*) { return false; }
 bool dylib_self::open_list(const char*, ...) { return false; }
+bool dylib_self::open_list_ex(int, const char*, ...) { return false; }
 bool dylib_self::close() { return false; }
@@ -2,21 +2,141 @@
 #define LIBDYLIBXX_H
 
 #include <string>
+#include <vector>
 
 #include "libdylib.h"
 
+#if __cplusplus >= 201103L || (defined(_MSC_VER) && _MSC_VER >= 1900)
+    #define LIBDYLIBXX_CXX11
+    #include <atomic>
+#endif
+
 namespace libdylib {
+    class search_path;
+#ifdef LIBDYLIBXX_CXX11
+    template<typename T>
+    class lazy_function;
+#endif
+
+#ifdef LIBDYLIBXX_CXX11
+    // hash_symbol() at compile time
+    constexpr uint32_t static_hash_symbol(const char *name, uint32_t hash = 5381) {
+        return *name ? static_hash_symbol(name + 1, hash * 33 + (unsigned char)*name) : hash;
+    }
+
+    // a symbol of type T (a function or object type) with its name hashed at
+    // compile time, when declared constexpr:
+    //     constexpr libdylib::symbol<int(float*, size_t)> render("render");
+    template<typename T>
+    class symbol {
+        const char *name_;
+        uint32_t hash_;
+    public:
+        typedef T *pointer;
+        constexpr explicit symbol(const char *name) : name_(name), hash_(static_hash_symbol(name)) {}
+        constexpr const char *name() const { return name_; }
+        constexpr uint32_t hash() const { return hash_; }
+        // a bind_table() entry storing into dest, which must have the right type
+        dylib_bind_entry entry(pointer &dest, bool optional = false) const {
+            dylib_bind_entry e = {name_, (void**)&dest, optional};
+            return e;
+        }
+    };
+    #define DYLIB_SYMBOL(name, type) libdylib::symbol<type>(#name)
+#endif
+
+    // a pointer to a symbol that keeps its library open, through a reference
+    // counted by the library handle - copies can be passed between threads
+    template<typename T>
+    class symbol_ptr {
+        dylib_ref lib_;
+        T *ptr_;
+    public:
+        symbol_ptr() : lib_(NULL), ptr_(NULL) {}
+        // ptr must be a symbol in lib
+        symbol_ptr(dylib_ref lib, T *ptr)
+            : lib_(ptr && lib ? LIBDYLIB_NAME(retain)(lib) : NULL), ptr_(lib_ ? ptr : NULL) {}
+        symbol_ptr(const symbol_ptr &other)
+            : lib_(other.lib_ ? LIBDYLIB_NAME(retain)(other.lib_) : NULL), ptr_(other.ptr_) {}
+#ifdef LIBDYLIBXX_CXX11
+        symbol_ptr(symbol_ptr &&other) noexcept : lib_(other.lib_), ptr_(other.ptr_) {
+            other.lib_ = NULL;
+            other.ptr_ = NULL;
+        }
+#endif
+        ~symbol_ptr() {
+            if (lib_)
+                LIBDYLIB_NAME(close)(lib_);
+        }
+        symbol_ptr &operator=(symbol_ptr other) {
+            swap(other);
+            return *this;
+        }
+        void swap(symbol_ptr &other) {
+            dylib_ref lib = lib_;
+            T *ptr = ptr_;
+            lib_ = other.lib_;
+            ptr_ = other.ptr_;
+            other.lib_ = lib;
+            other.ptr_ = ptr;
+        }
+        inline void reset() { symbol_ptr().swap(*this); }
+        inline T *get() const { return ptr_; }
+        inline T &operator*() const { return *ptr_; }
+        inline bool is_valid() const { return ptr_ != NULL; }
+        inline dylib_ref get_library() const { return lib_; }
+#ifdef LIBDYLIBXX_CXX11
+        explicit operator bool() const { return ptr_ != NULL; }
+        template<typename... Args>
+        auto operator()(Args&&... args) const -> decltype(ptr_(static_cast<Args&&>(args)...)) {
+            return ptr_(static_cast<Args&&>(args)...);
+        }
+#endif
+    };
+
+    // dylib objects own one reference to a library, and can be moved but not
+    // copied - see symbol_ptr to share a library
     class dylib {
     protected:
         dylib_ref handle;
+    private:
+#ifdef LIBDYLIBXX_CXX11
+        template<typename T>
+        friend class lazy_function;
+        dylib(const dylib&) = delete;
+        dylib &operator=(const dylib&) = delete;
+#else
+        dylib(const dylib&);
+        dylib &operator=(const dylib&);
+#endif
     public:
-        dylib(const char *path = NULL, bool locate = false);
+        // flags are LIBDYLIB_OPEN_* flags, see open_ex()
+        dylib(const char *path = NULL, bool locate = false, int flags = 0);
         ~dylib();
+#ifdef LIBDYLIBXX_CXX11
+        dylib(dylib &&other) noexcept : handle(other.handle) { other.handle = NULL; }
+        dylib &operator=(dylib &&other) noexcept {
+            if (this != &other)
+            {
+                if (handle)
+                    close();
+                handle = other.handle;
+                other.handle = NULL;
+            }
+            return *this;
+        }
+#endif
 
-        bool open(const char *path, bool locate = false);
-        inline bool open(std::string path, bool locate = false) { return open(path.c_str(), locate); }
+        bool open(const char *path, bool locate = false, int flags = 0);
+        inline bool open(std::string path, bool locate = false, int flags = 0) { return open(path.c_str(), locate, flags); }
         bool open_list(const char *path, ...);
-        bool open_locate(const char *name);
+        bool open_list_ex(int flags, const char *path, ...);
+        bool open_locate(const char *name, int flags = 0);
+        bool open_search(search_path &sp, const char *name, int flags = 0);
+        // see open_memory_ex()
+        bool open_memory(const void *buf, size_t len, const char *name, int flags = 0);
+        // see open_namespace() - ns is LIBDYLIB_NAMESPACE_NEW for a new namespace
+        bool open_namespace(const char *path, dylib_namespace ns, int flags = 0);
         bool close();
 
         void *lookup(const char *symbol);
@@ -29,6 +149,10 @@ namespace libdylib {
         // all remaining arguments properly)
         bool find_any(dylib_ref unused, ...);
         bool find_all(dylib_ref unused, ...);
+        void *lookup_first(dylib_ref unused, ...);
+        inline void *lookup_versioned(const char *symbol, const char *version) {
+            return LIBDYLIB_NAME(lookup_versioned)(handle, symbol, version);
+        }
 
         template<typename T>
         bool bind(const char *symbol, T* &dest) {
@@ -41,11 +165,281 @@ namespace libdylib {
         }
         #define DYLIB_BINDNAME(lib, name) lib.bind(#name, name)
 
+        // a symbol_ptr that keeps this library open
+        template<typename T>
+        symbol_ptr<T> get_ptr(const char *symbol) {
+            return symbol_ptr<T>(handle, (T*)lookup(symbol));
+        }
+
+#ifdef LIBDYLIBXX_CXX11
+        // typed lookups, reusing the symbol's precomputed hash
+        template<typename T>
+        typename symbol<T>::pointer get(const symbol<T> &sym) {
+            return (typename symbol<T>::pointer)LIBDYLIB_NAME(lookup_hash)(handle, sym.name(), sym.hash());
+        }
+        template<typename T>
+        bool bind(const symbol<T> &sym, typename symbol<T>::pointer &dest) {
+            dest = get(sym);
+            return dest != NULL;
+        }
+        template<typename T>
+        symbol_ptr<T> get_ptr(const symbol<T> &sym) {
+            return symbol_ptr<T>(handle, get(sym));
+        }
+#endif
+
+        // see LIBDYLIB_NAME(bind_table)
+        bool bind_table(const dylib_bind_entry *table, size_t n);
+        template<size_t N>
+        bool bind_table(const dylib_bind_entry (&table)[N]) {
+            return bind_table(table, N);
+        }
+
         inline dylib_ref &get_handle() { return handle; }
         inline const char *get_path() { return LIBDYLIB_NAME(get_path)(handle); }
         inline const void *get_raw_handle() { return LIBDYLIB_NAME(get_handle)(handle); }
         inline bool is_open() { return handle != NULL; }
+        inline dylib_namespace get_namespace() { return LIBDYLIB_NAME(get_namespace)(handle); }
+        inline bool get_cache_stats(size_t &hits, size_t &misses) {
+            return LIBDYLIB_NAME(get_cache_stats)(handle, &hits, &misses);
+        }
+        inline bool get_stats(dylib_stats &stats) {
+            return LIBDYLIB_NAME(get_stats)(handle, &stats);
+        }
+        inline bool addr_to_symbol(const void *addr, dylib_addr_info &info) {
+            return LIBDYLIB_NAME(addr_to_symbol)(handle, addr, &info);
+        }
+    };
+    // construct a bind_table() entry for a function or object pointer
+    template<typename T>
+    dylib_bind_entry bind_entry(const char *symbol, T* &dest, bool optional = false) {
+        dylib_bind_entry entry = {symbol, (void**)&dest, optional};
+        return entry;
+    }
+    #define DYLIB_BIND_ENTRY_NAME(name) libdylib::bind_entry(#name, name)
+
+#ifdef LIBDYLIBXX_CXX11
+    // a lazy call (see LIBDYLIB_LAZY) to a function of type T, declared with
+    // DYLIB_LAZY at namespace scope and called like a function:
+    //     DYLIB_LAZY(plugin, render, int(float*, size_t));
+    //     render(buf, n);
+    // lib is a dylib or dylib_ref, which must outlive the object - the
+    // object is constant-initialized, symbol hash included
+    template<typename T>
+    class lazy_function;
+    template<typename R, typename... A>
+    class lazy_function<R(A...)> {
+    public:
+        typedef R (*pointer)(A...);
+    private:
+        dylib_ref *lib_;
+        const char *name_;
+        uint32_t hash_;
+        std::atomic<pointer> ptr_;
+        pointer stub_;
+        lazy_function(const lazy_function&) = delete;
+        lazy_function &operator=(const lazy_function&) = delete;
+    public:
+        constexpr lazy_function(dylib_ref &lib, const char *name, pointer stub)
+            : lib_(&lib), name_(name), hash_(static_hash_symbol(name)), ptr_(stub), stub_(stub) {}
+        constexpr lazy_function(dylib &lib, const char *name, pointer stub)
+            : lib_(&lib.handle), name_(name), hash_(static_hash_symbol(name)), ptr_(stub), stub_(stub) {}
+        inline R operator()(A... args) const { return get()(static_cast<A&&>(args)...); }
+        inline pointer get() const { return ptr_.load(std::memory_order_acquire); }
+        inline bool is_resolved() const { return get() != stub_; }
+        // see LIBDYLIB_LAZY_RESET
+        inline void reset() { ptr_.store(stub_, std::memory_order_relaxed); }
+        template<lazy_function &F>
+        static R stub(A... args) {
+            void *slot;
+            pointer ptr = (pointer)LIBDYLIB_NAME(lazy_resolve)(*F.lib_, F.name_, F.hash_, &slot);
+            // concurrent first calls all store the same address
+            F.ptr_.store(ptr, std::memory_order_release);
+            return ptr(static_cast<A&&>(args)...);
+        }
+    };
+    #define DYLIB_LAZY(lib, name, type) \
+        libdylib::lazy_function<type> name(lib, #name, &libdylib::lazy_function<type>::stub<name>)
+#endif
+
+    // see LIBDYLIB_NAME(search_path_create)
+    class search_path {
+    protected:
+        dylib_search_path handle;
+    private:
+        search_path(const search_path&);
+        search_path &operator=(const search_path&);
+    public:
+        search_path();
+        ~search_path();
+        bool add_dir(const char *dir);
+        inline bool add_dir(std::string dir) { return add_dir(dir.c_str()); }
+        bool set_patterns(const char *const *patterns, size_t n);
+        void invalidate();
+        inline dylib_search_path get_handle() { return handle; }
     };
+
+    // see LIBDYLIB_NAME(scope_create)
+    class scope {
+    protected:
+        dylib_scope handle;
+    private:
+        scope(const scope&);
+        scope &operator=(const scope&);
+    public:
+        scope();
+        ~scope();
+        bool add(dylib &lib);
+        bool insert(size_t index, dylib &lib);
+        bool remove(dylib &lib);
+        inline size_t size() { return LIBDYLIB_NAME(scope_size)(handle); }
+        inline void *lookup(const char *symbol, dylib_ref *lib = NULL) {
+            return LIBDYLIB_NAME(scope_lookup)(handle, symbol, lib);
+        }
+        template<typename T>
+        inline T *get(const char *symbol) { return (T*)lookup(symbol); }
+        inline dylib_scope get_handle() { return handle; }
+    };
+
+    // a library being opened in the background, see LIBDYLIB_NAME(open_async)
+    class open_task {
+    protected:
+        dylib_open_task handle;
+    private:
+        open_task(const open_task&);
+        open_task &operator=(const open_task&);
+    public:
+        open_task(const char *path, int flags = 0);
+        // see LIBDYLIB_NAME(open_async_bind) - table must outlive the task
+        open_task(const char *path, int flags, const dylib_bind_entry *table, size_t n);
+        ~open_task();
+        inline bool is_valid() { return handle != NULL; }
+        // returns true if get() won't block
+        bool ready();
+        // wait for the library and hand it to lib, which must not be open
+        bool get(dylib &lib);
+    };
+
+    // see LIBDYLIB_NAME(reader_enter) - a reader section for the lifetime of
+    // the object
+    class reader_section {
+    private:
+        reader_section(const reader_section&);
+        reader_section &operator=(const reader_section&);
+    public:
+        inline reader_section() { LIBDYLIB_NAME(reader_enter)(); }
+        inline ~reader_section() { LIBDYLIB_NAME(reader_exit)(); }
+    };
+
+    // see LIBDYLIB_NAME(reloadable_open) - table must outlive the object
+    class reloadable {
+    protected:
+        dylib_reloadable handle;
+    private:
+        reloadable(const reloadable&);
+        reloadable &operator=(const reloadable&);
+    public:
+        reloadable(const char *path, int flags, const dylib_bind_entry *table, size_t n);
+        ~reloadable();
+        inline bool is_valid() { return handle != NULL; }
+        inline int poll() { return handle ? LIBDYLIB_NAME(reloadable_poll)(handle) : -1; }
+        inline bool reload() { return handle && LIBDYLIB_NAME(reloadable_reload)(handle); }
+        inline int get_fd() { return LIBDYLIB_NAME(reloadable_fd)(handle); }
+        inline unsigned long generation() { return handle ? LIBDYLIB_NAME(reloadable_generation)(handle) : 0; }
+        // the address of table entry i in the current version
+        template<typename T>
+        inline T *get(size_t i) { return (T*)LIBDYLIB_NAME(reloadable_symbols)(handle)[i]; }
+        inline dylib_reloadable get_handle() { return handle; }
+    };
+
+    // a single-pass range over the symbols exported by a library file, see
+    // LIBDYLIB_NAME(symbols_open) - begin() restarts the iteration
+    class symbol_range {
+    protected:
+        dylib_symbols_ref handle;
+    private:
+        symbol_range(const symbol_range&);
+        symbol_range &operator=(const symbol_range&);
+    public:
+        class iterator {
+            dylib_symbols_ref handle; // NULL at the end
+            dylib_symbol_info info;
+            friend class symbol_range;
+            explicit iterator(dylib_symbols_ref handle);
+        public:
+            inline const dylib_symbol_info &operator*() const { return info; }
+            inline const dylib_symbol_info *operator->() const { return &info; }
+            iterator &operator++();
+            inline bool operator==(const iterator &other) const { return handle == other.handle; }
+            inline bool operator!=(const iterator &other) const { return handle != other.handle; }
+        };
+
+        symbol_range(const char *path);
+        inline symbol_range(std::string path) : handle(LIBDYLIB_NAME(symbols_open)(path.c_str())) {}
+        ~symbol_range();
+        inline bool is_open() { return handle != NULL; }
+        iterator begin();
+        inline iterator end() { return iterator(NULL); }
+    };
+
+    // see LIBDYLIB_NAME(deps_resolve)
+    class dependency_graph {
+    protected:
+        dylib_deps handle;
+    private:
+        dependency_graph(const dependency_graph&);
+        dependency_graph &operator=(const dependency_graph&);
+    public:
+        dependency_graph(const char *path);
+        ~dependency_graph();
+        inline bool is_valid() { return handle != NULL; }
+        inline size_t size() { return handle ? LIBDYLIB_NAME(deps_count)(handle) : 0; }
+        inline const dylib_dependency &operator[](size_t i) { return *LIBDYLIB_NAME(deps_get)(handle, i); }
+        inline size_t prefetch() { return handle ? LIBDYLIB_NAME(deps_prefetch)(handle) : 0; }
+        std::string report();
+        inline dylib_deps get_handle() { return handle; }
+    };
+
+    // libraries that are closed together, see LIBDYLIB_NAME(close_many_ex) -
+    // the destructor calls close_all()
+    class dylib_set {
+    protected:
+        std::vector<dylib_ref> handles;
+    private:
+        dylib_set(const dylib_set&);
+        dylib_set &operator=(const dylib_set&);
+    public:
+        inline dylib_set() {}
+        ~dylib_set();
+        // open a library and add it to the set
+        bool open(const char *path, int flags = 0);
+        // take over the reference held by lib, which is left closed
+        bool add(dylib &lib);
+        inline size_t size() { return handles.size(); }
+        inline dylib_ref operator[](size_t i) { return handles[i]; }
+        // close every library (flags are LIBDYLIB_CLOSE_* flags) and empty
+        // the set, even if some of them fail to close
+        bool close_all(int flags = 0);
+    };
+
+    // see LIBDYLIB_NAME(instance_pool_open) - the destructor closes every
+    // instance
+    class instance_pool {
+    protected:
+        dylib_instance_pool handle;
+    private:
+        instance_pool(const instance_pool&);
+        instance_pool &operator=(const instance_pool&);
+    public:
+        instance_pool(const char *path, size_t n, int flags = 0);
+        ~instance_pool();
+        inline bool is_valid() { return handle != NULL; }
+        inline size_t size() { return handle ? LIBDYLIB_NAME(instance_pool_size)(handle) : 0; }
+        inline dylib_ref operator[](size_t i) { return LIBDYLIB_NAME(instance_pool_get)(handle, i); }
+        inline dylib_ref next() { return LIBDYLIB_NAME(instance_pool_next)(handle); }
+        inline dylib_instance_pool get_handle() { return handle; }
+    };
+
     class dylib_self : public dylib {
     public:
         dylib_self();
@@ -53,6 +447,7 @@ namespace libdylib {
     private:
         bool open(const char*);
         bool open_list(const char*, ...);
+        bool open_list_ex(int, const char*, ...);
         bool close();
     };
     extern dylib_self self;
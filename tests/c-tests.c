@@ -1,17 +1,186 @@
+#ifdef __linux__
+    #define _GNU_SOURCE // for dladdr()
+    #include <dirent.h>
+    #include <dlfcn.h>
+    #include <pthread.h>
+    #include <sys/stat.h>
+#endif
+#include <setjmp.h>
 #include "libdylib.h"
 #include "test.inc.h"
 
+#ifdef __linux__
+static void *open_thread (void *arg)
+{
+    (void)arg;
+    return libdylib_open(lib_path);
+}
+
+// replaces dest with a copy of src, like a deployment would
+static bool replace_file (const char *src, const char *dest)
+{
+    char buf[4096];
+    size_t len;
+    FILE *in = fopen(src, "rb"), *out = fopen("reload-tmp.so", "wb");
+    while (in && out && (len = fread(buf, 1, sizeof(buf), in)) > 0)
+        fwrite(buf, 1, len, out);
+    if (in)
+        fclose(in);
+    return in && out && fclose(out) == 0 && rename("reload-tmp.so", dest) == 0;
+}
+
+// reads all of path into a new buffer, and sets *len
+static char *read_file (const char *path, size_t *len)
+{
+    FILE *f = fopen(path, "rb");
+    char *buf = NULL;
+    if (f && fseek(f, 0, SEEK_END) == 0 && (*len = (size_t)ftell(f)) > 0 && fseek(f, 0, SEEK_SET) == 0)
+        buf = (char*)malloc(*len);
+    if (buf && fread(buf, 1, *len, f) != *len)
+    {
+        free(buf);
+        buf = NULL;
+    }
+    if (f)
+        fclose(f);
+    return buf;
+}
+
+// overwrites (or removes) every file in dir, and returns the number of files
+static int clobber_files (const char *dir, bool remove_files)
+{
+    char path[1024];
+    int count = 0;
+    DIR *d = opendir(dir);
+    struct dirent *entry;
+    while (d && (entry = readdir(d)))
+    {
+        if (entry->d_name[0] == '.')
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+        FILE *f = remove_files ? NULL : fopen(path, "wb");
+        if (f)
+            fclose(f);
+        if (remove_files)
+            remove(path);
+        ++count;
+    }
+    if (d)
+        closedir(d);
+    return count;
+}
+
+// flips a bit in the byte before the last of every file in dir, and returns
+// the number of files
+static int damage_files (const char *dir)
+{
+    char path[1024];
+    int count = 0;
+    DIR *d = opendir(dir);
+    struct dirent *entry;
+    while (d && (entry = readdir(d)))
+    {
+        size_t len;
+        if (entry->d_name[0] == '.')
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+        char *data = read_file(path, &len);
+        FILE *f = data && len >= 2 ? fopen(path, "wb") : NULL;
+        if (f)
+        {
+            data[len - 2] ^= 1;
+            if (fwrite(data, 1, len, f) == len)
+                ++count;
+            fclose(f);
+        }
+        free(data);
+    }
+    if (d)
+        closedir(d);
+    return count;
+}
+#endif
+
+struct alloc_counts {
+    size_t allocs, frees;
+};
+static void *counting_alloc (size_t size, void *ctx)
+{
+    ++((struct alloc_counts*)ctx)->allocs;
+    return malloc(size);
+}
+static void counting_free (void *ptr, void *ctx)
+{
+    ++((struct alloc_counts*)ctx)->frees;
+    free(ptr);
+}
+
+struct trace_counts {
+    int events[3];
+    bool ordered;
+};
+static void counting_trace (const dylib_trace_event *event, void *ctx)
+{
+    struct trace_counts *counts = (struct trace_counts*)ctx;
+    ++counts->events[event->type];
+    if (event->end_ns < event->start_ns)
+        counts->ordered = false;
+}
+
+// lazy calls into lazy_lib, which is opened by run_tests()
+static dylib_ref lazy_lib;
+LIBDYLIB_LAZY(lazy_lib, int, returns_1, (void), ())
+LIBDYLIB_LAZY(lazy_lib, int, missing_symbol, (void), ())
+LIBDYLIB_LAZY_VOID(lazy_lib, sym2, (void), ())
+static jmp_buf lazy_fail_jmp;
+static void lazy_fail (dylib_ref lib, const char *symbol)
+{
+    (void)lib; (void)symbol;
+    longjmp(lazy_fail_jmp, 1);
+}
+#ifdef __linux__
+static void *lazy_thread (void *arg)
+{
+    (void)arg;
+    return (void*)(size_t)returns_1();
+}
+
+// looks up sym1 and enough missing symbols to grow the cache of arg, which is
+// shared with other threads - returns arg if every lookup was right
+#define CACHE_THREAD_LOOKUPS 2000
+static void *cache_thread (void *arg)
+{
+    dylib_ref lib = (dylib_ref)arg;
+    void *sym1 = dlsym((void*)libdylib_get_handle(lib), "sym1");
+    char name[32];
+    int i;
+    for (i = 0; i < CACHE_THREAD_LOOKUPS / 2; ++i)
+    {
+        snprintf(name, sizeof(name), "missing_%i", i % 300);
+        if (libdylib_lookup(lib, "sym1") != sym1 || libdylib_lookup(lib, name))
+            return NULL;
+    }
+    return arg;
+}
+#endif
+
 void run_tests()
 {
+    struct alloc_counts counts = {0, 0};
+    libdylib_set_allocator(counting_alloc, counting_free, &counts);
     TEST(!libdylib_last_error());
+    // counted from the start, for the tests of statistics below
+    libdylib_set_stats_enabled(true);
 
     dylib_ref lib;
     TEST(lib = libdylib_open(lib_path));
     TEST(libdylib_close(lib));
     TEST(!libdylib_close(lib));
+    TEST(libdylib_last_error_code() == LIBDYLIB_E_INVALID_HANDLE);
     TEST(lib = libdylib_open(lib_path));
     TEST(!libdylib_open("foo"));
     TEST(libdylib_last_error());
+    TEST(libdylib_last_error_code() == LIBDYLIB_E_OPEN_FAILED);
 
     dylib_ref plib;
     TEST(plib = libdylib_open_locate(plib_path));
@@ -41,6 +210,44 @@ void run_tests()
     TEST(!libdylib_find_all(lib, "x", "sym1", NULL));
     TEST(!libdylib_find_all(lib, "sym1", "x", NULL));
 
+    // lazy calls (before returns_1 is declared below)
+    dylib_stats lazy_before, lazy_stats;
+    void *lazy_results[4];
+    int lazy_i;
+    lazy_lib = lib;
+    TEST(libdylib_get_stats(lib, &lazy_before));
+    TEST(LIBDYLIB_LAZY_TARGET(returns_1) != libdylib_lookup(lib, "returns_1"));
+    TEST(returns_1() == 1 && LIBDYLIB_LAZY_TARGET(returns_1) == libdylib_lookup(lib, "returns_1"));
+    TEST(returns_1() == 1);
+    sym2();
+    TEST(LIBDYLIB_LAZY_TARGET(sym2) == libdylib_lookup(lib, "sym2"));
+    // one lookup per stub, and three by the tests
+    TEST(libdylib_get_stats(lib, &lazy_stats) && lazy_stats.lookups == lazy_before.lookups + 5);
+    libdylib_set_lazy_fail_handler(lazy_fail);
+    volatile bool lazy_failed = false;
+    if (setjmp(lazy_fail_jmp))
+        lazy_failed = true;
+    else
+        missing_symbol();
+    TEST(lazy_failed);
+    TEST(libdylib_last_error_code() == LIBDYLIB_E_NOT_FOUND);
+    TEST(LIBDYLIB_LAZY_TARGET(missing_symbol) == (void*)libdylib_lazy_missing_symbol);
+    libdylib_set_lazy_fail_handler(NULL);
+    LIBDYLIB_LAZY_RESET(returns_1);
+    TEST(LIBDYLIB_LAZY_TARGET(returns_1) == (void*)libdylib_lazy_returns_1);
+#ifdef __linux__
+    // concurrent first calls
+    pthread_t lazy_threads[4];
+    for (lazy_i = 0; lazy_i < 4; ++lazy_i)
+        pthread_create(&lazy_threads[lazy_i], NULL, lazy_thread, NULL);
+    for (lazy_i = 0; lazy_i < 4; ++lazy_i)
+        pthread_join(lazy_threads[lazy_i], &lazy_results[lazy_i]);
+    TEST(lazy_results[0] == (void*)1 && lazy_results[3] == (void*)1);
+    TEST(LIBDYLIB_LAZY_TARGET(returns_1) == libdylib_lookup(lib, "returns_1"));
+#else
+    (void)lazy_results; (void)lazy_i;
+#endif
+
     int (*returns_0)(void), (*returns_1)(void);
     TEST(libdylib_bind(lib, "returns_0", (void**)&returns_0));
     TEST(LIBDYLIB_BIND(lib, "returns_0", returns_0));
@@ -51,4 +258,654 @@ void run_tests()
 
     TEST(libdylib_open_self());
     TEST(libdylib_find(libdylib_open_self(), "main"));
+
+    dylib_ref clib;
+    size_t hits = 1, misses = 1;
+    TEST(clib = libdylib_open_ex(lib_path, LIBDYLIB_OPEN_CACHE));
+    TEST(libdylib_get_cache_stats(clib, &hits, &misses) && hits == 0 && misses == 0);
+    TEST(libdylib_lookup(clib, "sym1") == libdylib_lookup(lib, "sym1"));
+    TEST(libdylib_lookup(clib, "sym1") == libdylib_lookup(lib, "sym1"));
+    TEST(!libdylib_lookup(clib, "x"));
+    TEST(!libdylib_find(clib, "x"));
+    TEST(libdylib_last_error());
+    // lib and clib share a handle, and therefore the cache
+    TEST(clib == lib);
+    TEST(libdylib_get_cache_stats(clib, &hits, &misses) && hits == 4 && misses == 2);
+    TEST(libdylib_get_cache_stats(lib, &hits, &misses) && hits == 4);
+    TEST(libdylib_close(clib));
+
+    void *bsym1 = NULL, *bx = lib, *by = lib, *bz = lib;
+    dylib_bind_entry table[] = {
+        LIBDYLIB_BIND_ENTRY("sym1", bsym1),
+        LIBDYLIB_BIND_ENTRY_NAME(returns_0),
+        LIBDYLIB_BIND_ENTRY_OPTIONAL("x", bx),
+    };
+    returns_0 = NULL;
+    TEST(libdylib_bind_table(lib, table, 3));
+    TEST(bsym1 == libdylib_lookup(lib, "sym1") && returns_0 && !bx);
+    dylib_bind_entry bad_table[] = {
+        LIBDYLIB_BIND_ENTRY("y", by),
+        LIBDYLIB_BIND_ENTRY("sym1", bsym1),
+        LIBDYLIB_BIND_ENTRY("z", bz),
+        {"sym2", NULL, false},
+    };
+    TEST(!libdylib_bind_table(lib, bad_table, 4));
+    TEST(!by && !bz && bsym1);
+    TEST(libdylib_last_error() && strstr(libdylib_last_error(), "y, z"));
+    TEST(libdylib_bind_table(lib, NULL, 0));
+
+    TEST(libdylib_last_error_code() == LIBDYLIB_E_NOT_FOUND);
+
+    TEST(!libdylib_lookup(NULL, "sym1"));
+    TEST(libdylib_last_error_code() == LIBDYLIB_E_NULL_HANDLE);
+    TEST(!libdylib_lookup(lib, "missing_symbol"));
+    TEST(libdylib_last_error_code() == LIBDYLIB_E_NOT_FOUND);
+    TEST(strstr(libdylib_last_error(), "missing_symbol"));
+    TEST(libdylib_lookup(lib, "sym1"));
+    TEST(strstr(libdylib_last_error(), "missing_symbol"));
+
+    dylib_ref elib;
+    TEST(elib = libdylib_open_ex(lib_path, LIBDYLIB_OPEN_ELF_LOOKUP));
+    TEST(libdylib_lookup(elib, "sym1") == libdylib_lookup(lib, "sym1"));
+    TEST(libdylib_lookup(elib, "returns_1") == libdylib_lookup(lib, "returns_1"));
+    TEST(!libdylib_lookup(elib, "missing_symbol"));
+    TEST(libdylib_find_all(elib, "sym1", "sym2", "sym3", "returns_0", NULL));
+    TEST(libdylib_close(elib));
+#ifdef LIBDYLIB_LINUX
+    // memcpy is an IFUNC and printf has several versions in glibc
+    dylib_ref libc, elibc;
+    TEST(libc = libdylib_open("libc.so.6"));
+    TEST(elibc = libdylib_open_ex("libc.so.6", LIBDYLIB_OPEN_ELF_LOOKUP | LIBDYLIB_OPEN_CACHE));
+    TEST(libdylib_lookup(elibc, "memcpy") == libdylib_lookup(libc, "memcpy"));
+    TEST(libdylib_lookup(elibc, "printf") == libdylib_lookup(libc, "printf"));
+    TEST(libdylib_lookup(elibc, "qsort") == libdylib_lookup(libc, "qsort"));
+    TEST(libdylib_lookup(elibc, "errno") == libdylib_lookup(libc, "errno"));
+    TEST(libdylib_close(elibc));
+    TEST(libdylib_close(libc));
+
+    dylib_symbols_ref syms;
+    dylib_symbol_info info;
+    int pass, found;
+    TEST(syms = libdylib_symbols_open(lib_path));
+    for (pass = 0; pass < 2; ++pass)
+    {
+        found = 0;
+        libdylib_symbols_rewind(syms);
+        while (libdylib_symbols_next(syms, &info))
+        {
+            if ((!strncmp(info.name, "sym", 3) || !strncmp(info.name, "returns_", 8)) &&
+                info.type == LIBDYLIB_SYMTYPE_FUNC && info.binding == LIBDYLIB_SYMBIND_GLOBAL && info.value)
+                ++found;
+        }
+        TEST(found == 5);
+    }
+    libdylib_symbols_close(syms);
+    Dl_info libc_info;
+    TEST(dladdr((void*)&qsort, &libc_info) && libc_info.dli_fname);
+    TEST(syms = libdylib_symbols_open(libc_info.dli_fname));
+    found = 0;
+    char qsort_version[64] = "";
+    while (syms && libdylib_symbols_next(syms, &info))
+    {
+        if (!strcmp(info.name, "memcpy") && info.version && info.default_version && info.type == LIBDYLIB_SYMTYPE_IFUNC)
+            ++found;
+        if (!strcmp(info.name, "qsort") && info.version && info.default_version)
+            snprintf(qsort_version, sizeof(qsort_version), "%s", info.version);
+    }
+    TEST(found == 1);
+    libdylib_symbols_close(syms);
+#ifdef __GLIBC__
+    // versioned lookups
+    char versioned[128];
+    TEST(*qsort_version);
+    TEST(libc = libdylib_open(libc_info.dli_fname));
+    TEST(libdylib_lookup_versioned(libc, "qsort", qsort_version) == libdylib_lookup(libc, "qsort"));
+    TEST(libdylib_lookup_versioned(libc, "qsort", NULL) == libdylib_lookup(libc, "qsort"));
+    TEST(!libdylib_lookup_versioned(libc, "qsort", "NO_SUCH_VERSION"));
+    TEST(libdylib_last_error_code() == LIBDYLIB_E_NOT_FOUND);
+    snprintf(versioned, sizeof(versioned), "qsort@%s", qsort_version);
+    TEST(libdylib_lookup_first(libc, "qsort@NO_SUCH_VERSION", versioned, NULL) == libdylib_lookup(libc, "qsort"));
+    TEST(libdylib_close(libc));
+#endif
+    TEST(!libdylib_symbols_open("foo"));
+    TEST(libdylib_last_error_code() == LIBDYLIB_E_OPEN_FAILED);
+    TEST(!libdylib_symbols_open("CMakeCache.txt"));
+    TEST(libdylib_last_error_code() == LIBDYLIB_E_BAD_FORMAT);
+
+    // dependency graphs
+    dylib_deps deps;
+    const dylib_dependency *dep;
+    char report[4096];
+    size_t di;
+    TEST(deps = libdylib_deps_resolve("/proc/self/exe"));
+    TEST(libdylib_deps_count(deps) >= 2);
+    TEST((dep = libdylib_deps_get(deps, 0)) && dep->depth == 0 && dep->parent == (size_t)-1 && dep->size);
+    found = 0;
+    for (di = 1; di < libdylib_deps_count(deps); ++di)
+    {
+        dep = libdylib_deps_get(deps, di);
+        if (!strcmp(dep->name, "libc.so.6") && dep->path && dep->loaded && dep->depth == 1 && dep->parent == 0)
+            ++found;
+    }
+    TEST(found == 1);
+    TEST(!libdylib_deps_get(deps, libdylib_deps_count(deps)));
+    TEST(libdylib_deps_prefetch(deps) == 1); // only the executable itself
+    TEST(libdylib_deps_report(deps, report, sizeof(report)) == strlen(report));
+    TEST(strstr(report, "libc.so.6 => ") && strstr(report, "[already loaded]"));
+    TEST(libdylib_deps_report(deps, NULL, 0) == strlen(report));
+    libdylib_deps_free(deps);
+    TEST(!libdylib_deps_resolve("./foo"));
+    TEST(libdylib_last_error_code() == LIBDYLIB_E_OPEN_FAILED);
+    dylib_ref plib2;
+    TEST(plib2 = libdylib_open_ex("./libptestlib.so", LIBDYLIB_OPEN_PREFETCH));
+    TEST(libdylib_close(plib2));
+#endif
+
+    // shared handles
+    dylib_ref rlib, rlib2;
+    TEST(rlib = libdylib_open(lib_path));
+    TEST(rlib == lib);
+    TEST(libdylib_open("./testlib.dylib") == lib);
+    TEST(libdylib_close(lib));
+    TEST(libdylib_close(lib));
+    TEST(libdylib_find(lib, "sym1"));
+    TEST(libdylib_open_self() == libdylib_open_self());
+    TEST(libdylib_close(libdylib_open_self()));
+    TEST(libdylib_find(libdylib_open_self(), "main"));
+    TEST(!libdylib_open(""));
+    TEST(libdylib_last_error_code() == LIBDYLIB_E_OPEN_FAILED);
+    TEST(rlib = libdylib_open_locate(plib_path));
+    TEST(rlib2 = libdylib_open_locate(plib_path));
+    TEST(rlib == rlib2);
+    TEST(libdylib_close(rlib));
+    TEST(libdylib_close(rlib2));
+    int i;
+#ifdef __linux__
+    pthread_t threads[8];
+    void *results[8];
+    for (i = 0; i < 8; ++i)
+        pthread_create(&threads[i], NULL, open_thread, NULL);
+    for (i = 0; i < 8; ++i)
+        pthread_join(threads[i], &results[i]);
+    for (i = 0; i < 8; ++i)
+        TEST(results[i] == lib && libdylib_close(lib));
+
+    // concurrent lookups, and closes during lookups
+    TEST(rlib = libdylib_open_ex(lib_path, LIBDYLIB_OPEN_CACHE));
+    TEST(libdylib_get_cache_stats(rlib, &hits, &misses));
+    size_t thread_hits = hits, thread_misses = misses;
+    for (i = 0; i < 8; ++i)
+        pthread_create(&threads[i], NULL, cache_thread, rlib);
+    for (i = 0; i < 8; ++i)
+        pthread_join(threads[i], &results[i]);
+    for (i = 0; i < 8; ++i)
+        TEST(results[i] == rlib);
+    TEST(libdylib_get_cache_stats(rlib, &hits, &misses));
+    TEST(hits + misses - thread_hits - thread_misses == 8 * CACHE_THREAD_LOOKUPS);
+    TEST(misses - thread_misses >= 300);
+    TEST(libdylib_close(rlib));
+    void *retired_sym1;
+    TEST(replace_file(lib_path, "./retire-test.so"));
+    TEST(rlib = libdylib_open("./retire-test.so"));
+    libdylib_reader_enter();
+    TEST(retired_sym1 = libdylib_lookup(rlib, "sym1"));
+    TEST(libdylib_close(rlib));
+    // lookups that started before the close may still be using the library
+    TEST(dladdr(retired_sym1, &libc_info));
+    libdylib_reader_exit();
+    TEST(!dladdr(retired_sym1, &libc_info));
+    remove("./retire-test.so");
+
+    // batched closes
+    dylib_ref batch[4];
+    void *batch_sym;
+    TEST(replace_file(lib_path, "./batch-test-1.so"));
+    TEST(replace_file(lib_path, "./batch-test-2.so"));
+    TEST(batch[0] = libdylib_open("./batch-test-1.so"));
+    TEST(batch[1] = libdylib_open(lib_path));
+    batch[2] = NULL;
+    TEST(batch[3] = libdylib_open("./batch-test-2.so"));
+    TEST(batch_sym = libdylib_lookup(batch[3], "sym1"));
+    TEST(libdylib_close_many(batch, 4));
+    TEST(!dladdr(batch_sym, &libc_info));
+    TEST(libdylib_find(lib, "sym1"));
+    // every library is closed, with one error for the invalid handle (NULL
+    // entries aren't counted)
+    TEST(batch[1] = libdylib_open("./batch-test-2.so"));
+    TEST(batch[1] != batch[0]);
+    TEST(batch_sym = libdylib_lookup(batch[1], "sym1"));
+    TEST(!libdylib_close_many(batch, 3));
+    TEST(libdylib_last_error_code() == LIBDYLIB_E_INVALID_HANDLE);
+    TEST(!strncmp(libdylib_last_error(), "1 of 2 libraries", 16));
+    TEST(!dladdr(batch_sym, &libc_info));
+    // closed handles stay invalid when their memory is reused
+    TEST(batch[0] = libdylib_open("./batch-test-1.so"));
+    TEST(libdylib_close(batch[0]));
+    TEST(batch[1] = libdylib_open("./batch-test-2.so"));
+    TEST(!libdylib_close(batch[0]) && libdylib_last_error_code() == LIBDYLIB_E_INVALID_HANDLE);
+    TEST(!libdylib_lookup(batch[0], "sym1") && libdylib_last_error_code() == LIBDYLIB_E_INVALID_HANDLE);
+    TEST(!libdylib_retain(batch[0]) && !libdylib_get_path(batch[0]));
+    TEST(libdylib_lookup(batch[1], "sym1"));
+    TEST(libdylib_close(batch[1]));
+    // fast exits leave libraries loaded
+    TEST(batch[0] = libdylib_open("./batch-test-1.so"));
+    TEST(batch_sym = libdylib_lookup(batch[0], "sym1"));
+    TEST(libdylib_close_many_ex(batch, 1, LIBDYLIB_CLOSE_FAST_EXIT));
+    TEST(dladdr(batch_sym, &libc_info));
+    TEST(batch[0] = libdylib_open_ex("./batch-test-1.so", LIBDYLIB_OPEN_NOLOAD));
+    TEST(libdylib_lookup(batch[0], "sym1") == batch_sym);
+    TEST(libdylib_close(batch[0]));
+    TEST(libdylib_close_many(batch, 0));
+    TEST(!libdylib_close_many(NULL, 1));
+    remove("./batch-test-1.so");
+    remove("./batch-test-2.so");
+
+    // libraries in memory
+    size_t image_len = 0;
+    char *image;
+    dylib_ref mlib, mlib2;
+    TEST(image = read_file(lib_path, &image_len));
+    TEST(mlib = libdylib_open_memory(image, image_len, "testlib-memory"));
+    TEST(mlib2 = libdylib_open_memory_ex(image, image_len, "testlib-memory", LIBDYLIB_OPEN_CACHE));
+    free(image);
+    // every image is a separate copy of the library
+    TEST(mlib != mlib2 && mlib != lib);
+    TEST(libdylib_lookup(mlib, "sym1") && libdylib_lookup(mlib, "sym1") != libdylib_lookup(lib, "sym1"));
+    TEST(libdylib_lookup(mlib2, "sym1") && libdylib_lookup(mlib2, "sym1") != libdylib_lookup(mlib, "sym1"));
+    TEST(!strncmp(libdylib_get_path(mlib), "/proc/self/fd/", 14));
+    TEST(libdylib_open(libdylib_get_path(mlib)) == mlib);
+    TEST(libdylib_close(mlib));
+    retired_sym1 = libdylib_lookup(mlib, "sym1");
+    TEST(libdylib_close(mlib));
+    TEST(!dladdr(retired_sym1, &libc_info));
+    TEST(libdylib_close(mlib2));
+    TEST(!libdylib_open_memory(NULL, 0, "x"));
+    TEST(libdylib_last_error_code() == LIBDYLIB_E_NULL_ARG);
+    TEST(!libdylib_open_memory("not a library", 13, "x"));
+    TEST(libdylib_last_error_code() == LIBDYLIB_E_OPEN_FAILED);
+#endif
+#ifdef LM_ID_NEWLM
+    // namespaces
+    dylib_ref nlib;
+    TEST(libdylib_get_namespace(lib) == LIBDYLIB_NAMESPACE_BASE);
+    TEST(libdylib_open_namespace(lib_path, LIBDYLIB_NAMESPACE_BASE, 0) == lib);
+    TEST(libdylib_close(lib));
+    TEST(nlib = libdylib_open_namespace(lib_path, LIBDYLIB_NAMESPACE_NEW, LIBDYLIB_OPEN_ELF_LOOKUP));
+    TEST(nlib != lib && libdylib_get_namespace(nlib) > LIBDYLIB_NAMESPACE_BASE);
+    TEST(libdylib_lookup(nlib, "sym1") && libdylib_lookup(nlib, "sym1") != libdylib_lookup(lib, "sym1"));
+    // only opens in the same namespace share the handle
+    TEST(libdylib_open_namespace(lib_path, libdylib_get_namespace(nlib), 0) == nlib);
+    TEST(libdylib_close(nlib));
+    TEST((rlib = libdylib_open(lib_path)) == lib);
+    TEST(libdylib_close(rlib));
+    retired_sym1 = libdylib_lookup(nlib, "sym1");
+    TEST(libdylib_close(nlib));
+    TEST(!dladdr(retired_sym1, &libc_info));
+    TEST(!libdylib_open_namespace("nonexistent.so", LIBDYLIB_NAMESPACE_NEW, 0));
+    TEST(libdylib_last_error_code() == LIBDYLIB_E_OPEN_FAILED);
+    TEST(libdylib_get_namespace(NULL) == LIBDYLIB_NAMESPACE_NEW);
+
+    // instance pools
+    dylib_instance_pool pool;
+    TEST(pool = libdylib_instance_pool_open(lib_path, 3, 0));
+    TEST(libdylib_instance_pool_size(pool) == 3);
+    TEST(libdylib_instance_pool_get(pool, 0) != libdylib_instance_pool_get(pool, 1));
+    TEST(libdylib_get_namespace(libdylib_instance_pool_get(pool, 0)) != libdylib_get_namespace(libdylib_instance_pool_get(pool, 2)));
+    TEST(libdylib_lookup(libdylib_instance_pool_get(pool, 1), "sym1") != libdylib_lookup(libdylib_instance_pool_get(pool, 2), "sym1"));
+    TEST(!libdylib_instance_pool_get(pool, 3));
+    TEST(libdylib_last_error_code() == LIBDYLIB_E_NOT_FOUND);
+    for (i = 0; i < 4; ++i)
+        TEST(libdylib_instance_pool_next(pool) == libdylib_instance_pool_get(pool, i % 3));
+    retired_sym1 = libdylib_lookup(libdylib_instance_pool_get(pool, 2), "sym1");
+    TEST(libdylib_instance_pool_free(pool));
+    TEST(!dladdr(retired_sym1, &libc_info));
+    TEST(!libdylib_instance_pool_open("nonexistent.so", 2, 0));
+    TEST(libdylib_last_error_code() == LIBDYLIB_E_OPEN_FAILED);
+    TEST(!libdylib_instance_pool_open(lib_path, 0, 0));
+    TEST(libdylib_last_error_code() == LIBDYLIB_E_NULL_ARG);
+#endif
+
+    // search paths
+    dylib_search_path sp;
+    const char *patterns[] = {"%s.dylib", "lib%s.so", "%s.txt"};
+    TEST(sp = libdylib_search_path_create());
+    TEST(libdylib_search_path_add_dir(sp, "/nonexistent"));
+    TEST(libdylib_search_path_add_dir(sp, "."));
+    TEST(!libdylib_open_search(sp, "testlib", 0));
+    TEST(libdylib_last_error_code() == LIBDYLIB_E_OPEN_FAILED);
+    TEST(libdylib_search_path_set_patterns(sp, patterns, 3));
+    TEST((rlib = libdylib_open_search(sp, "testlib", 0)) == lib);
+    TEST(libdylib_close(rlib));
+    TEST((rlib = libdylib_open_search(sp, "ptestlib", 0)));
+    TEST(libdylib_close(rlib));
+    TEST(!libdylib_open_search(sp, "CMakeCache", 0));
+    TEST(!libdylib_open_search(sp, "foo", 0));
+    TEST(!libdylib_open_search(sp, "foo", 0));
+#ifdef __linux__
+    // candidates that aren't loaded yet aren't misses for later opens
+    TEST(replace_file(lib_path, "./libsearch-test.so"));
+    TEST(!libdylib_open_search(sp, "search-test", LIBDYLIB_OPEN_NOLOAD));
+    TEST((rlib = libdylib_open_search(sp, "search-test", 0)));
+    TEST(libdylib_close(rlib));
+    remove("./libsearch-test.so");
+    // a library that is found but doesn't load keeps the loader's error,
+    // also once it is remembered
+    FILE *broken = fopen("./libbroken-test.so", "wb");
+    char broken_header[64];
+    FILE *header_src = fopen(lib_path, "rb");
+    TEST(broken && header_src && fread(broken_header, 1, 64, header_src) == 64);
+    TEST(broken && fwrite(broken_header, 1, 64, broken) == 64);
+    if (header_src)
+        fclose(header_src);
+    if (broken)
+        fclose(broken);
+    for (i = 0; i < 2; ++i)
+    {
+        TEST(!libdylib_open_search(sp, "broken-test", 0));
+        TEST(libdylib_last_error_code() == LIBDYLIB_E_OPEN_FAILED);
+        TEST(strstr(libdylib_last_error(), "libbroken-test.so"));
+        TEST(!strstr(libdylib_last_error(), "not found in search path"));
+    }
+    remove("./libbroken-test.so");
+#endif
+    libdylib_search_path_invalidate(sp);
+    TEST(libdylib_search_path_set_patterns(sp, NULL, 0));
+    TEST((rlib = libdylib_open_search(sp, "ptestlib", 0)));
+    TEST(libdylib_close(rlib));
+    libdylib_search_path_free(sp);
+
+    // loader flags
+    TEST(!libdylib_open_ex("ptestlib.so", LIBDYLIB_OPEN_NOLOAD));
+    TEST(!libdylib_open_ex("./libptestlib.so", LIBDYLIB_OPEN_NOLOAD));
+    TEST(libdylib_last_error_code() == LIBDYLIB_E_OPEN_FAILED);
+    TEST(rlib = libdylib_open_ex(lib_path, LIBDYLIB_OPEN_NOLOAD));
+    TEST(rlib == lib);
+    TEST(libdylib_close(rlib));
+    TEST(rlib = libdylib_open_list_ex(LIBDYLIB_OPEN_LAZY | LIBDYLIB_OPEN_GLOBAL, "foo", "./libptestlib.so", NULL));
+    TEST(rlib2 = libdylib_open_ex("./libptestlib.so", LIBDYLIB_OPEN_NOLOAD));
+    TEST(rlib == rlib2);
+    TEST(libdylib_find(rlib, "returns_1"));
+    TEST(libdylib_close(rlib2));
+    TEST(libdylib_close(rlib));
+    TEST(!libdylib_open_ex("./libptestlib.so", LIBDYLIB_OPEN_NOLOAD));
+    TEST(rlib = libdylib_open_locate_ex(plib_path, LIBDYLIB_OPEN_NODELETE));
+    TEST(libdylib_close(rlib));
+    TEST(rlib = libdylib_open_ex("./libptestlib.so", LIBDYLIB_OPEN_NOLOAD));
+    TEST(libdylib_close(rlib));
+
+    // background opening
+    dylib_open_task task, task2;
+    void *bsym2 = NULL, *bmissing = NULL;
+    dylib_bind_entry btable[] = {
+        LIBDYLIB_BIND_ENTRY("sym2", bsym2),
+        LIBDYLIB_BIND_ENTRY("missing", bmissing),
+    };
+    TEST(task = libdylib_open_async(lib_path, 0));
+    TEST(task2 = libdylib_open_async("foo", 0));
+    TEST(libdylib_open_task_wait(task) == lib);
+    TEST(libdylib_open_task_poll(task));
+    TEST(!libdylib_open_task_wait(task2));
+    TEST(libdylib_last_error_code() == LIBDYLIB_E_OPEN_FAILED);
+    TEST(libdylib_close(lib));
+    libdylib_open_task_free(task);
+    libdylib_open_task_free(task2);
+    TEST(task = libdylib_open_async_bind("./libptestlib.so", 0, btable, 1));
+    TEST(rlib = libdylib_open_task_wait(task));
+    TEST(bsym2 && bsym2 == libdylib_lookup(rlib, "sym2"));
+    TEST(task2 = libdylib_open_async_bind("./libptestlib.so", 0, btable, 2));
+    TEST(!libdylib_open_task_wait(task2));
+    TEST(libdylib_last_error_code() == LIBDYLIB_E_NOT_FOUND);
+    TEST(strstr(libdylib_last_error(), "missing"));
+    libdylib_open_task_free(task2);
+    TEST(libdylib_close(rlib));
+    libdylib_open_task_free(task);
+    {
+        const char *paths[] = {lib_path, "foo", "./libptestlib.so"};
+        dylib_ref libs[3];
+        TEST(libdylib_preload(paths, 3, LIBDYLIB_OPEN_LAZY, libs) == 2);
+        TEST(libs[0] == lib && !libs[1] && libs[2]);
+        TEST(libdylib_close(libs[0]));
+        TEST(libdylib_close(libs[2]));
+    }
+
+    // precomputed hashes
+    TEST(libdylib_hash_symbol("") == 5381);
+    TEST(libdylib_hash_symbol("a") == 5381 * 33 + 'a');
+    TEST(rlib = libdylib_open_ex(lib_path, LIBDYLIB_OPEN_CACHE));
+    TEST(libdylib_lookup_hash(rlib, "sym3", libdylib_hash_symbol("sym3")) == libdylib_lookup(rlib, "sym3"));
+    TEST(libdylib_lookup_hash(rlib, "sym3", 0) == libdylib_lookup(rlib, "sym3"));
+    TEST(!libdylib_lookup_hash(rlib, "x", libdylib_hash_symbol("x")));
+    TEST(libdylib_last_error_code() == LIBDYLIB_E_NOT_FOUND);
+    TEST(libdylib_close(rlib));
+
+    // extra references
+    TEST(rlib = libdylib_open("./libptestlib.so"));
+    TEST(libdylib_retain(rlib) == rlib);
+    TEST(libdylib_close(rlib));
+    TEST(libdylib_find(rlib, "sym1"));
+    TEST(libdylib_close(rlib));
+    TEST(!libdylib_retain(rlib));
+    TEST(libdylib_last_error_code() == LIBDYLIB_E_INVALID_HANDLE);
+    TEST(libdylib_retain(libdylib_open_self()));
+
+    // allocator hooks, and no allocations for repeated open/close cycles
+    TEST(counts.allocs > 0 && counts.frees > 0);
+    for (i = 0; i < 2; ++i)
+    {
+        TEST(rlib = libdylib_open("./libptestlib.so"));
+        TEST(libdylib_close(rlib));
+    }
+    size_t allocs = counts.allocs;
+    for (i = 0; i < 10; ++i)
+    {
+        rlib = libdylib_open("./libptestlib.so");
+        libdylib_close(rlib);
+    }
+    TEST(counts.allocs == allocs);
+
+    // statistics and tracing
+    dylib_stats stats, before, totals;
+    struct trace_counts traced = {{0, 0, 0}, true};
+    TEST(!libdylib_get_stats(NULL, NULL));
+    TEST(libdylib_get_stats(NULL, &totals));
+    TEST(totals.opens > 0 && totals.open_failures > 0 && totals.closes > 0 && totals.error_bytes > 0);
+    libdylib_set_trace_callback(counting_trace, &traced);
+    TEST(rlib = libdylib_open("./libptestlib.so"));
+    TEST(libdylib_get_stats(rlib, &before) && before.opens > 0);
+    TEST(libdylib_lookup(rlib, "sym1"));
+    TEST(!libdylib_lookup(rlib, "x"));
+    TEST(libdylib_get_stats(rlib, &stats) && stats.lookups == before.lookups + 2);
+    TEST(stats.lookup_hits == before.lookup_hits + 1 && stats.lookup_misses == before.lookup_misses + 1);
+    TEST(!libdylib_open("foo"));
+    TEST(libdylib_close(rlib));
+    libdylib_set_trace_callback(NULL, NULL);
+    TEST(traced.events[LIBDYLIB_TRACE_OPEN] == 2 && traced.events[LIBDYLIB_TRACE_LOOKUP] == 2);
+    TEST(traced.events[LIBDYLIB_TRACE_CLOSE] == 1 && traced.ordered);
+    TEST(libdylib_get_stats(NULL, &stats));
+    TEST(stats.opens == totals.opens + 1 && stats.open_failures == totals.open_failures + 1);
+    TEST(stats.closes == totals.closes + 1 && stats.lookups >= totals.lookups + 2);
+    TEST(stats.error_bytes > totals.error_bytes);
+    // counters stay the same while disabled
+    libdylib_set_stats_enabled(false);
+    TEST(libdylib_lookup(lib, "sym1") && !libdylib_lookup(lib, "x"));
+    TEST(libdylib_close(libdylib_open(lib_path)));
+    TEST(libdylib_get_stats(NULL, &totals));
+    TEST(totals.lookups == stats.lookups && totals.opens == stats.opens && totals.closes == stats.closes);
+    TEST(totals.error_bytes == stats.error_bytes);
+    libdylib_set_stats_enabled(true);
+
+    // lookups of the first of several candidates
+    void *asym2 = libdylib_lookup(lib, "sym2");
+    TEST(libdylib_lookup_first(lib, "sym2_v3", "sym2_v2", "sym2", "sym1", NULL) == asym2);
+    TEST(libdylib_get_stats(lib, &before));
+    TEST(libdylib_lookup_first(lib, "sym2_v3", "sym2_v2", "sym2", "sym1", NULL) == asym2);
+    TEST(libdylib_lookup_first(lib, "sym1", NULL) == libdylib_lookup(lib, "sym1"));
+    TEST(!libdylib_lookup_first(lib, "x_v2", "x", NULL));
+    TEST(libdylib_last_error_code() == LIBDYLIB_E_NOT_FOUND);
+    TEST(!libdylib_lookup_first(lib, "x_v2", "x", NULL));
+    // one lookup for the remembered winner, two for "sym1" and two for the
+    // first failure - the second failure is remembered
+    TEST(libdylib_get_stats(lib, &stats) && stats.lookups == before.lookups + 5);
+    // "sylS" and "sym2" have the same hash
+    TEST(!libdylib_lookup_first(lib, "sylS", NULL));
+    TEST(libdylib_lookup_first(lib, "sym2", NULL) == asym2);
+    TEST(!libdylib_lookup_first(lib, NULL));
+
+    // scopes
+    dylib_scope scope;
+    dylib_ref in_lib;
+    TEST(scope = libdylib_scope_create());
+    TEST(rlib = libdylib_open("./libptestlib.so"));
+    TEST(rlib2 = libdylib_open_self());
+    TEST(libdylib_scope_add(scope, lib));
+    TEST(libdylib_scope_lookup(scope, "sym1", &in_lib) == libdylib_lookup(lib, "sym1") && in_lib == lib);
+    TEST(libdylib_scope_insert(scope, 0, rlib) && libdylib_scope_add(scope, rlib2));
+    TEST(libdylib_scope_add(scope, lib) && libdylib_scope_size(scope) == 3);
+    TEST(libdylib_close(rlib)); // still held by the scope
+    TEST(libdylib_scope_lookup(scope, "sym1", &in_lib) == libdylib_lookup(rlib, "sym1") && in_lib == rlib);
+    TEST(libdylib_scope_lookup(scope, "returns_1", NULL) == libdylib_lookup(rlib, "returns_1"));
+    TEST(libdylib_scope_lookup(scope, "main", &in_lib) == libdylib_lookup(rlib2, "main") && in_lib == rlib2);
+    TEST(!libdylib_scope_lookup(scope, "x", &in_lib) && !in_lib);
+    TEST(libdylib_last_error_code() == LIBDYLIB_E_NOT_FOUND);
+    TEST(libdylib_scope_remove(scope, rlib));
+    TEST(!libdylib_scope_remove(scope, rlib));
+    TEST(libdylib_scope_lookup(scope, "sym1", &in_lib) == libdylib_lookup(lib, "sym1") && in_lib == lib);
+    TEST(libdylib_scope_lookup(scope, "main", &in_lib) == libdylib_lookup(rlib2, "main") && in_lib == rlib2);
+#ifdef __linux__
+    // a scope lookup is counted once, also when the member has to be searched
+    TEST(libdylib_get_stats(NULL, &before) && libdylib_scope_lookup(scope, "tls1", &in_lib) && in_lib == lib);
+    TEST(libdylib_get_stats(NULL, &stats) && stats.lookups == before.lookups + 1);
+#endif
+    TEST(libdylib_scope_remove(scope, lib));
+    TEST(!libdylib_scope_lookup(scope, "sym1", NULL));
+    TEST(libdylib_scope_insert(scope, 0, lib) && libdylib_scope_lookup(scope, "sym1", &in_lib) && in_lib == lib);
+    libdylib_scope_free(scope);
+
+    // reverse lookups
+    dylib_addr_info ainfo, ainfos[3];
+    const void *addrs[3];
+    TEST(libdylib_addr_to_symbol(lib, asym2, &ainfo));
+    TEST(ainfo.lib == lib && ainfo.symbol && !strcmp(ainfo.symbol, "sym2") && ainfo.offset == 0);
+    TEST(libdylib_addr_to_symbol(lib, (char*)asym2 + 1, &ainfo));
+    TEST(ainfo.symbol_addr == asym2 && ainfo.offset == 1 && ainfo.path == libdylib_get_path(lib));
+    TEST(!libdylib_addr_to_symbol(lib, &ainfo, &ainfo));
+    TEST(libdylib_last_error_code() == LIBDYLIB_E_NOT_FOUND);
+    TEST(!libdylib_addr_to_symbol(lib, asym2, NULL));
+    TEST(libdylib_addr_to_symbol(NULL, asym2, &ainfo) && ainfo.lib == lib && !strcmp(ainfo.symbol, "sym2"));
+    TEST(rlib = libdylib_open("./libptestlib.so"));
+    addrs[0] = libdylib_lookup(rlib, "returns_1");
+    addrs[1] = (const void*)1;
+    addrs[2] = libdylib_lookup(lib, "sym3");
+    TEST(libdylib_addr_to_symbols(NULL, addrs, 3, ainfos) == 2);
+    TEST(ainfos[0].lib == rlib && !strcmp(ainfos[0].symbol, "returns_1"));
+    TEST(!ainfos[1].path && !ainfos[1].symbol);
+    TEST(ainfos[2].lib == lib && !strcmp(ainfos[2].symbol, "sym3"));
+    TEST(libdylib_addr_to_symbols(rlib, addrs, 3, ainfos) == 1 && ainfos[0].lib == rlib);
+    TEST(libdylib_close(rlib));
+    // the index of all objects is updated after unloading, then loading
+    TEST(libdylib_addr_to_symbol(NULL, addrs[2], &ainfo) && ainfo.lib == lib && !strcmp(ainfo.symbol, "sym3"));
+    TEST(rlib = libdylib_open("./libptestlib.so"));
+    addrs[0] = libdylib_lookup(rlib, "returns_1");
+    TEST(libdylib_addr_to_symbol(NULL, addrs[0], &ainfo) && ainfo.lib == rlib && !strcmp(ainfo.symbol, "returns_1"));
+    TEST(libdylib_addr_to_symbol(NULL, addrs[2], &ainfo) && ainfo.lib == lib && !strcmp(ainfo.symbol, "sym3"));
+    TEST(libdylib_close(rlib));
+
+#ifdef __linux__
+    // reloading
+    void *rsym1 = NULL;
+    dylib_bind_entry reload_table[] = {
+        LIBDYLIB_BIND_ENTRY("sym1", rsym1),
+        LIBDYLIB_BIND_ENTRY_OPTIONAL("x", bx),
+    };
+    dylib_reloadable reloadable;
+    TEST(replace_file(lib_path, "./reload-test.so"));
+    TEST(reloadable = libdylib_reloadable_open("./reload-test.so", 0, reload_table, 2));
+    TEST(libdylib_reloadable_generation(reloadable) == 1);
+    TEST(rsym1 && !bx);
+    TEST(libdylib_reloadable_fd(reloadable) >= 0);
+    TEST(libdylib_reloadable_poll(reloadable) == 0);
+    libdylib_reader_enter();
+    void *old_sym1 = rsym1;
+    TEST(libdylib_reloadable_symbols(reloadable)[0] == rsym1);
+    TEST(libdylib_lookup(libdylib_reloadable_get(reloadable), "sym1") == rsym1);
+    TEST(!libdylib_close(libdylib_reloadable_get(reloadable)));
+    TEST(replace_file(lib_path, "./reload-test.so"));
+    TEST(libdylib_reloadable_poll(reloadable) == 1);
+    TEST(libdylib_reloadable_generation(reloadable) == 2);
+    TEST(rsym1 && rsym1 != old_sym1);
+    TEST(libdylib_reloadable_symbols(reloadable)[0] == rsym1);
+    // the previous version stays loaded until the reader section ends
+    TEST(dladdr(old_sym1, &libc_info));
+    libdylib_reader_exit();
+    // the loader would return the current version again
+    TEST(!libdylib_reloadable_reload(reloadable));
+    TEST(libdylib_reloadable_generation(reloadable) == 2 && rsym1);
+    TEST(replace_file("./libptestlib.so", "./reload-test.so"));
+    TEST(libdylib_reloadable_poll(reloadable) == 1);
+    TEST(replace_file("./libptestlib.so", "./reload-test.so"));
+    TEST(libdylib_reloadable_poll(reloadable) == 1 && libdylib_reloadable_generation(reloadable) == 4);
+    libdylib_reloadable_free(reloadable);
+    // versions that stay loaded are never published again as a new version
+    void *kept_syms[3];
+    TEST(replace_file(lib_path, "./reload-test.so"));
+    TEST(reloadable = libdylib_reloadable_open("./reload-test.so", LIBDYLIB_OPEN_NODELETE, reload_table, 2));
+    kept_syms[0] = rsym1;
+    TEST(replace_file(lib_path, "./reload-test.so"));
+    TEST(libdylib_reloadable_poll(reloadable) == 1);
+    kept_syms[1] = rsym1;
+    TEST(replace_file(lib_path, "./reload-test.so"));
+    TEST(libdylib_reloadable_poll(reloadable) == 1);
+    kept_syms[2] = rsym1;
+    TEST(kept_syms[1] != kept_syms[0] && kept_syms[2] != kept_syms[0] && kept_syms[2] != kept_syms[1]);
+    libdylib_reloadable_free(reloadable);
+    TEST(!libdylib_reloadable_open("./no-such-lib.so", 0, NULL, 0));
+    remove("./reload-test.so");
+
+    // persistent symbol offsets
+    void *psym1 = NULL, *preturns_1 = NULL, *pmissing = NULL, *psym2 = NULL;
+    dylib_bind_entry persist_table[] = {
+        LIBDYLIB_BIND_ENTRY("sym1", psym1),
+        LIBDYLIB_BIND_ENTRY_OPTIONAL("missing_symbol", pmissing),
+        LIBDYLIB_BIND_ENTRY("returns_1", preturns_1),
+        LIBDYLIB_BIND_ENTRY("sym2", psym2),
+    };
+    mkdir("./persist-test", 0755);
+    clobber_files("./persist-test", true);
+    TEST(libdylib_set_persist_dir("./persist-test"));
+    TEST(rlib = libdylib_open_ex("./libptestlib.so", LIBDYLIB_OPEN_PERSIST));
+    TEST(libdylib_get_stats(rlib, &before));
+    TEST(libdylib_bind_table(rlib, persist_table, 3));
+    TEST(libdylib_get_stats(rlib, &stats) && stats.persist_writes == before.persist_writes + 1);
+    TEST(stats.persist_hits == before.persist_hits);
+    TEST(psym1 == libdylib_lookup(rlib, "sym1") && preturns_1 == libdylib_lookup(rlib, "returns_1") && !pmissing);
+    TEST(clobber_files("./persist-test", false) == 1);
+    // a stale file is rebuilt
+    psym1 = preturns_1 = NULL;
+    TEST(libdylib_get_stats(rlib, &before) && libdylib_bind_table(rlib, persist_table, 3));
+    TEST(libdylib_get_stats(rlib, &stats) && stats.persist_writes == before.persist_writes + 1);
+    TEST(psym1 == libdylib_lookup(rlib, "sym1") && preturns_1 == libdylib_lookup(rlib, "returns_1"));
+    psym1 = preturns_1 = NULL;
+    TEST(libdylib_get_stats(rlib, &before) && libdylib_bind_table(rlib, persist_table, 3));
+    TEST(libdylib_get_stats(rlib, &stats) && stats.persist_writes == before.persist_writes);
+    TEST(stats.persist_hits == before.persist_hits + 2 && stats.lookups == before.lookups + 1);
+    TEST(psym1 == libdylib_lookup(rlib, "sym1") && preturns_1 == libdylib_lookup(rlib, "returns_1") && !pmissing);
+    // symbols that are not in the file are added to it
+    TEST(libdylib_get_stats(rlib, &before) && libdylib_bind_table(rlib, persist_table, 4));
+    TEST(libdylib_get_stats(rlib, &stats) && stats.persist_writes == before.persist_writes + 1);
+    TEST(libdylib_bind_table(rlib, persist_table, 4) && libdylib_get_stats(rlib, &stats));
+    TEST(stats.persist_hits == before.persist_hits + 5 && psym2 == libdylib_lookup(rlib, "sym2"));
+    pmissing = &pmissing;
+    TEST(libdylib_bind_table(rlib, persist_table + 1, 1) && !pmissing);
+    // a damaged file is rebuilt instead of being trusted
+    TEST(damage_files("./persist-test") == 1);
+    psym1 = preturns_1 = psym2 = NULL;
+    TEST(libdylib_get_stats(rlib, &before) && libdylib_bind_table(rlib, persist_table, 4));
+    TEST(libdylib_get_stats(rlib, &stats) && stats.persist_writes == before.persist_writes + 1);
+    TEST(stats.persist_hits == before.persist_hits && psym2 == libdylib_lookup(rlib, "sym2"));
+    TEST(psym1 == libdylib_lookup(rlib, "sym1") && preturns_1 == libdylib_lookup(rlib, "returns_1"));
+    TEST(libdylib_close(rlib));
+    TEST(libdylib_set_persist_dir(NULL));
+    clobber_files("./persist-test", true);
+    rmdir("./persist-test");
+#endif
 }
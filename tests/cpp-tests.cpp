@@ -1,11 +1,19 @@
 #include "libdylibxx.h"
+#include <vector>
 #include "test.inc.h"
 
 using namespace libdylib;
 
+#ifdef LIBDYLIBXX_CXX11
+// a lazy call into lazy_lib, which is opened by run_tests()
+dylib lazy_lib;
+DYLIB_LAZY(lazy_lib, returns_0, int());
+#endif
+
 void run_tests()
 {
     TEST(!libdylib::last_error());
+    libdylib::set_stats_enabled(true);
 
     dylib lib(lib_path);
     TEST(lib.is_open());
@@ -24,6 +32,46 @@ void run_tests()
     TEST(lib.close());
     TEST(!lib.open_list("foo", "foo", "bar", "baz", "", NULL));
 
+#ifdef __linux__
+    std::vector<char> image;
+    FILE *image_file = fopen(lib_path, "rb");
+    char image_buf[4096];
+    size_t image_read;
+    while (image_file && (image_read = fread(image_buf, 1, sizeof(image_buf), image_file)) > 0)
+        image.insert(image.end(), image_buf, image_buf + image_read);
+    if (image_file)
+        fclose(image_file);
+    dylib mlib;
+    TEST(mlib.open_memory(&image[0], image.size(), "testlib-memory"));
+    TEST(!mlib.open_memory(&image[0], image.size(), "testlib-memory"));
+    TEST(mlib.find("sym1"));
+    TEST(mlib.close());
+#endif
+
+    dylib_set set;
+    dylib set_lib(lib_path);
+    TEST(set.open(lib_path));
+    TEST(!set.open("foo"));
+    TEST(set.add(set_lib));
+    TEST(!set_lib.is_open());
+    TEST(!set.add(set_lib));
+    TEST(set.size() == 2 && set[0] == set[1]);
+    TEST(set.close_all());
+    TEST(set.size() == 0 && set.close_all());
+
+#ifdef __GLIBC__
+    dylib nlib;
+    TEST(nlib.open_namespace(lib_path, LIBDYLIB_NAMESPACE_NEW));
+    TEST(nlib.get_namespace() != LIBDYLIB_NAMESPACE_BASE);
+    TEST(nlib.lookup("sym1") && nlib.lookup("sym1") != lib.lookup("sym1"));
+    TEST(nlib.close());
+    instance_pool pool(lib_path, 2);
+    TEST(pool.is_valid() && pool.size() == 2);
+    TEST(pool[0] != pool[1] && pool.next() == pool[0] && pool.next() == pool[1]);
+    instance_pool bad_pool("foo", 2);
+    TEST(!bad_pool.is_valid() && bad_pool.size() == 0);
+#endif
+
     dylib plib(plib_path, true);
     TEST(plib.is_open());
     TEST(dylib(lib_path, true).is_open());
@@ -73,4 +121,198 @@ void run_tests()
         TEST(handle && !*handle);
     }
 
+    {
+        size_t hits = 1, misses = 1;
+        dylib clib(lib_path, false, LIBDYLIB_OPEN_CACHE);
+        TEST(clib.get_cache_stats(hits, misses) && hits == 0 && misses == 0);
+        TEST(clib.lookup("sym1") && clib.lookup("sym1") == clib.lookup("sym1"));
+        TEST(!clib.find("x") && !clib.find("x"));
+        TEST(clib.get_cache_stats(hits, misses) && hits == 3 && misses == 2);
+        TEST(lib.get_cache_stats(hits, misses) && hits == 3); // same library as clib
+        dylib_stats stats;
+        TEST(clib.get_stats(stats) && stats.cache_hits == 3 && stats.lookups >= 5 && stats.lookup_misses >= 2);
+        dylib_addr_info info;
+        TEST(clib.addr_to_symbol(clib.lookup("sym1"), info) && !strcmp(info.symbol, "sym1"));
+        TEST(clib.lookup_first(NULL, "sym1_v2", "sym1", NULL) == clib.lookup("sym1"));
+        TEST(clib.lookup_versioned("sym1", NULL) == clib.lookup("sym1"));
+    }
+
+    {
+        void *bsym1 = NULL, *bx = &lib, *by = &lib;
+        returns_0 = NULL;
+        dylib_bind_entry table[] = {
+            bind_entry("sym1", bsym1),
+            DYLIB_BIND_ENTRY_NAME(returns_0),
+            bind_entry("x", bx, true),
+        };
+        TEST(lib.bind_table(table));
+        TEST(bsym1 == lib.lookup("sym1") && returns_0 && returns_0() == 0 && !bx);
+        dylib_bind_entry bad_table[] = {
+            bind_entry("y", by),
+            bind_entry("sym2", bsym1),
+        };
+        TEST(!lib.bind_table(bad_table, 2));
+        TEST(!by && bsym1 && strstr(libdylib::last_error(), "y"));
+        TEST(libdylib::last_error_code() == LIBDYLIB_E_NOT_FOUND);
+    }
+
+    {
+        int found = 0;
+        symbol_range syms(lib_path);
+        TEST(syms.is_open());
+        for (symbol_range::iterator it = syms.begin(); it != syms.end(); ++it)
+        {
+            if (std::string(it->name) == "returns_1" && (*it).type == LIBDYLIB_SYMTYPE_FUNC)
+                ++found;
+        }
+        for (symbol_range::iterator it = syms.begin(); it != syms.end(); ++it)
+        {
+            if (std::string(it->name) == "returns_1")
+                ++found;
+        }
+        TEST(found == 2);
+        TEST(!symbol_range("foo").is_open());
+    }
+
+    {
+        dependency_graph deps("/proc/self/exe");
+        TEST(deps.is_valid() && deps.size() >= 2);
+        TEST(deps[0].depth == 0 && deps[1].depth == 1 && deps[1].parent == 0);
+        std::string report = deps.report();
+        TEST(report.size() == libdylib::deps_report(deps.get_handle(), NULL, 0));
+        TEST(report.find(deps[1].name) != std::string::npos);
+        TEST(!dependency_graph("foo").is_valid());
+    }
+
+    {
+        dylib a(lib_path), b(lib_path);
+        TEST(a.get_handle() == b.get_handle());
+        TEST(a.close());
+        TEST(b.find("sym1"));
+        TEST(b.close());
+    }
+
+    {
+        libdylib::search_path sp;
+        TEST(sp.add_dir(std::string(".")));
+        dylib a, b;
+        TEST(a.open_search(sp, "ptestlib"));
+        TEST(!b.open_search(sp, "foo"));
+        sp.invalidate();
+        TEST(!b.open_search(sp, "foo"));
+    }
+
+    {
+        dylib a(lib_path, false, LIBDYLIB_OPEN_NOLOAD), b;
+        TEST(a.is_open());
+        TEST(b.open_list_ex(LIBDYLIB_OPEN_LAZY, "foo", lib_path, NULL));
+        TEST(a.get_handle() == b.get_handle());
+    }
+
+    {
+        dylib a(lib_path), b("./libptestlib.so");
+        libdylib::scope sc;
+        dylib_ref in_lib = NULL;
+        TEST(sc.add(a) && sc.insert(0, b) && sc.size() == 2);
+        TEST(sc.get<int()>("returns_1") == b.lookup("returns_1"));
+        TEST(sc.lookup("sym1", &in_lib) && in_lib == b.get_handle());
+        TEST(sc.remove(b) && sc.lookup("sym1") == a.lookup("sym1"));
+    }
+
+    {
+        libdylib::open_task task(lib_path), missing("foo");
+        dylib a, b;
+        TEST(task.get(a));
+        TEST(task.ready());
+        TEST(!task.get(a));
+        TEST(a.find("sym1"));
+        TEST(!missing.get(b));
+        TEST(libdylib::last_error_code() == LIBDYLIB_E_OPEN_FAILED);
+    }
+
+#ifdef LIBDYLIB_UNIX
+    {
+        int (*reload_returns_1)() = NULL;
+        dylib_bind_entry table[] = {libdylib::bind_entry("returns_1", reload_returns_1)};
+        libdylib::reloadable r(lib_path, 0, table, 1);
+        TEST(r.is_valid() && r.generation() == 1);
+        libdylib::reader_section section;
+        TEST(reload_returns_1 && reload_returns_1() == 1);
+        TEST(r.get<int()>(0) == reload_returns_1);
+        TEST(r.poll() == 0);
+    }
+#endif
+
+#ifdef LIBDYLIBXX_CXX11
+    {
+        constexpr libdylib::symbol<int()> returns_1_sym("returns_1");
+        constexpr libdylib::symbol<void()> missing_sym("missing");
+        static_assert(libdylib::static_hash_symbol("a") == 5381 * 33 + 'a', "hash must be computed at compile time");
+        TEST(returns_1_sym.hash() == libdylib::hash_symbol("returns_1"));
+        dylib a(lib_path, false, LIBDYLIB_OPEN_CACHE), b(lib_path, false, LIBDYLIB_OPEN_ELF_LOOKUP);
+        int (*r1)() = NULL;
+        TEST(a.bind(returns_1_sym, r1) && r1() == 1);
+        TEST(b.get(returns_1_sym) == r1);
+        TEST(b.get(DYLIB_SYMBOL(returns_0, int())) && b.get(DYLIB_SYMBOL(returns_0, int()))() == 0);
+        TEST(!a.get(missing_sym));
+
+        // a typed interface, bound in one pass
+        struct {
+            int (*returns_0)();
+            int (*returns_1)();
+            void (*missing)();
+        } api;
+        const dylib_bind_entry entries[] = {
+            DYLIB_SYMBOL(returns_0, int()).entry(api.returns_0),
+            returns_1_sym.entry(api.returns_1),
+            missing_sym.entry(api.missing, true),
+        };
+        TEST(a.bind_table(entries));
+        TEST(api.returns_0() == 0 && api.returns_1() == 1 && !api.missing);
+    }
+
+    {
+        // returns_0 is a local in this function
+        TEST(lazy_lib.open(lib_path));
+        TEST(!::returns_0.is_resolved());
+        TEST(::returns_0() == 0 && ::returns_0.is_resolved());
+        TEST((void*)::returns_0.get() == lazy_lib.lookup("returns_0"));
+        ::returns_0.reset();
+        TEST(!::returns_0.is_resolved() && ::returns_0() == 0);
+        TEST(lazy_lib.close());
+    }
+#endif
+
+    {
+        libdylib::symbol_ptr<int()> p1, p2;
+        {
+            dylib a("./libptestlib.so");
+            p1 = a.get_ptr<int()>("returns_1");
+            TEST(p1.is_valid() && p1.get_library() == a.get_handle());
+            TEST(!a.get_ptr<int()>("missing").is_valid());
+        }
+        // the library stays open as long as a symbol_ptr uses it
+        TEST(p1.is_valid() && (*p1)() == 1);
+        p2 = p1;
+        p1.reset();
+        TEST(!p1.is_valid());
+        TEST(p2.get()() == 1);
+        dylib b("./libptestlib.so", false, LIBDYLIB_OPEN_NOLOAD);
+        TEST(b.is_open());
+        p2.reset();
+        TEST(b.close());
+    }
+#ifdef LIBDYLIBXX_CXX11
+    {
+        dylib a(lib_path);
+        dylib_ref ref = a.get_handle();
+        dylib b(std::move(a));
+        TEST(!a.is_open() && b.get_handle() == ref);
+        a = std::move(b);
+        TEST(a.get_handle() == ref && !b.is_open());
+        constexpr libdylib::symbol<int()> returns_0_sym("returns_0");
+        std::vector<libdylib::symbol_ptr<int()>> ptrs(4, a.get_ptr(returns_0_sym));
+        TEST(ptrs[3] && ptrs[3]() == 0);
+    }
+#endif
 }
@@ -4,3 +4,7 @@ void sym3() {};
 
 int returns_0() { return 0; }
 int returns_1() { return 1; }
+
+#ifdef __linux__
+__thread int tls1;
+#endif